@@ -0,0 +1,351 @@
+/**
+ * @file
+ * CoAP DTLS to plain CoAP proxy, for the controller.
+ *
+ * node-red-contrib-coap doesn't do DTLS, so sensors with a coaps:// URI talk
+ * to this instead. It listens for DTLS with a pre-shared key, and passes
+ * every PUT it gets on to NodeRED over plain CoAP on localhost, with the same
+ * path, options and payload. NodeRED's reply goes back the same way.
+ *
+ * Every sensor uses the same key; the station name is the PSK identity.
+ *
+ * Sessions are cached by the DTLS library, so a sensor can resume its session
+ * after a deep sleep with an abbreviated handshake, until this is restarted.
+ *
+ * Build it with:
+ *
+ *     gcc -O2 -Wall -o dtls_proxy dtls_proxy.c \
+ *         $(pkg-config --cflags --libs libcoap-2-openssl)
+ *
+ * and see instructions.md for running it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+
+#include <coap2/coap.h>
+
+/** Longest key we accept, in bytes. */
+#define MAX_KEY_LEN 64
+
+/** How long to wait for NodeRED to reply, in ms. */
+#define UPSTREAM_TIMEOUT_MS 5000
+
+/** Defaults for the command line options. */
+#define DEFAULT_LISTEN_PORT "5684"
+#define DEFAULT_UPSTREAM_HOST "127.0.0.1"
+#define DEFAULT_UPSTREAM_PORT "5683"
+
+/** Context and session for talking to NodeRED. */
+static coap_context_t *upstream_ctx = NULL;
+static coap_session_t *upstream_session = NULL;
+
+/** The reply from NodeRED to the request in flight, if it's come in. */
+static int reply_ready = 0;
+static uint8_t reply_code;
+static uint8_t reply_data[COAP_DEFAULT_MAX_PDU_RX_SIZE];
+static size_t reply_length;
+
+/** Message ID of the request in flight. */
+static coap_tid_t upstream_tid;
+
+/**
+ * Print usage and exit.
+ *
+ * @param program [in] Our name.
+ */
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s -k <hex key> [-p <port>] [-u <host>] [-U <port>]\n"
+            "\n"
+            "  -k  DTLS pre-shared key, as set on the sensors with\n"
+            "      \"config set psk\".\n"
+            "  -p  Port to listen on for DTLS (default " DEFAULT_LISTEN_PORT
+            ").\n"
+            "  -u  Host NodeRED listens on (default " DEFAULT_UPSTREAM_HOST
+            ").\n"
+            "  -U  Port NodeRED listens on (default " DEFAULT_UPSTREAM_PORT
+            ").\n",
+            program);
+    exit(1);
+}
+
+/**
+ * Parse a hex key.
+ *
+ * @param hex    [in]  The key, as hex digits.
+ * @param key    [out] The key. Must be MAX_KEY_LEN long.
+ * @param length [out] Its length.
+ *
+ * @return 1 on success.
+ * @return 0 on failure.
+ */
+static int parse_key(const char *hex, uint8_t *key, size_t *length)
+{
+    size_t digits = strlen(hex);
+    unsigned int byte;
+    size_t i;
+
+    if (digits == 0 || digits % 2 != 0 || digits / 2 > MAX_KEY_LEN ||
+        strspn(hex, "0123456789abcdefABCDEF") != digits) {
+        return 0;
+    }
+
+    for (i = 0; i < digits / 2; ++i) {
+        sscanf(hex + i * 2, "%2x", &byte);
+        key[i] = (uint8_t)byte;
+    }
+
+    *length = digits / 2;
+    return 1;
+}
+
+/**
+ * Resolve a host and port.
+ *
+ * @param host    [in]  The host.
+ * @param port    [in]  The port.
+ * @param address [out] The address.
+ *
+ * @return 1 on success.
+ * @return 0 on failure.
+ */
+static int resolve(const char *host, const char *port, coap_address_t *address)
+{
+    struct addrinfo hints;
+    struct addrinfo *result;
+    int error;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    error = getaddrinfo(host, port, &hints, &result);
+    if (error != 0) {
+        fprintf(stderr, "Can't resolve %s:%s: %s\n", host, port,
+                gai_strerror(error));
+        return 0;
+    }
+
+    coap_address_init(address);
+    address->size = result->ai_addrlen;
+    memcpy(&address->addr, result->ai_addr, result->ai_addrlen);
+
+    freeaddrinfo(result);
+    return 1;
+}
+
+/**
+ * Handle a reply from NodeRED.
+ *
+ * @param ctx      [in] Upstream context.
+ * @param session  [in] Upstream session.
+ * @param sent     [in] What we sent, if libcoap still has it.
+ * @param received [in] The reply.
+ * @param id       [in] Its message ID.
+ */
+static void upstream_reply(coap_context_t *ctx, coap_session_t *session,
+                           coap_pdu_t *sent, coap_pdu_t *received,
+                           const coap_tid_t id)
+{
+    size_t length;
+    uint8_t *data;
+
+    // An empty ACK just means the reply is coming separately.
+    if (received->code == 0) {
+        return;
+    }
+
+    // Separate replies have their own message ID, so this only checks
+    // piggybacked ones. Only one request is ever in flight anyway.
+    if (received->type == COAP_MESSAGE_ACK && id != upstream_tid) {
+        return;
+    }
+
+    reply_code = received->code;
+    reply_length = 0;
+    if (coap_get_data(received, &length, &data)) {
+        if (length > sizeof(reply_data)) {
+            length = sizeof(reply_data);
+        }
+        memcpy(reply_data, data, length);
+        reply_length = length;
+    }
+
+    reply_ready = 1;
+}
+
+/**
+ * Handle a PUT from a sensor, by passing it on to NodeRED and sending back
+ * what it says.
+ *
+ * @param ctx      [in]  Our context.
+ * @param resource [in]  The resource, which is the catch all one.
+ * @param session  [in]  The sensor's DTLS session.
+ * @param request  [in]  The request.
+ * @param token    [in]  Its token.
+ * @param query    [in]  Its query, if any.
+ * @param response [out] Our response.
+ */
+static void handle_put(coap_context_t *ctx, coap_resource_t *resource,
+                       coap_session_t *session, coap_pdu_t *request,
+                       coap_binary_t *token, coap_string_t *query,
+                       coap_pdu_t *response)
+{
+    coap_opt_iterator_t iterator;
+    coap_opt_t *option;
+    coap_pdu_t *forward;
+    size_t length;
+    uint8_t *data;
+    unsigned int waited = 0;
+    int result;
+
+    forward = coap_new_pdu(upstream_session);
+    if (forward == NULL) {
+        response->code = COAP_RESPONSE_CODE(500);
+        return;
+    }
+
+    forward->type = COAP_MESSAGE_CON;
+    forward->code = COAP_REQUEST_PUT;
+    forward->tid = coap_new_message_id(upstream_session);
+    upstream_tid = forward->tid;
+    coap_add_token(forward, request->token_length, request->token);
+
+    // Options come out in order, which is the order they have to go in.
+    coap_option_iterator_init(request, &iterator, COAP_OPT_ALL);
+    while ((option = coap_option_next(&iterator)) != NULL) {
+        coap_add_option(forward, iterator.type, coap_opt_length(option),
+                        coap_opt_value(option));
+    }
+
+    if (coap_get_data(request, &length, &data)) {
+        coap_add_data(forward, length, data);
+    }
+
+    reply_ready = 0;
+    if (coap_send(upstream_session, forward) == COAP_INVALID_TID) {
+        response->code = COAP_RESPONSE_CODE(502);
+        return;
+    }
+
+    while (!reply_ready && waited < UPSTREAM_TIMEOUT_MS) {
+        result = coap_run_once(upstream_ctx, UPSTREAM_TIMEOUT_MS - waited);
+        if (result < 0) {
+            break;
+        }
+        // It returns 0 if something came in straight away.
+        waited += result > 0 ? result : 1;
+    }
+
+    if (!reply_ready) {
+        fprintf(stderr, "No reply from NodeRED.\n");
+        response->code = COAP_RESPONSE_CODE(504);
+        return;
+    }
+
+    response->code = reply_code;
+    if (reply_length > 0) {
+        coap_add_data(response, reply_length, reply_data);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *listen_port = DEFAULT_LISTEN_PORT;
+    const char *upstream_host = DEFAULT_UPSTREAM_HOST;
+    const char *upstream_port = DEFAULT_UPSTREAM_PORT;
+    uint8_t key[MAX_KEY_LEN];
+    size_t key_length = 0;
+    coap_address_t listen_address;
+    coap_address_t upstream_address;
+    coap_context_t *ctx;
+    coap_resource_t *resource;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "k:p:u:U:")) != -1) {
+        switch (opt) {
+            case 'k':
+                if (!parse_key(optarg, key, &key_length)) {
+                    fprintf(stderr, "The key should be hex digits.\n");
+                    usage(argv[0]);
+                }
+                break;
+            case 'p':
+                listen_port = optarg;
+                break;
+            case 'u':
+                upstream_host = optarg;
+                break;
+            case 'U':
+                upstream_port = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (key_length == 0) {
+        usage(argv[0]);
+    }
+
+    coap_startup();
+
+    if (!coap_dtls_is_supported()) {
+        fprintf(stderr, "This libcoap was built without DTLS.\n");
+        return 1;
+    }
+
+    if (!resolve(NULL, listen_port, &listen_address) ||
+        !resolve(upstream_host, upstream_port, &upstream_address)) {
+        return 1;
+    }
+
+    ctx = coap_new_context(NULL);
+    upstream_ctx = coap_new_context(NULL);
+    if (ctx == NULL || upstream_ctx == NULL) {
+        fprintf(stderr, "Can't create a CoAP context.\n");
+        return 1;
+    }
+
+    if (!coap_context_set_psk(ctx, "", key, key_length) ||
+        coap_new_endpoint(ctx, &listen_address, COAP_PROTO_DTLS) == NULL) {
+        fprintf(stderr, "Can't listen for DTLS on port %s.\n", listen_port);
+        return 1;
+    }
+
+    upstream_session = coap_new_client_session(upstream_ctx, NULL,
+                                               &upstream_address,
+                                               COAP_PROTO_UDP);
+    if (upstream_session == NULL) {
+        fprintf(stderr, "Can't create a session to %s:%s.\n", upstream_host,
+                upstream_port);
+        return 1;
+    }
+    coap_register_response_handler(upstream_ctx, upstream_reply);
+
+    // Everything goes to NodeRED, whatever the path.
+    resource = coap_resource_unknown_init(handle_put);
+    coap_add_resource(ctx, resource);
+
+    printf("Proxying DTLS on port %s to %s:%s.\n", listen_port, upstream_host,
+           upstream_port);
+
+    while (1) {
+        if (coap_run_once(ctx, 0) < 0) {
+            break;
+        }
+    }
+
+    coap_session_release(upstream_session);
+    coap_free_context(upstream_ctx);
+    coap_free_context(ctx);
+    coap_cleanup();
+
+    return 0;
+}
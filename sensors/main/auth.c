@@ -0,0 +1,123 @@
+/**
+ * @file
+ * Per-report authentication, without DTLS.
+ *
+ * Each report carries a CoAP option with a sequence number and a truncated
+ * HMAC-SHA256 over it, the station name and the payload, keyed with a secret
+ * only this puck and the controller know. The controller checks the tag, and
+ * drops anything with a sequence number it's already seen from this puck, so
+ * reports can't be forged or replayed. Nothing is encrypted, but there's no
+ * handshake, so it costs one hash and a few bytes per report.
+ */
+
+#include <string.h>
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "mbedtls/md.h"
+
+#include "auth.h"
+#include "config_storage.h"
+#include "rtc_storage.h"
+
+static const char *TAG = "auth";
+
+#define NVS_AUTH_NAMESPACE "mc-auth"
+
+/** End of the last block of sequence numbers reserved. */
+#define NVS_SEQ_LIMIT_NAME "seq"
+
+/**
+ * Reserve the next block of sequence numbers, by writing its end to NVS.
+ *
+ * @return true on success.
+ * @return false on failure.
+ */
+static bool reserve_seq(void)
+{
+    nvs_handle handle;
+    uint32_t stored = 0;
+    esp_err_t ret;
+
+    if (nvs_open(NVS_AUTH_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        ESP_LOGE(TAG, "Can't open NVS to reserve sequence numbers.");
+        return false;
+    }
+
+    // After anything but deep sleep, RTC memory is zeroed, so carry on from
+    // where the last block reserved ended. Some numbers in it may never have
+    // been used, but they'd only have to be unique.
+    if (rtc_storage.auth_seq_limit == 0) {
+        ret = nvs_get_u32(handle, NVS_SEQ_LIMIT_NAME, &stored);
+        if (ret != ESP_OK && ret != ESP_ERR_NVS_NOT_FOUND) {
+            ESP_LOGE(TAG, "Can't read the sequence number: %s",
+                     esp_err_to_name(ret));
+            nvs_close(handle);
+            return false;
+        }
+        rtc_storage.auth_seq = stored;
+    }
+
+    ret = nvs_set_u32(handle, NVS_SEQ_LIMIT_NAME,
+                      rtc_storage.auth_seq + AUTH_SEQ_BLOCK);
+    if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Can't reserve sequence numbers: %s",
+                 esp_err_to_name(ret));
+        return false;
+    }
+
+    rtc_storage.auth_seq_limit = rtc_storage.auth_seq + AUTH_SEQ_BLOCK;
+    return true;
+}
+
+bool auth_sign(const char *payload, size_t length, uint8_t *option)
+{
+    mbedtls_md_context_t md;
+    uint8_t tag[32];
+    uint32_t seq;
+    int result;
+
+    if (!is_auth_key_set(&current_config)) {
+        return false;
+    }
+
+    if (rtc_storage.auth_seq >= rtc_storage.auth_seq_limit &&
+        !reserve_seq()) {
+        return false;
+    }
+
+    seq = ++rtc_storage.auth_seq;
+    option[0] = seq >> 24;
+    option[1] = (seq >> 16) & 0xFF;
+    option[2] = (seq >> 8) & 0xFF;
+    option[3] = seq & 0xFF;
+
+    mbedtls_md_init(&md);
+    result = mbedtls_md_setup(&md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                              1);
+    if (result == 0) {
+        mbedtls_md_hmac_starts(&md, current_config.auth_key,
+                               sizeof(current_config.auth_key));
+        mbedtls_md_hmac_update(&md, option, AUTH_SEQ_LEN);
+        mbedtls_md_hmac_update(&md,
+                               (const uint8_t *)current_config.station_name,
+                               strlen(current_config.station_name));
+        mbedtls_md_hmac_update(&md, (const uint8_t *)"\n", 1);
+        mbedtls_md_hmac_update(&md, (const uint8_t *)payload, length);
+        mbedtls_md_hmac_finish(&md, tag);
+    }
+    mbedtls_md_free(&md);
+
+    if (result != 0) {
+        ESP_LOGE(TAG, "mbedtls_md_setup returned -0x%04x", -result);
+        return false;
+    }
+
+    memcpy(option + AUTH_SEQ_LEN, tag, AUTH_TAG_LEN);
+    return true;
+}
@@ -0,0 +1,57 @@
+/**
+ * @file
+ * Header file for auth.c.
+ */
+
+#ifndef __AUTH_H_
+#define __AUTH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * CoAP option number for the authentication option. This is in the range
+ * RFC 7252 sets aside for experiments, and is elective and safe to forward,
+ * so servers and proxies which don't know it pass it on or ignore it.
+ */
+#define COAP_OPTION_AUTH 65000
+
+/** Length of the sequence number at the start of the option. */
+#define AUTH_SEQ_LEN 4
+
+/**
+ * Length of the HMAC-SHA256 tag after it, truncated. 8 bytes is the shortest
+ * RFC 2104 recommends, and forging one is still a 1 in 2^64 guess.
+ */
+#define AUTH_TAG_LEN 8
+
+/** Length of the option. */
+#define AUTH_OPTION_LEN (AUTH_SEQ_LEN + AUTH_TAG_LEN)
+
+/**
+ * How many sequence numbers to reserve in NVS at a time. Only the end of the
+ * reserved block is written to flash, once per block, and the next number is
+ * kept in RTC memory. After any reset but deep sleep, numbering starts from
+ * the end of the block, so it never goes backwards.
+ */
+#define AUTH_SEQ_BLOCK 1024
+
+/**
+ * Build the authentication option for a report, with the next sequence
+ * number.
+ *
+ * The tag is a truncated HMAC-SHA256, keyed with current_config.auth_key,
+ * over the sequence number, the station name, a newline, and the payload.
+ *
+ * @param payload [in]  The report.
+ * @param length  [in]  Its length.
+ * @param option  [out] The option value, AUTH_OPTION_LEN long.
+ *
+ * @return true if it was built.
+ * @return false if there's no key set, or the next sequence number couldn't
+ *         be reserved.
+ */
+bool auth_sign(const char *payload, size_t length, uint8_t *option);
+
+#endif // __AUTH_H_
@@ -0,0 +1,442 @@
+/**
+ * @file
+ * Store and forward for readings we couldn't deliver.
+ *
+ * Readings are kept in RTC memory first, because writing them to flash on
+ * every failed wake would wear it out. When that fills up, the whole lot is
+ * written to flash as one chunk, in a ring of BACKLOG_FLASH_CHUNKS.
+ *
+ * When we next get through to the controller, the oldest chunk from flash and
+ * everything in RTC memory go out with the current reading in one message, so
+ * catching up after an outage doesn't cost any more wakes.
+ *
+ * The WiFi task formats and commits the backlog while the temperature task
+ * adds to it, so it's all done under backlog_lock. That's held from
+ * backlog_format() until the send is over, so a reading can't be added, or
+ * the readings being sent spilled to flash, in the middle.
+ *
+ * Where the ring starts and how full it is lives in RTC memory, and also in
+ * flash, so what's there survives a cold boot. That's when it's most likely
+ * to be needed: the batteries running out, or being changed, while the
+ * controller is down.
+ */
+
+#include <stdio.h>
+#include <string.h> // for memcpy, memmove
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "backlog.h"
+#include "queues.h"
+#include "rtc_storage.h"
+#include "schedule.h"
+
+static const char *TAG = "backlog";
+
+#define NVS_BACKLOG_NAMESPACE "mc-backlog"
+
+/** Maximum length of a chunk key, including the NUL. */
+#define NVS_CHUNK_NAME_LEN 4
+
+/** Key for the ring's backlog_ring_t. */
+#define NVS_RING_NAME "ring"
+
+/** Arbitrary value marking a backlog_ring_t as written by us. */
+#define BACKLOG_RING_MAGIC 0x474C4B42
+
+/**
+ * Where the chunks are in flash, as kept there.
+ */
+typedef struct {
+    uint32_t magic;             /**< BACKLOG_RING_MAGIC. */
+    uint8_t head;               /**< Slot of the oldest chunk. */
+    uint8_t count;              /**< Number of chunks. */
+} backlog_ring_t;
+
+/** The flash chunk being sent, if any. */
+static backlog_entry_t sending_chunk[BACKLOG_RTC_LEN];
+
+/** Whether the last backlog_format() included a flash chunk. */
+static bool sent_flash_chunk = false;
+
+/** Number of RTC entries included in the last backlog_format(). */
+static int sent_rtc_entries = 0;
+
+/**
+ * Get the NVS key for a given chunk slot.
+ *
+ * @param slot   [in]  The slot.
+ * @param buffer [out] Buffer of at least NVS_CHUNK_NAME_LEN for the key.
+ */
+static void chunk_name(uint8_t slot, char *buffer)
+{
+    snprintf(buffer, NVS_CHUNK_NAME_LEN, "c%u", slot);
+}
+
+/**
+ * Read a chunk from flash.
+ *
+ * @param handle [in]  The backlog's NVS handle.
+ * @param slot   [in]  The chunk's slot.
+ * @param chunk  [out] BACKLOG_RTC_LEN entries to read it into.
+ *
+ * @return true on success.
+ * @return false on failure.
+ */
+static bool get_chunk(nvs_handle handle, uint8_t slot,
+                      backlog_entry_t *chunk)
+{
+    char name[NVS_CHUNK_NAME_LEN];
+    size_t length = BACKLOG_RTC_LEN * sizeof(*chunk);
+
+    chunk_name(slot, name);
+
+    return nvs_get_blob(handle, name, chunk, &length) == ESP_OK &&
+           length == BACKLOG_RTC_LEN * sizeof(*chunk);
+}
+
+/**
+ * Write a chunk to flash. This doesn't commit it.
+ *
+ * @param handle [in] The backlog's NVS handle, open for writing.
+ * @param slot   [in] The chunk's slot.
+ * @param chunk  [in] BACKLOG_RTC_LEN entries to write.
+ *
+ * @return true on success.
+ * @return false on failure.
+ */
+static bool set_chunk(nvs_handle handle, uint8_t slot,
+                      const backlog_entry_t *chunk)
+{
+    char name[NVS_CHUNK_NAME_LEN];
+
+    chunk_name(slot, name);
+
+    return nvs_set_blob(handle, name, chunk,
+                        BACKLOG_RTC_LEN * sizeof(*chunk)) == ESP_OK;
+}
+
+/**
+ * Set where the ring is in flash. This doesn't commit it.
+ *
+ * @param handle [in] The backlog's NVS handle, open for writing.
+ * @param head   [in] Slot of the oldest chunk.
+ * @param count  [in] Number of chunks.
+ *
+ * @return true on success.
+ * @return false on failure.
+ */
+static bool set_ring(nvs_handle handle, uint8_t head, uint8_t count)
+{
+    backlog_ring_t ring = {
+        .magic = BACKLOG_RING_MAGIC,
+        .head = head,
+        .count = count,
+    };
+
+    return nvs_set_blob(handle, NVS_RING_NAME, &ring, sizeof(ring)) == ESP_OK;
+}
+
+/**
+ * Write everything in RTC memory to flash as a new chunk.
+ *
+ * @return true on success.
+ * @return false on failure - in which case the readings are still in RTC
+ *         memory and the oldest of them will be overwritten.
+ */
+static bool spill_to_flash(void)
+{
+    nvs_handle handle;
+    uint8_t head = rtc_storage.backlog_flash_head;
+    uint8_t count = rtc_storage.backlog_flash_count;
+    uint8_t slot;
+    bool success = false;
+
+    slot = (head + count) % BACKLOG_FLASH_CHUNKS;
+
+    if (count < BACKLOG_FLASH_CHUNKS) {
+        ++count;
+    }
+    else {
+        // This overwrites the oldest one.
+        head = (head + 1) % BACKLOG_FLASH_CHUNKS;
+    }
+
+    if (nvs_open(NVS_BACKLOG_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK) {
+        if (set_chunk(handle, slot, rtc_storage.backlog) &&
+            set_ring(handle, head, count) &&
+            nvs_commit(handle) == ESP_OK) {
+            success = true;
+        }
+        nvs_close(handle);
+    }
+
+    if (!success) {
+        ESP_LOGE(TAG, "Failed to write backlog to flash.");
+    }
+    else {
+        if (head != rtc_storage.backlog_flash_head) {
+            ESP_LOGW(TAG, "Backlog full, dropped the oldest %d readings.",
+                     BACKLOG_RTC_LEN);
+        }
+        rtc_storage.backlog_flash_head = head;
+        rtc_storage.backlog_flash_count = count;
+        rtc_storage.backlog_count = 0;
+    }
+
+    return success;
+}
+
+/**
+ * Read the oldest chunk from flash into sending_chunk.
+ *
+ * @return true on success.
+ * @return false on failure.
+ */
+static bool read_oldest_chunk(void)
+{
+    nvs_handle handle;
+    bool success = false;
+
+    if (nvs_open(NVS_BACKLOG_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+        success = get_chunk(handle, rtc_storage.backlog_flash_head,
+                            sending_chunk);
+        nvs_close(handle);
+    }
+
+    return success;
+}
+
+/**
+ * Pick up the ring in flash after a cold boot.
+ *
+ * The sample times were by the clock from before, and there's no knowing how
+ * long we were off, so they're moved to end at the boot. The ages sent are
+ * then as old as we can be sure of, rather than nonsense.
+ *
+ * @param handle [in] The backlog's NVS handle, open for writing.
+ *
+ * @return true if what's in flash made sense, and has been picked up.
+ * @return false if it didn't, and should be cleared out.
+ */
+static bool recover_ring(nvs_handle handle)
+{
+    backlog_ring_t ring;
+    size_t length = sizeof(ring);
+    uint32_t shift_s;
+    uint8_t slot;
+    int chunk;
+    int i;
+
+    if (nvs_get_blob(handle, NVS_RING_NAME, &ring, &length) != ESP_OK ||
+        length != sizeof(ring) || ring.magic != BACKLOG_RING_MAGIC ||
+        ring.head >= BACKLOG_FLASH_CHUNKS ||
+        ring.count > BACKLOG_FLASH_CHUNKS) {
+        return false;
+    }
+
+    if (ring.count == 0) {
+        return true;
+    }
+
+    // The newest reading is the last in the newest chunk.
+    slot = (ring.head + ring.count - 1) % BACKLOG_FLASH_CHUNKS;
+    if (!get_chunk(handle, slot, sending_chunk)) {
+        return false;
+    }
+    shift_s = sending_chunk[BACKLOG_RTC_LEN - 1].sample_time_s -
+              schedule_clock_s();
+
+    for (chunk = 0; chunk < ring.count; ++chunk) {
+        slot = (ring.head + chunk) % BACKLOG_FLASH_CHUNKS;
+        if (!get_chunk(handle, slot, sending_chunk)) {
+            return false;
+        }
+
+        // This can wrap, which is fine, because the ages are worked out
+        // the same way.
+        for (i = 0; i < BACKLOG_RTC_LEN; ++i) {
+            sending_chunk[i].sample_time_s -= shift_s;
+        }
+
+        if (!set_chunk(handle, slot, sending_chunk)) {
+            return false;
+        }
+    }
+
+    if (nvs_commit(handle) != ESP_OK) {
+        return false;
+    }
+
+    rtc_storage.backlog_flash_head = ring.head;
+    rtc_storage.backlog_flash_count = ring.count;
+    ESP_LOGW(TAG, "Kept %u undelivered readings from before the reset.",
+             ring.count * BACKLOG_RTC_LEN);
+
+    return true;
+}
+
+/**
+ * Format one entry onto the end of a buffer.
+ *
+ * @param entry   [in]     The entry.
+ * @param now_s   [in]     The current time, for the age.
+ * @param buffer  [in,out] The buffer; the entry is appended to what's there.
+ * @param length  [in]     Total size of the buffer.
+ * @param celsius [in]     true for Celsius, false for Farenheit.
+ */
+static void format_entry(const backlog_entry_t *entry, uint32_t now_s,
+                         char *buffer, size_t length, bool celsius)
+{
+    char temperature[MAX_TEMPERATURE_STR_LEN];
+    size_t used = strlen(buffer);
+
+    format_temperature(temperature, sizeof(temperature), entry->temperature,
+                       celsius);
+    snprintf(buffer + used, length - used, "\n%u %s",
+             now_s - entry->sample_time_s, temperature);
+}
+
+void backlog_init(bool rtc_valid)
+{
+    nvs_handle handle;
+
+    if (!rtc_valid) {
+        // The RTC storage was zeroed, so find out what's in flash from the
+        // ring kept there. If that doesn't add up, clear it out rather than
+        // leave it orphaned.
+        if (nvs_open(NVS_BACKLOG_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK) {
+            if (!recover_ring(handle)) {
+                ESP_LOGW(TAG, "No usable backlog in flash, clearing it.");
+                rtc_storage.backlog_flash_head = 0;
+                rtc_storage.backlog_flash_count = 0;
+                if (nvs_erase_all(handle) == ESP_OK) {
+                    nvs_commit(handle);
+                }
+            }
+            nvs_close(handle);
+        }
+    }
+}
+
+/**
+ * @return the number of undelivered readings. Only call this with
+ *         backlog_lock held.
+ */
+static uint32_t count(void)
+{
+    return rtc_storage.backlog_flash_count * BACKLOG_RTC_LEN +
+           rtc_storage.backlog_count;
+}
+
+void backlog_push(int16_t temperature)
+{
+    xSemaphoreTake(backlog_lock, portMAX_DELAY);
+
+    if (rtc_storage.backlog_count == BACKLOG_RTC_LEN && !spill_to_flash()) {
+        // Make room by dropping the oldest.
+        memmove(&rtc_storage.backlog[0], &rtc_storage.backlog[1],
+                sizeof(rtc_storage.backlog) - sizeof(rtc_storage.backlog[0]));
+        --rtc_storage.backlog_count;
+    }
+
+    rtc_storage.backlog[rtc_storage.backlog_count].sample_time_s =
+        schedule_clock_s();
+    rtc_storage.backlog[rtc_storage.backlog_count].temperature = temperature;
+    ++rtc_storage.backlog_count;
+
+    ESP_LOGW(TAG, "Keeping reading for later, %u undelivered.", count());
+
+    xSemaphoreGive(backlog_lock);
+}
+
+int backlog_format(char *buffer, size_t length, bool celsius)
+{
+    uint32_t now_s = schedule_clock_s();
+    int i;
+
+    // Given back by backlog_commit() or backlog_release().
+    xSemaphoreTake(backlog_lock, portMAX_DELAY);
+
+    buffer[0] = '\0';
+    sent_flash_chunk = false;
+    sent_rtc_entries = 0;
+
+    // Oldest first.
+    if (rtc_storage.backlog_flash_count > 0) {
+        if (read_oldest_chunk()) {
+            for (i = 0; i < BACKLOG_RTC_LEN; ++i) {
+                format_entry(&sending_chunk[i], now_s, buffer, length,
+                             celsius);
+            }
+            sent_flash_chunk = true;
+        }
+        else {
+            ESP_LOGE(TAG, "Failed to read backlog from flash.");
+        }
+    }
+
+    for (i = 0; i < rtc_storage.backlog_count; ++i) {
+        format_entry(&rtc_storage.backlog[i], now_s, buffer, length, celsius);
+    }
+    sent_rtc_entries = rtc_storage.backlog_count;
+
+    return (sent_flash_chunk ? BACKLOG_RTC_LEN : 0) + sent_rtc_entries;
+}
+
+void backlog_commit(void)
+{
+    nvs_handle handle;
+    char name[NVS_CHUNK_NAME_LEN];
+
+    if (sent_flash_chunk) {
+        chunk_name(rtc_storage.backlog_flash_head, name);
+        rtc_storage.backlog_flash_head =
+            (rtc_storage.backlog_flash_head + 1) % BACKLOG_FLASH_CHUNKS;
+        --rtc_storage.backlog_flash_count;
+        sent_flash_chunk = false;
+
+        // If this fails, the chunk is sent again after a cold boot, which
+        // is better than losing any.
+        if (nvs_open(NVS_BACKLOG_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK) {
+            if (set_ring(handle, rtc_storage.backlog_flash_head,
+                         rtc_storage.backlog_flash_count) &&
+                nvs_erase_key(handle, name) == ESP_OK) {
+                nvs_commit(handle);
+            }
+            nvs_close(handle);
+        }
+    }
+
+    if (sent_rtc_entries > 0) {
+        memmove(&rtc_storage.backlog[0],
+                &rtc_storage.backlog[sent_rtc_entries],
+                (rtc_storage.backlog_count - sent_rtc_entries) *
+                    sizeof(rtc_storage.backlog[0]));
+        rtc_storage.backlog_count -= sent_rtc_entries;
+        sent_rtc_entries = 0;
+    }
+
+    xSemaphoreGive(backlog_lock);
+}
+
+void backlog_release(void)
+{
+    sent_flash_chunk = false;
+    sent_rtc_entries = 0;
+
+    xSemaphoreGive(backlog_lock);
+}
+
+uint32_t backlog_count(void)
+{
+    uint32_t result;
+
+    xSemaphoreTake(backlog_lock, portMAX_DELAY);
+    result = count();
+    xSemaphoreGive(backlog_lock);
+
+    return result;
+}
@@ -0,0 +1,106 @@
+/**
+ * @file
+ * Header file for backlog.c.
+ */
+
+#ifndef __BACKLOG_H_
+#define __BACKLOG_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "temperature.h"
+
+/**
+ * Number of readings kept in RTC memory. When this fills up, they're all
+ * written to flash as one chunk, so this is also the chunk size.
+ */
+#define BACKLOG_RTC_LEN 16
+
+/**
+ * Number of chunks kept in flash. Once this is full, the oldest chunk is
+ * overwritten. With the defaults, this is about a day of readings at the
+ * default poll interval.
+ */
+#define BACKLOG_FLASH_CHUNKS 8
+
+/**
+ * Most readings we send in one message - everything in RTC memory, plus one
+ * chunk from flash.
+ */
+#define BACKLOG_MAX_SEND (2 * BACKLOG_RTC_LEN)
+
+/**
+ * Longest formatted backlog line: a newline, the age in seconds (up to 10
+ * digits), a space, and the temperature. This is one more than needed,
+ * because MAX_TEMPERATURE_STR_LEN includes the NUL.
+ */
+#define BACKLOG_LINE_LEN (1 + 10 + 1 + MAX_TEMPERATURE_STR_LEN)
+
+/**
+ * Longest formatted backlog, including the NUL.
+ */
+#define BACKLOG_MAX_STR_LEN (BACKLOG_MAX_SEND * BACKLOG_LINE_LEN + 1)
+
+/**
+ * A reading which we couldn't deliver.
+ */
+typedef struct {
+    uint32_t sample_time_s;     /**< schedule_clock_s() when it was taken. */
+    int16_t temperature;        /**< Temperature, in 1/16 degree C. */
+} backlog_entry_t;
+
+/**
+ * Set up the backlog after boot.
+ *
+ * After a cold boot, what's in flash is kept if it checks out. The sample
+ * times are only meaningful relative to the puck's clock, which restarts, so
+ * they're moved to end at the boot, and the ages sent are as old as we can be
+ * sure of.
+ *
+ * @param rtc_valid Whether RTC storage survived from the last wake.
+ */
+void backlog_init(bool rtc_valid);
+
+/**
+ * Keep a reading which we couldn't deliver.
+ *
+ * @param temperature The reading, in 1/16 degree C.
+ */
+void backlog_push(int16_t temperature);
+
+/**
+ * Format the oldest of the undelivered readings for sending.
+ *
+ * Each reading is a line of the form "\n<age> <temperature>", where age is
+ * how many seconds ago it was taken.
+ *
+ * @param buffer  [out] buffer to receive the string. Always NUL terminated.
+ * @param length  [in]  size of buffer; BACKLOG_MAX_STR_LEN is enough.
+ * @param celsius [in]  true for Celsius, false for Farenheit.
+ *
+ * @return the number of readings formatted.
+ *
+ * @note This locks the backlog until backlog_commit() or backlog_release(),
+ *       one of which has to follow it, on the same task.
+ */
+int backlog_format(char *buffer, size_t length, bool celsius);
+
+/**
+ * Forget the readings from the last backlog_format(), because the
+ * controller has them now, and unlock the backlog.
+ */
+void backlog_commit(void);
+
+/**
+ * Keep the readings from the last backlog_format(), because they didn't get
+ * through, and unlock the backlog.
+ */
+void backlog_release(void);
+
+/**
+ * @return the number of undelivered readings.
+ */
+uint32_t backlog_count(void);
+
+#endif // __BACKLOG_H_
@@ -14,6 +14,7 @@
 #include "config_storage.h"
 #include "console.h"
 #include "wifi.h"
+#include "schedule.h"
 
 static const char *TAG = "cmd_config";
 
@@ -32,10 +33,19 @@ static const char *TAG = "cmd_config";
 #define CONFIG_SET_NAME "name"
 #define CONFIG_SET_TEMP_UNIT "unit"
 #define CONFIG_SET_POLL_INTERVAL "polling"
+#define CONFIG_SET_HEARTBEAT "heartbeat"
+#define CONFIG_SET_ADAPTIVE "adaptive"
+#define CONFIG_SET_FAST_OFF "fast_off"
+#define CONFIG_SET_MAINS "mains"
+#define CONFIG_SET_RELAY "relay"
+#define CONFIG_SET_VIA "via"
+#define CONFIG_VIA_NONE "none"
+#define CONFIG_SET_RAW_COAP "raw_coap"
+#define CONFIG_SET_PSK "psk"
+#define CONFIG_SET_AUTH_KEY "auth_key"
+#define CONFIG_KEY_NONE "none"
 #define CONFIG_SET_URI "uri"
 
-config_storage_t new_config;
-
 static void register_config(void);
 
 void register_configure(void)
@@ -145,7 +155,67 @@ static void emit_config_items(config_storage_t *config)
         printf("\tTemp Unit:\tF\n");
     }
     printf("\tPolling:\t%us\n", config->poll_time_sec);
+    printf("\tHeartbeat:\tevery %u polls\n", config->heartbeat_polls);
+    printf("\tAdaptive Poll:\t");
+    if (config->adaptive_poll) {
+        printf("Yes");
+    }
+    else {
+        printf("No");
+    }
+    printf("\n");
+    printf("\tFast WiFi Off:\t");
+    if (config->fast_shutdown) {
+        printf("Yes");
+    }
+    else {
+        printf("No");
+    }
+    printf("\n");
+    printf("\tMains Powered:\t");
+    if (config->mains_powered) {
+        printf("Yes");
+    }
+    else {
+        printf("No");
+    }
+    printf("\n");
+    printf("\tRelay:\t\t");
+    if (config->espnow_relay) {
+        printf("Yes");
+    }
+    else {
+        printf("No");
+    }
+    printf("\n");
+    if (is_relay_set(config)) {
+        printf("\tReport Via:\t%02X:%02X:%02X:%02X:%02X:%02X\n",
+               config->relay_mac[0], config->relay_mac[1],
+               config->relay_mac[2], config->relay_mac[3],
+               config->relay_mac[4], config->relay_mac[5]);
+    }
+    else {
+        printf("\tReport Via:\tNot set\n");
+    }
+    printf("\tRaw CoAP:\t");
+    if (config->raw_coap) {
+        printf("Yes");
+    }
+    else {
+        printf("No");
+    }
+    printf("\n");
+    // Never print the key itself.
+    printf("\tPSK:\t\t%s\n", is_psk_set(config) ? "Set" : "Not set");
+    printf("\tAuth Key:\t%s\n",
+           is_auth_key_set(config) ? "Set" : "Not set");
     printf("\tURI:\t\t%s\n", config->uri);
+    if (config->config_hash == 0) {
+        printf("\tController:\tNot set\n");
+    }
+    else {
+        printf("\tController:\t%08x\n", config->config_hash);
+    }
 }
 
 /**
@@ -220,10 +290,82 @@ static void emit_set_help(void)
            "            (max %u).\n", UINT16_MAX);
     printf("        Note: this has battery implications. Lower values will\n"
            "        consume more battery, higher values will be less responsive.\n");
+    printf("    " CONFIG_SET_HEARTBEAT
+           " = report at least once every this many polls (max %u).\n"
+           "        In between, the sensor only wakes the radio if the\n"
+           "        temperature has moved by about a degree C since the last\n"
+           "        report (checked by the sensor itself, so it is cheap).\n"
+           "        1 reports on every poll. The sensor still reports at\n"
+           "        least every %us, however this is set, or the\n"
+           "        controller would think it dead.\n", UINT16_MAX,
+           HEARTBEAT_MAX_S);
+    printf("    " CONFIG_SET_ADAPTIVE
+           " = whether to adapt the polling interval (Y or N).\n"
+           "        If enabled, the sensor polls more often while the\n"
+           "        temperature is changing quickly or is near the zone's\n"
+           "        setpoint, down to %us, and up to %u times less often\n"
+           "        while it's stable, as long as that still reports at\n"
+           "        least every %us. The controller can also ask for a\n"
+           "        given interval in its reply.\n",
+           ADAPT_MIN_POLL_S, ADAPT_STABLE_MULTIPLIER, HEARTBEAT_MAX_S);
+    printf("    " CONFIG_SET_FAST_OFF
+           " = whether to skip shutting WiFi down gracefully (Y or N).\n"
+           "        If enabled, once the controller has accepted a report,\n"
+           "        the sensor just tells the AP it is leaving and goes to\n"
+           "        sleep, which turns the radio off anyway. \"wifi show\"\n"
+           "        shows how long each way took last time.\n");
+    printf("    " CONFIG_SET_MAINS
+           " = whether the sensor is on mains (USB) power (Y or N).\n"
+           "        If enabled, the sensor never deep sleeps. It stays\n"
+           "        connected, with the radio in modem sleep between\n"
+           "        reports, keeps its CoAP session open and reports every\n"
+           "        poll, so the polling interval can be well under a\n"
+           "        minute. It also serves /temperature, which the\n"
+           "        controller can observe instead, in which case it only\n"
+           "        reports for the heartbeat. Don't enable this on\n"
+           "        batteries.\n");
+    printf("    " CONFIG_SET_RELAY
+           " = whether to relay reports from other sensors (Y or N).\n"
+           "        Sensors which have this one as their \"" CONFIG_SET_VIA "\"\n"
+           "        send it their reports over ESP-NOW, and it passes\n"
+           "        them on to the controller. Only works on mains power.\n");
+    printf("    " CONFIG_SET_VIA
+           " = MAC of the relay to report through, or \"" CONFIG_VIA_NONE
+           "\".\n"
+           "        Battery sensors with this set send their reports to the\n"
+           "        relay over ESP-NOW, without connecting to the AP, which\n"
+           "        is much quicker. The relay's MAC is in \"wifi show\",\n"
+           "        and it has to be on the same channel as the AP, so\n"
+           "        " CONFIG_SET_CACHE_AP " must be on. The controller can't\n"
+           "        send anything back this way.\n");
+    printf("    " CONFIG_SET_RAW_COAP
+           " = whether to use the minimal CoAP sender (Y or N).\n"
+           "        If enabled, reports are sent from a prebuilt packet\n"
+           "        straight through lwIP, skipping libcoap's setup. This\n"
+           "        only works for coap:// URIs with an IP address for the\n"
+           "        host; anything else uses libcoap anyway. \"wifi show\"\n"
+           "        shows how long each way took last time.\n");
+    printf("    " CONFIG_SET_PSK
+           " = DTLS pre-shared key, as %d hex digits, or \"" CONFIG_KEY_NONE
+           "\".\n"
+           "        Needed for coaps:// URIs. The station name is the PSK\n"
+           "        identity, and the key has to match the one the DTLS\n"
+           "        proxy on the controller was started with.\n",
+           PSK_LEN * 2);
+    printf("    " CONFIG_SET_AUTH_KEY
+           " = report authentication key, as %d hex digits, or \""
+           CONFIG_KEY_NONE "\".\n"
+           "        If set, each report carries a sequence number and an\n"
+           "        HMAC, so the controller can tell it's really from this\n"
+           "        sensor and isn't a replay. Give each sensor its own key,\n"
+           "        and put the same one in the controller's AUTH_KEYS.\n",
+           AUTH_KEY_LEN * 2);
     printf("    " CONFIG_SET_URI
            " = URI (%d char max).\n"
            "        Note: This should be of the form:\n"
-           "              coap://host/url\n", MAX_URI_LEN);
+           "              coap://host/url\n"
+           "              or, with a " CONFIG_SET_PSK ", coaps://host/url\n",
+           MAX_URI_LEN);
     printf("\n");
 }
 
@@ -246,6 +388,35 @@ static void emit_config_help(void)
     emit_set_help();
 }
 
+/**
+ * Parse a key given as hex digits.
+ *
+ * @param hex    [in]  The key, as hex digits.
+ * @param key    [out] The key.
+ * @param length [in]  Its length, in bytes.
+ *
+ * @return true on success.
+ * @return false if it's the wrong length, or not hex.
+ */
+static bool parse_hex_key(const char *hex, uint8_t *key, size_t length)
+{
+    unsigned int byte;
+    size_t i;
+
+    if (strlen(hex) != length * 2 ||
+        strspn(hex, "0123456789abcdefABCDEF") != length * 2) {
+        return false;
+    }
+
+    // newlib nano doesn't do %hhx, so this has to go via an int.
+    for (i = 0; i < length; ++i) {
+        sscanf(hex + i * 2, "%2x", &byte);
+        key[i] = (uint8_t)byte;
+    }
+
+    return true;
+}
+
 /**
  * Handle our set command.
  *
@@ -263,6 +434,8 @@ static int handle_set(int argc, char **argv)
     int retval = 1;
     int temp;
     ip4_addr_t temp_ip;
+    unsigned int mac[MAC_ADDR_LEN];
+    char trailing;
 
     // at this point, argument should be like:
     //     config set ssid frobz
@@ -352,6 +525,167 @@ static int handle_set(int argc, char **argv)
                 retval = 0;
             }
         }
+        else if (strcmp(argv[2], CONFIG_SET_HEARTBEAT) == 0) {
+            temp = atoi(argv[3]);
+            if (temp > UINT16_MAX) {
+                printf("Error: heartbeat max is %u polls.\n", UINT16_MAX);
+            }
+            else if (temp < 1) {
+                printf("Error: heartbeat minimum is 1 poll.\n");
+            }
+            else {
+                new_config.heartbeat_polls = (uint16_t)temp;
+                retval = 0;
+
+                if ((uint32_t)temp * new_config.poll_time_sec >
+                    HEARTBEAT_MAX_S) {
+                    printf("Note: at this polling interval, that's more "
+                           "than %us, so it will report more often.\n",
+                           HEARTBEAT_MAX_S);
+                }
+            }
+        }
+        else if (strcmp(argv[2], CONFIG_SET_ADAPTIVE) == 0) {
+            if (strlen(argv[3]) != 1) {
+                printf("Error: adaptive setting should be 'Y' or 'N'.\n");
+            }
+            else {
+                if (argv[3][0] == 'Y') {
+                    new_config.adaptive_poll = true;
+                    retval = 0;
+                }
+                else if (argv[3][0] == 'N') {
+                    new_config.adaptive_poll = false;
+                    retval = 0;
+                }
+                else {
+                    printf("Error: adaptive setting should be 'Y' or 'N'.\n");
+                }
+            }
+        }
+        else if (strcmp(argv[2], CONFIG_SET_FAST_OFF) == 0) {
+            if (strlen(argv[3]) != 1) {
+                printf("Error: fast off setting should be 'Y' or 'N'.\n");
+            }
+            else {
+                if (argv[3][0] == 'Y') {
+                    new_config.fast_shutdown = true;
+                    retval = 0;
+                }
+                else if (argv[3][0] == 'N') {
+                    new_config.fast_shutdown = false;
+                    retval = 0;
+                }
+                else {
+                    printf("Error: fast off setting should be 'Y' or 'N'.\n");
+                }
+            }
+        }
+        else if (strcmp(argv[2], CONFIG_SET_MAINS) == 0) {
+            if (strlen(argv[3]) != 1) {
+                printf("Error: mains setting should be 'Y' or 'N'.\n");
+            }
+            else {
+                if (argv[3][0] == 'Y') {
+                    new_config.mains_powered = true;
+                    retval = 0;
+                }
+                else if (argv[3][0] == 'N') {
+                    new_config.mains_powered = false;
+                    retval = 0;
+                }
+                else {
+                    printf("Error: mains setting should be 'Y' or 'N'.\n");
+                }
+            }
+        }
+        else if (strcmp(argv[2], CONFIG_SET_RELAY) == 0) {
+            if (strlen(argv[3]) != 1) {
+                printf("Error: relay setting should be 'Y' or 'N'.\n");
+            }
+            else {
+                if (argv[3][0] == 'Y') {
+                    new_config.espnow_relay = true;
+                    retval = 0;
+                }
+                else if (argv[3][0] == 'N') {
+                    new_config.espnow_relay = false;
+                    retval = 0;
+                }
+                else {
+                    printf("Error: relay setting should be 'Y' or 'N'.\n");
+                }
+            }
+        }
+        else if (strcmp(argv[2], CONFIG_SET_VIA) == 0) {
+            if (strcmp(argv[3], CONFIG_VIA_NONE) == 0) {
+                memset(new_config.relay_mac, 0, sizeof(new_config.relay_mac));
+                retval = 0;
+            }
+            // newlib nano doesn't do %hhx, so this has to go via ints.
+            else if (sscanf(argv[3], "%x:%x:%x:%x:%x:%x%c", &mac[0], &mac[1],
+                            &mac[2], &mac[3], &mac[4], &mac[5],
+                            &trailing) != MAC_ADDR_LEN) {
+                printf("Error: via should be a MAC, like 12:34:56:78:9A:BC, "
+                       "or \"" CONFIG_VIA_NONE "\".\n");
+            }
+            else if (mac[0] > UINT8_MAX || mac[1] > UINT8_MAX ||
+                     mac[2] > UINT8_MAX || mac[3] > UINT8_MAX ||
+                     mac[4] > UINT8_MAX || mac[5] > UINT8_MAX) {
+                printf("Error: each part of the MAC should be 00 to FF.\n");
+            }
+            else {
+                for (temp = 0; temp < MAC_ADDR_LEN; ++temp) {
+                    new_config.relay_mac[temp] = (uint8_t)mac[temp];
+                }
+                retval = 0;
+            }
+        }
+        else if (strcmp(argv[2], CONFIG_SET_RAW_COAP) == 0) {
+            if (strlen(argv[3]) != 1) {
+                printf("Error: raw CoAP setting should be 'Y' or 'N'.\n");
+            }
+            else {
+                if (argv[3][0] == 'Y') {
+                    new_config.raw_coap = true;
+                    retval = 0;
+                }
+                else if (argv[3][0] == 'N') {
+                    new_config.raw_coap = false;
+                    retval = 0;
+                }
+                else {
+                    printf("Error: raw CoAP setting should be 'Y' or 'N'.\n");
+                }
+            }
+        }
+        else if (strcmp(argv[2], CONFIG_SET_PSK) == 0) {
+            if (strcmp(argv[3], CONFIG_KEY_NONE) == 0) {
+                memset(new_config.psk, 0, sizeof(new_config.psk));
+                retval = 0;
+            }
+            else if (!parse_hex_key(argv[3], new_config.psk, PSK_LEN)) {
+                printf("Error: psk should be %d hex digits, or \""
+                       CONFIG_KEY_NONE "\".\n", PSK_LEN * 2);
+            }
+            else {
+                retval = 0;
+            }
+        }
+        else if (strcmp(argv[2], CONFIG_SET_AUTH_KEY) == 0) {
+            if (strcmp(argv[3], CONFIG_KEY_NONE) == 0) {
+                memset(new_config.auth_key, 0, sizeof(new_config.auth_key));
+                retval = 0;
+            }
+            else if (!parse_hex_key(argv[3], new_config.auth_key,
+                                    AUTH_KEY_LEN)) {
+                printf("Error: auth_key should be %d hex digits, or \""
+                       CONFIG_KEY_NONE "\".\n", AUTH_KEY_LEN * 2);
+            }
+            else {
+                retval = 0;
+            }
+        }
         else if (strcmp(argv[2], CONFIG_SET_URI) == 0) {
             if (strlen(argv[3]) > MAX_URI_LEN) {
                 printf("Error: uri too long, maximum is %d characters.\n",
@@ -467,11 +801,14 @@ static bool handle_save()
 {
     // Assume failure
     int retval = 1;
+    uint32_t changes = config_changes(&current_config, &new_config);
 
-    printf("Saving config...\n");
-
-    // Save config
-    if (!write_config_to_nvs(&new_config)) {
+    if (changes == 0) {
+        printf("No changes to save.\n");
+        retval = 0;
+    }
+    // Save config - only what changed, since the rest is already there.
+    else if (!write_config_changes_to_nvs(&current_config, &new_config)) {
         printf("Error saving configuration.\n");
     }
     // Reread config
@@ -479,13 +816,19 @@ static bool handle_save()
         printf("Error reading configuration.\n");
     }
     else {
-        printf("... config saved\n");
+        printf("Config saved.\n");
 
         // Shadow current config to new config (so they are the same)
         memcpy(&new_config, &current_config, sizeof(new_config));
 
-        set_console_prompt_text();
-        wifi_restart();
+        // and only poke what needs to know. Everything else is read where
+        // it's used, so it just takes effect.
+        if (changes & CONFIG_CHANGED_NAME) {
+            set_console_prompt_text();
+        }
+        if (changes & CONFIG_CHANGED_NETWORK) {
+            wifi_reconfigure();
+        }
 
         // If we got here, everything succeeded and we are therefore happy.
         retval = 0;
@@ -0,0 +1,251 @@
+/**
+ * @file
+ * Console commands to drive the simulated DS18B20.
+ */
+
+#include "ds18b20_sensor.h"
+
+#if SIMULATE_DS18B20
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_console.h"
+#include "temperature.h"
+#include "ds18b20_sim.h"
+#include "cmd_sim.h"
+
+#define SIM_HELP_COMMAND "help"
+#define SIM_SHOW_COMMAND "show"
+#define SIM_RESET_COMMAND "reset"
+#define SIM_TEMP_COMMAND "temp"
+#define SIM_PRESENCE_COMMAND "presence"
+#define SIM_CRC_COMMAND "crc"
+#define SIM_STUCK_COMMAND "stuck"
+#define SIM_CONVERSION_COMMAND "conv"
+
+static void register_sim_cmd(void);
+
+void register_sim(void)
+{
+    ds18b20_sim_init();
+    register_sim_cmd();
+}
+
+/**
+ * Print the help for the sim subcommands.
+ */
+static void emit_sim_help(void)
+{
+    printf("sim commands:\n\n");
+    printf(SIM_HELP_COMMAND "\n");
+    printf("  show this help.\n");
+    printf("\n");
+    printf(SIM_SHOW_COMMAND "\n");
+    printf("  show the simulator settings and counters.\n");
+    printf("\n");
+    printf(SIM_RESET_COMMAND "\n");
+    printf("  zero the counters.\n");
+    printf("\n");
+    printf(SIM_TEMP_COMMAND " <degrees C>\n");
+    printf("  set the temperature the sensor reports, e.g. 21.5\n");
+    printf("\n");
+    printf(SIM_PRESENCE_COMMAND " <percent>\n");
+    printf("  chance of a missing presence pulse on each bus reset.\n");
+    printf("\n");
+    printf(SIM_CRC_COMMAND " <percent>\n");
+    printf("  chance of a CRC error on each scratchpad read.\n");
+    printf("\n");
+    printf(SIM_STUCK_COMMAND " <percent>\n");
+    printf("  chance a conversion silently doesn't happen.\n");
+    printf("\n");
+    printf(SIM_CONVERSION_COMMAND " <ms>\n");
+    printf("  conversion time, or 0 for the datasheet time for the\n");
+    printf("  configured resolution.\n");
+    printf("\n");
+}
+
+/**
+ * Print the simulator settings and counters.
+ */
+static void emit_sim(void)
+{
+    char temperature[MAX_TEMPERATURE_STR_LEN];
+
+    format_temperature(temperature, sizeof(temperature),
+                       ds18b20_sim_settings.temperature, true);
+
+    printf("Temperature:\t%s°C\n", temperature);
+    printf("No presence:\t%u%%\n", ds18b20_sim_settings.no_presence_rate);
+    printf("CRC errors:\t%u%%\n", ds18b20_sim_settings.crc_error_rate);
+    printf("Stuck:\t\t%u%%\n", ds18b20_sim_settings.stuck_rate);
+    if (ds18b20_sim_settings.conversion_ms > 0) {
+        printf("Conversion:\t%u ms\n", ds18b20_sim_settings.conversion_ms);
+    }
+    else {
+        printf("Conversion:\tdatasheet\n");
+    }
+    printf("\n");
+    printf("Resets:\t\t%u\n", ds18b20_sim_stats.resets);
+    printf("Conversions:\t%u\n", ds18b20_sim_stats.conversions);
+    printf("Reads:\t\t%u\n", ds18b20_sim_stats.scratchpad_reads);
+    printf("Early reads:\t%u\n", ds18b20_sim_stats.early_reads);
+    printf("EEPROM writes:\t%u\n", ds18b20_sim_stats.eeprom_writes);
+    printf("Faults:\t\t%u\n", ds18b20_sim_stats.faults);
+}
+
+/**
+ * Parse a temperature in degrees C with up to one decimal place.
+ *
+ * @param str         [in]  The string, e.g. "-12.5".
+ * @param temperature [out] The temperature, in 1/16 degree C.
+ *
+ * @return true on success.
+ * @return false if it isn't a temperature the sensor could report.
+ */
+static bool parse_temperature(const char *str, int16_t *temperature)
+{
+    char *end;
+    long whole;
+    long tenths;
+    bool negative = (str[0] == '-');
+
+    whole = strtol(str, &end, 10);
+    if (end == str) {
+        return false;
+    }
+
+    tenths = labs(whole) * 10;
+    if (*end == '.') {
+        ++end;
+        if (*end < '0' || *end > '9') {
+            return false;
+        }
+        tenths += *end - '0';
+        ++end;
+    }
+    if (*end != '\0') {
+        return false;
+    }
+
+    // The sensor's range.
+    if (tenths > (negative ? 550 : 1250)) {
+        return false;
+    }
+
+    tenths = (tenths * TEMP_UNITS_PER_DEGREE + 5) / 10;
+    *temperature = (int16_t)(negative ? -tenths : tenths);
+
+    return true;
+}
+
+/**
+ * Parse a percentage.
+ *
+ * @param str  [in]  The string.
+ * @param rate [out] The percentage.
+ *
+ * @return true on success.
+ * @return false if it's not 0-100.
+ */
+static bool parse_rate(const char *str, uint8_t *rate)
+{
+    int temp = atoi(str);
+
+    if (temp < 0 || temp > 100) {
+        printf("Error: percentage should be 0-100.\n");
+        return false;
+    }
+
+    *rate = (uint8_t)temp;
+
+    return true;
+}
+
+/**
+ * Sim tasks - parses commands and executes them appropriately.
+ *
+ * @param argc [in]  Number of arguments, including the command itself.
+ * @param argv [in]  Arguments, including the command itself.
+ *
+ * @return 0 if success
+ * @return 1 if error
+ */
+static int tasks_sim(int argc, char **argv)
+{
+    // assume failure.
+    int retval = 1;
+    int temp;
+
+    if (argc == 1) {
+        // no commands, print help
+        emit_sim_help();
+        retval = 0;
+    }
+    else if (strcmp(argv[1], SIM_HELP_COMMAND) == 0) {
+        emit_sim_help();
+        retval = 0;
+    }
+    else if (strcmp(argv[1], SIM_SHOW_COMMAND) == 0) {
+        emit_sim();
+        retval = 0;
+    }
+    else if (strcmp(argv[1], SIM_RESET_COMMAND) == 0) {
+        ds18b20_sim_reset_stats();
+        retval = 0;
+    }
+    else if (argc != 3) {
+        printf("Error: %s requires a value.\n", argv[1]);
+    }
+    else if (strcmp(argv[1], SIM_TEMP_COMMAND) == 0) {
+        if (parse_temperature(argv[2], &ds18b20_sim_settings.temperature)) {
+            retval = 0;
+        }
+        else {
+            printf("Error: temperature should be -55.0 to 125.0.\n");
+        }
+    }
+    else if (strcmp(argv[1], SIM_PRESENCE_COMMAND) == 0) {
+        if (parse_rate(argv[2], &ds18b20_sim_settings.no_presence_rate)) {
+            retval = 0;
+        }
+    }
+    else if (strcmp(argv[1], SIM_CRC_COMMAND) == 0) {
+        if (parse_rate(argv[2], &ds18b20_sim_settings.crc_error_rate)) {
+            retval = 0;
+        }
+    }
+    else if (strcmp(argv[1], SIM_STUCK_COMMAND) == 0) {
+        if (parse_rate(argv[2], &ds18b20_sim_settings.stuck_rate)) {
+            retval = 0;
+        }
+    }
+    else if (strcmp(argv[1], SIM_CONVERSION_COMMAND) == 0) {
+        temp = atoi(argv[2]);
+        if (temp < 0) {
+            printf("Error: conversion time can't be negative.\n");
+        }
+        else {
+            ds18b20_sim_settings.conversion_ms = (uint32_t)temp;
+            retval = 0;
+        }
+    }
+    else {
+        printf("Error: Unknown command: %s\n", argv[1]);
+    }
+
+    return retval;
+}
+
+static void register_sim_cmd(void)
+{
+    const esp_console_cmd_t cmd = {
+        .command = "sim",
+        .help = "Simulated DS18B20 commands",
+        .hint = NULL,
+        .func = &tasks_sim,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+}
+
+#endif // SIMULATE_DS18B20
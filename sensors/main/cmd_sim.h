@@ -0,0 +1,11 @@
+/**
+ * @file
+ * Header file for cmd_sim.c.
+ */
+
+#ifndef __CMD_SIM_H_
+#define __CMD_SIM_H_
+
+void register_sim(void);
+
+#endif // __CMD_SIM_H_
@@ -8,6 +8,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include "esp_log.h"
@@ -16,16 +17,31 @@
 #include "esp_system.h"
 #include "esp_sleep.h"
 #include "esp_spi_flash.h"
+#include "driver/uart.h"
 #include "argtable3/argtable3.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "temperature.h"
+#include "stacks.h"
 #include "version.h"
 
 #ifdef CONFIG_FREERTOS_USE_STATS_FORMATTING_FUNCTIONS
 #define WITH_TASKS_INFO 1
 #endif
 
+/** How long top samples for, by default, in seconds. */
+#define TOP_DEFAULT_INTERVAL_S 1
+
+/**
+ * Longest interval top takes, in seconds. The run time counters are 32 bit
+ * microseconds, so they wrap every 71 minutes, and a delta is only right if
+ * they wrap at most once.
+ */
+#define TOP_MAX_INTERVAL_S 3600
+
+/** Room for tasks started while top is sampling. */
+#define TOP_SPARE_TASKS 4
+
 static const char *TAG = "cmd_system";
 
 static void register_free(void);
@@ -33,6 +49,8 @@ static void register_heap(void);
 static void register_version(void);
 static void register_restart(void);
 static void register_tasks(void);
+static void register_stacks(void);
+static void register_top(void);
 static void register_nosleep(void);
 static void register_pause(void);
 
@@ -43,6 +61,8 @@ void register_system(void)
     register_version();
     register_restart();
     register_tasks();
+    register_stacks();
+    register_top();
     register_nosleep();
     register_pause();
 }
@@ -167,6 +187,168 @@ static void register_tasks(void)
     ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
 }
 
+/* 'stacks' command prints how much of our tasks' stacks they've used */
+static int stacks_info(int argc, char **argv)
+{
+    stacks_print();
+    return 0;
+}
+
+static void register_stacks(void)
+{
+    const esp_console_cmd_t cmd = {
+        .command = "stacks",
+        .help = "Get stack use of our tasks, now and since power on",
+        .hint = NULL,
+        .func = &stacks_info,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+}
+
+/* 'top' command prints how much CPU each task used over an interval */
+
+/**
+ * Print each task's share of the CPU between two snapshots.
+ *
+ * @param before       [in] Tasks at the start.
+ * @param before_count [in] How many.
+ * @param after        [in] Tasks at the end.
+ * @param after_count  [in] How many.
+ * @param elapsed      [in] Run time between them, in us.
+ */
+static void print_top(const TaskStatus_t *before, UBaseType_t before_count,
+                      const TaskStatus_t *after, UBaseType_t after_count,
+                      uint32_t elapsed)
+{
+    uint32_t delta;
+    uint32_t permille;
+    UBaseType_t i;
+    UBaseType_t j;
+
+    printf("\nTask\t\tPrio\tRun (us)\tCPU\n");
+    for (i = 0; i < after_count; ++i) {
+        // Tasks started since the first snapshot ran for all of their time.
+        delta = after[i].ulRunTimeCounter;
+        for (j = 0; j < before_count; ++j) {
+            if (before[j].xTaskNumber == after[i].xTaskNumber) {
+                delta -= before[j].ulRunTimeCounter;
+                break;
+            }
+        }
+
+        permille = elapsed > 0 ? (uint64_t)delta * 1000 / elapsed : 0;
+        printf("%-16s%u\t%10u\t%3u.%u%%\n", after[i].pcTaskName,
+               (unsigned int)after[i].uxCurrentPriority, delta, permille / 10,
+               permille % 10);
+    }
+    printf("Total\t\t\t%10u\n", elapsed);
+}
+
+/**
+ * Top - samples the run time stats over an interval, and prints each task's
+ * share, optionally over and over.
+ *
+ * @param argc [in]  Number of arguments, including the command itself.
+ * @param argv [in]  Arguments, including the command itself.
+ *
+ * @return 0 if success
+ * @return 1 if error
+ */
+static int top(int argc, char **argv)
+{
+    int interval_s = TOP_DEFAULT_INTERVAL_S;
+    int count = 1;
+    int samples = 0;
+    UBaseType_t size = uxTaskGetNumberOfTasks() + TOP_SPARE_TASKS;
+    TaskStatus_t *before;
+    TaskStatus_t *after;
+    TaskStatus_t *swap;
+    UBaseType_t before_count;
+    UBaseType_t after_count;
+    uint32_t before_total;
+    uint32_t after_total;
+    uint8_t key;
+    bool stop = false;
+
+    if (argc > 3) {
+        printf("Usage: top [<interval s> [<count>]]\n");
+        return 1;
+    }
+    if (argc > 1) {
+        interval_s = atoi(argv[1]);
+        if (interval_s < 1 || interval_s > TOP_MAX_INTERVAL_S) {
+            printf("Error: Interval must be 1 to %d seconds.\n",
+                   TOP_MAX_INTERVAL_S);
+            return 1;
+        }
+    }
+    if (argc > 2) {
+        count = atoi(argv[2]);
+        if (count < 0) {
+            printf("Error: Count must be 0 or more.\n");
+            return 1;
+        }
+    }
+
+    before = malloc(size * sizeof(TaskStatus_t));
+    after = malloc(size * sizeof(TaskStatus_t));
+    if (before == NULL || after == NULL) {
+        ESP_LOGE(TAG, "failed to allocate buffers for task states");
+        free(before);
+        free(after);
+        return 1;
+    }
+
+    if (count != 1) {
+        printf("Press any key to stop.\n");
+    }
+
+    before_count = uxTaskGetSystemState(before, size, &before_total);
+    while (!stop && (count == 0 || samples < count)) {
+        // Waiting on the console's UART, rather than just delaying, lets a
+        // key press stop it. That takes the key, but it's only there to
+        // stop us.
+        if (uart_read_bytes(CONFIG_ESP_CONSOLE_UART_NUM, &key, 1,
+                            interval_s * 1000 / portTICK_PERIOD_MS) > 0) {
+            stop = true;
+        }
+
+        after_count = uxTaskGetSystemState(after, size, &after_total);
+        if (before_count == 0 || after_count == 0) {
+            printf("Error: Too many tasks to sample.\n");
+            break;
+        }
+
+        print_top(before, before_count, after, after_count,
+                  after_total - before_total);
+        ++samples;
+
+        // This sample's end is the next one's start, so nothing's missed.
+        swap = before;
+        before = after;
+        after = swap;
+        before_count = after_count;
+        before_total = after_total;
+    }
+
+    free(before);
+    free(after);
+    return 0;
+}
+
+static void register_top(void)
+{
+    const esp_console_cmd_t cmd = {
+        .command = "top",
+        .help = "Get how much CPU each task uses over <interval s> (default "
+                "1), <count> times (default 1, 0 for until a key is pressed). "
+                "Use `pause` first, or the puck may sleep while it runs.",
+        .hint = "[<interval s> [<count>]]",
+        .func = &top,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+}
+
 static int disable_sleep(int argc, char **argv)
 {
     disable_deep_sleep();
@@ -36,7 +36,8 @@ static void emit_temperature_help(void)
     printf("  show this help.\n");
     printf("\n");
     printf(TEMPERATURE_READ_COMMAND "\n");
-    printf("  read the current temperature and print it\n");
+    printf("  read the current temperature (and humidity, if fitted) and\n");
+    printf("  print it\n");
 }
 
 /**
@@ -44,16 +45,22 @@ static void emit_temperature_help(void)
  */
 static void read_and_print_temperature(void)
 {
-    float temperature = get_last_temp();
-    // last_temp is converted to the configured unit when it is sampled, so the
-    // conditional logic is really just for the correct label.
-    printf("Temperature is %.1f°", temperature);
+    char temperature[MAX_TEMPERATURE_STR_LEN];
+    uint16_t humidity;
+
+    format_temperature(temperature, sizeof(temperature), get_last_temp(),
+                       current_config.use_celsius);
+    printf("Temperature is %s°", temperature);
     if (current_config.use_celsius) {
         printf("C\n");
     }
     else {
         printf("F\n");
     }
+
+    if (get_last_humidity(&humidity)) {
+        printf("Humidity is %u.%u%%\n", humidity / 10, humidity % 10);
+    }
 }
 
 /**
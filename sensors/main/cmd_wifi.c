@@ -13,6 +13,8 @@
 #include "argtable3/argtable3.h"
 #include "wifi.h"
 #include "config_storage.h"
+#include "rtc_storage.h"
+#include "discovery.h"
 
 static const char *TAG = "cmd_wifi";
 
@@ -53,6 +55,46 @@ static void emit_wifi(void)
     char temp_buf[MAX_IPV4_LEN];
     char * ret_buf;
     
+    printf("WiFi state:\t%s\n", wifi_state_name());
+
+    // How long the last shutdown each way took, so they can be compared.
+    printf("WiFi off:\t");
+    if (rtc_storage.graceful_off_ms == 0) {
+        printf("graceful not yet, ");
+    }
+    else {
+        printf("graceful %ums, ", rtc_storage.graceful_off_ms);
+    }
+    if (rtc_storage.fast_off_ms == 0) {
+        printf("fast not yet\n");
+    }
+    else {
+        printf("fast %ums\n", rtc_storage.fast_off_ms);
+    }
+
+    // Likewise the last send each way.
+    printf("CoAP send:\t");
+    if (rtc_storage.libcoap_send_us == 0) {
+        printf("libcoap not yet, ");
+    }
+    else {
+        printf("libcoap %uus, ", rtc_storage.libcoap_send_us);
+    }
+    if (rtc_storage.raw_send_us == 0) {
+        printf("raw not yet\n");
+    }
+    else {
+        printf("raw %uus\n", rtc_storage.raw_send_us);
+    }
+
+    // Where reports go, if the controller has been found somewhere other
+    // than the URI says.
+    if (discovery_address() == NULL) {
+        printf("Controller:\tas configured\n");
+    }
+    else {
+        printf("Controller:\tdiscovered at %s\n", discovery_address());
+    }
     printf("WiFi status:\t");
 
     err = esp_wifi_sta_get_ap_info(&ap_info);
@@ -0,0 +1,611 @@
+/**
+ * @file
+ * Minimal CoAP sender, straight on top of lwIP's raw UDP API.
+ *
+ * Every report is the same shape - a confirmable PUT to the same path - and
+ * only the message ID, token and payload change. So the header and Uri-Path
+ * options are built once, into a static buffer, and each send just patches
+ * those in and hands the lot to lwIP. There's no libcoap context or session,
+ * no sockets layer, and no DNS; the reply is matched by a receive callback,
+ * which only needs to understand the replies the controller actually sends.
+ *
+ * Everything which touches lwIP is run on its thread with tcpip_callback(),
+ * because the raw API isn't thread safe.
+ *
+ * The template and reply matching are also used for coaps://, where the
+ * message goes through DTLS instead. See dtls.c.
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_system.h"
+
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+#include "lwip/tcpip.h"
+
+#include "coap/coap.h"
+
+#include "coap_raw.h"
+#include "auth.h"
+#include "config_storage.h"
+
+static const char *TAG = "coap_raw";
+
+/** Fixed header, before the token. */
+#define HEADER_LEN 4
+
+/** First byte of the header: version 1, confirmable, and our token length. */
+#define HEADER_BYTE0 ((1 << 6) | (COAP_MESSAGE_CON << 4) | COAP_RAW_TOKEN_LEN)
+
+/** Where the token goes, and where the options start. */
+#define TOKEN_OFFSET HEADER_LEN
+#define OPTIONS_OFFSET (TOKEN_OFFSET + COAP_RAW_TOKEN_LEN)
+
+/** Marks the end of the options and the start of the payload. */
+#define PAYLOAD_MARKER 0xFF
+
+/** Empty message code, as in an ACK without a piggybacked response. */
+#define CODE_EMPTY 0
+
+/** The request, with everything up to the payload filled in. */
+static uint8_t packet[COAP_RAW_MAX_LEN];
+
+/** How much of packet is the header, token and options. */
+static size_t template_len = 0;
+
+/** Number of the last option in the template. */
+static uint16_t template_last_option;
+
+/** How much of packet is filled in for the message in flight. */
+static size_t packet_len = 0;
+
+/** The URI the template was built for, or empty if there isn't one. */
+static char template_uri[MAX_URI_LEN + 1];
+
+/** Where the template sends to. */
+static char server_host[MAX_IPV4_LEN];
+static ip_addr_t server_addr;
+static uint16_t server_port;
+
+/** Whether the template is for coaps://. */
+static bool secure = false;
+
+/** Our socket, which is only touched on the lwIP thread. */
+static struct udp_pcb *pcb = NULL;
+
+/** Message ID of the last message we sent. */
+static uint16_t message_id;
+
+/** The task waiting for a reply, to be notified by the receive callback. */
+static TaskHandle_t waiter = NULL;
+
+/**
+ * Whether we're waiting for a reply. The receive callback ignores anything
+ * which comes in when we aren't, and clears it once it has the reply, so
+ * the reply isn't overwritten while it's being read.
+ */
+static volatile bool waiting = false;
+
+/** Whether the server has sent an empty ACK, so the reply comes separately. */
+static volatile bool acked = false;
+
+/**
+ * What came in, which is only touched on the lwIP thread while we're waiting.
+ * It's static because it's too big for that thread's stack.
+ */
+static uint8_t received[COAP_RAW_MAX_LEN];
+
+/** The reply, which points into received. */
+static coap_raw_reply_t raw_reply;
+
+/**
+ * Encode an option's delta or length, which share the same scheme: values
+ * under 13 go in the 4 bit field, and bigger ones in 1 or 2 more bytes.
+ *
+ * @param value  [in]  The delta or length.
+ * @param nibble [out] What goes in the 4 bit field.
+ * @param extra  [out] What goes after the option header, if anything.
+ *
+ * @return how many bytes go in extra.
+ */
+static size_t encode_option_field(uint16_t value, uint8_t *nibble,
+                                  uint8_t *extra)
+{
+    if (value < 13) {
+        *nibble = value;
+        return 0;
+    }
+    if (value < 269) {
+        *nibble = 13;
+        extra[0] = value - 13;
+        return 1;
+    }
+    *nibble = 14;
+    extra[0] = (value - 269) >> 8;
+    extra[1] = (value - 269) & 0xFF;
+    return 2;
+}
+
+/**
+ * Append an option to the packet.
+ *
+ * @param offset [in] Where it goes.
+ * @param delta  [in] Option number, less that of the last option.
+ * @param value  [in] Option value.
+ * @param length [in] Its length.
+ *
+ * @return where the next one goes.
+ * @return 0 if it doesn't fit.
+ */
+static size_t add_option(size_t offset, uint16_t delta, const uint8_t *value,
+                         size_t length)
+{
+    uint8_t delta_nibble;
+    uint8_t delta_extra[2];
+    size_t delta_extra_len;
+    uint8_t length_nibble;
+    uint8_t length_extra[2];
+    size_t length_extra_len;
+
+    delta_extra_len = encode_option_field(delta, &delta_nibble, delta_extra);
+    length_extra_len = encode_option_field(length, &length_nibble,
+                                           length_extra);
+
+    // Leave room for the payload marker after it.
+    if (offset + 1 + delta_extra_len + length_extra_len + length + 1 >
+        sizeof(packet)) {
+        return 0;
+    }
+
+    packet[offset++] = (delta_nibble << 4) | length_nibble;
+    memcpy(packet + offset, delta_extra, delta_extra_len);
+    offset += delta_extra_len;
+    memcpy(packet + offset, length_extra, length_extra_len);
+    offset += length_extra_len;
+    memcpy(packet + offset, value, length);
+
+    return offset + length;
+}
+
+bool coap_raw_prepare(const char *uri)
+{
+    coap_uri_t parts;
+    const uint8_t *segment;
+    const uint8_t *end;
+    const uint8_t *slash;
+    uint16_t delta = COAP_OPTION_URI_PATH;
+    size_t offset;
+
+    if (template_len != 0 && strcmp(template_uri, uri) == 0) {
+        return true;
+    }
+
+    template_len = 0;
+    template_uri[0] = '\0';
+
+    if (coap_split_uri((const uint8_t *)uri, strlen(uri), &parts) != 0 ||
+        (parts.scheme != COAP_URI_SCHEME_COAP &&
+         parts.scheme != COAP_URI_SCHEME_COAPS)) {
+        ESP_LOGW(TAG, "Only coap:// and coaps:// URIs can be sent raw.");
+        return false;
+    }
+
+    // No DNS here - it'd cost more than everything else put together.
+    if (parts.host.length >= sizeof(server_host)) {
+        ESP_LOGW(TAG, "Only IP addresses can be sent to raw.");
+        return false;
+    }
+    memcpy(server_host, parts.host.s, parts.host.length);
+    server_host[parts.host.length] = '\0';
+    if (!ipaddr_aton(server_host, &server_addr)) {
+        ESP_LOGW(TAG, "Only IP addresses can be sent to raw.");
+        return false;
+    }
+    server_port = parts.port;
+    secure = parts.scheme == COAP_URI_SCHEME_COAPS;
+
+    packet[0] = HEADER_BYTE0;
+    packet[1] = COAP_REQUEST_PUT;
+    offset = OPTIONS_OFFSET;
+    template_last_option = 0;
+
+    // One Uri-Path option per segment.
+    segment = parts.path.s;
+    end = parts.path.s + parts.path.length;
+    while (segment < end) {
+        slash = memchr(segment, '/', end - segment);
+        if (slash == NULL) {
+            slash = end;
+        }
+
+        offset = add_option(offset, delta, segment, slash - segment);
+        if (offset == 0) {
+            ESP_LOGW(TAG, "URI path is too long to send raw.");
+            return false;
+        }
+
+        template_last_option = COAP_OPTION_URI_PATH;
+        delta = 0;
+        segment = slash + 1;
+    }
+
+    template_len = offset;
+
+    strncpy(template_uri, uri, sizeof(template_uri));
+    message_id = esp_random();
+
+    ESP_LOGI(TAG, "Template for %s is %u bytes.", uri, template_len);
+
+    return true;
+}
+
+bool coap_raw_find_payload(const uint8_t *data, size_t length,
+                           size_t *payload)
+{
+    size_t offset;
+    uint32_t delta;
+    uint32_t option_len;
+
+    if (length < HEADER_LEN) {
+        return false;
+    }
+
+    // The options start after the header and token.
+    offset = HEADER_LEN + (data[0] & 0x0F);
+
+    while (offset < length && data[offset] != PAYLOAD_MARKER) {
+        delta = data[offset] >> 4;
+        option_len = data[offset] & 0x0F;
+        ++offset;
+
+        // 13 and 14 mean 1 or 2 more bytes follow; 15 is reserved.
+        if (delta == 15 || option_len == 15) {
+            return false;
+        }
+        if (delta == 13) {
+            offset += 1;
+        }
+        else if (delta == 14) {
+            offset += 2;
+        }
+        if (option_len == 13) {
+            if (offset >= length) {
+                return false;
+            }
+            option_len = data[offset] + 13;
+            offset += 1;
+        }
+        else if (option_len == 14) {
+            if (offset + 1 >= length) {
+                return false;
+            }
+            option_len = ((data[offset] << 8) | data[offset + 1]) + 269;
+            offset += 2;
+        }
+
+        offset += option_len;
+    }
+
+    if (offset > length) {
+        return false;
+    }
+
+    // The marker is only there if there's a payload after it.
+    *payload = offset < length ? offset + 1 : length;
+    return true;
+}
+
+bool coap_raw_secure(void)
+{
+    return secure;
+}
+
+const char *coap_raw_host(void)
+{
+    return server_host;
+}
+
+uint16_t coap_raw_port(void)
+{
+    return server_port;
+}
+
+size_t coap_raw_build(const char *payload, size_t length,
+                      const uint8_t *auth, const uint8_t **message)
+{
+    uint32_t token;
+    size_t offset = template_len;
+
+    if (template_len == 0) {
+        return 0;
+    }
+
+    // The authentication option is always the last, so it goes on the end
+    // of the template.
+    if (auth != NULL) {
+        offset = add_option(offset, COAP_OPTION_AUTH - template_last_option,
+                            auth, AUTH_OPTION_LEN);
+        if (offset == 0) {
+            return 0;
+        }
+    }
+
+    if (offset + 1 + length > sizeof(packet)) {
+        return 0;
+    }
+    packet[offset++] = PAYLOAD_MARKER;
+
+    // Patch in what's new for this message.
+    ++message_id;
+    packet[2] = message_id >> 8;
+    packet[3] = message_id & 0xFF;
+    token = esp_random();
+    memcpy(packet + TOKEN_OFFSET, &token, COAP_RAW_TOKEN_LEN);
+    memcpy(packet + offset, payload, length);
+    packet_len = offset + length;
+
+    *message = packet;
+    return packet_len;
+}
+
+coap_raw_match_t coap_raw_match(const uint8_t *data, size_t length,
+                                coap_raw_reply_t *reply)
+{
+    uint8_t type;
+    uint8_t token_len;
+    uint16_t mid;
+    size_t payload;
+
+    if (length < HEADER_LEN || (data[0] >> 6) != 1) {
+        return COAP_RAW_NOT_OURS;
+    }
+
+    type = (data[0] >> 4) & 0x03;
+    token_len = data[0] & 0x0F;
+    mid = (data[2] << 8) | data[3];
+
+    if (type == COAP_MESSAGE_RST && mid == message_id) {
+        return COAP_RAW_RESET;
+    }
+
+    // An empty ACK means the reply will come separately, so stop resending.
+    if (type == COAP_MESSAGE_ACK && mid == message_id &&
+        data[1] == CODE_EMPTY) {
+        return COAP_RAW_ACKED;
+    }
+
+    // Otherwise it's only a reply if it's a piggybacked one to our message,
+    // or a separate one, and either way it has our token.
+    if (!(type == COAP_MESSAGE_ACK && mid == message_id) &&
+        !(type == COAP_MESSAGE_CON || type == COAP_MESSAGE_NON)) {
+        return COAP_RAW_NOT_OURS;
+    }
+    if (token_len != COAP_RAW_TOKEN_LEN ||
+        length < HEADER_LEN + COAP_RAW_TOKEN_LEN ||
+        memcmp(data + TOKEN_OFFSET, packet + TOKEN_OFFSET,
+               COAP_RAW_TOKEN_LEN) != 0) {
+        return COAP_RAW_NOT_OURS;
+    }
+
+    if (!coap_raw_find_payload(data, length, &payload)) {
+        ESP_LOGW(TAG, "Malformed reply.");
+        return COAP_RAW_NOT_OURS;
+    }
+
+    reply->code = data[1];
+    reply->payload = data + payload;
+    reply->length = length - payload;
+    reply->needs_ack = type == COAP_MESSAGE_CON;
+    reply->message_id = mid;
+
+    return COAP_RAW_REPLY;
+}
+
+size_t coap_raw_empty_ack(uint16_t mid, uint8_t *buffer)
+{
+    buffer[0] = (1 << 6) | (COAP_MESSAGE_ACK << 4);
+    buffer[1] = CODE_EMPTY;
+    buffer[2] = mid >> 8;
+    buffer[3] = mid & 0xFF;
+
+    return COAP_RAW_EMPTY_ACK_LEN;
+}
+
+/**
+ * Send an empty ACK for a separate response. Runs on the lwIP thread.
+ *
+ * @param addr [in] Who to send it to.
+ * @param port [in] Their port.
+ * @param mid  [in] Message ID of the response.
+ */
+static void send_empty_ack(const ip_addr_t *addr, uint16_t port, uint16_t mid)
+{
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, COAP_RAW_EMPTY_ACK_LEN,
+                                PBUF_RAM);
+    uint8_t ack[COAP_RAW_EMPTY_ACK_LEN];
+
+    if (p == NULL) {
+        return;
+    }
+
+    pbuf_take(p, ack, coap_raw_empty_ack(mid, ack));
+    udp_sendto(pcb, p, addr, port);
+    pbuf_free(p);
+}
+
+/**
+ * Callback for anything coming in on our socket. Runs on the lwIP thread.
+ *
+ * @param arg  [in] Unused.
+ * @param upcb [in] Our socket.
+ * @param p    [in] What came in. We have to free it.
+ * @param addr [in] Who sent it.
+ * @param port [in] Their port.
+ */
+static void receive_callback(void *arg, struct udp_pcb *upcb, struct pbuf *p,
+                             const ip_addr_t *addr, uint16_t port)
+{
+    size_t length;
+
+    if (!waiting) {
+        pbuf_free(p);
+        return;
+    }
+
+    length = pbuf_copy_partial(p, received, sizeof(received), 0);
+    pbuf_free(p);
+
+    switch (coap_raw_match(received, length, &raw_reply)) {
+        case COAP_RAW_RESET:
+            waiting = false;
+            xTaskNotify(waiter, COAP_RAW_NOTIFY_RESET, eSetBits);
+            break;
+        case COAP_RAW_ACKED:
+            acked = true;
+            break;
+        case COAP_RAW_REPLY:
+            if (raw_reply.needs_ack) {
+                send_empty_ack(addr, port, raw_reply.message_id);
+            }
+            waiting = false;
+            xTaskNotify(waiter, COAP_RAW_NOTIFY_REPLY, eSetBits);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Send the message in flight. Runs on the lwIP thread.
+ *
+ * @param ctx [in] Unused.
+ */
+static void send_in_tcpip(void *ctx)
+{
+    struct pbuf *p;
+    err_t result;
+
+    if (pcb == NULL) {
+        pcb = udp_new();
+        if (pcb == NULL) {
+            ESP_LOGE(TAG, "udp_new failed");
+            return;
+        }
+        udp_bind(pcb, IP_ADDR_ANY, 0);
+        udp_recv(pcb, receive_callback, NULL);
+    }
+
+    p = pbuf_alloc(PBUF_TRANSPORT, packet_len, PBUF_RAM);
+    if (p == NULL) {
+        ESP_LOGE(TAG, "pbuf_alloc failed");
+        return;
+    }
+
+    pbuf_take(p, packet, packet_len);
+    result = udp_sendto(pcb, p, &server_addr, server_port);
+    if (result != ERR_OK) {
+        ESP_LOGE(TAG, "udp_sendto returned %d", result);
+    }
+    pbuf_free(p);
+}
+
+/**
+ * Close our socket. Runs on the lwIP thread.
+ *
+ * @param ctx [in] Unused.
+ */
+static void close_in_tcpip(void *ctx)
+{
+    if (pcb != NULL) {
+        udp_remove(pcb);
+        pcb = NULL;
+    }
+}
+
+bool coap_raw_put(const char *payload, size_t length, const uint8_t *auth,
+                  uint32_t timeout_ms, int attempts, const uint8_t **reply,
+                  size_t *reply_length)
+{
+    TickType_t start = xTaskGetTickCount();
+    TickType_t timeout = timeout_ms / portTICK_PERIOD_MS;
+    TickType_t total = timeout * attempts;
+    TickType_t sent = 0;
+    TickType_t elapsed;
+    TickType_t wait;
+    uint32_t events = 0;
+    uint32_t pending;
+    const uint8_t *message;
+    int send_attempts = 0;
+
+    // coaps:// has to go through DTLS.
+    if (secure || coap_raw_build(payload, length, auth, &message) == 0) {
+        return false;
+    }
+
+    waiter = xTaskGetCurrentTaskHandle();
+    xTaskNotifyWait(COAP_RAW_NOTIFY_REPLY | COAP_RAW_NOTIFY_RESET, 0, NULL, 0);
+    acked = false;
+    waiting = true;
+
+    while ((events & (COAP_RAW_NOTIFY_REPLY | COAP_RAW_NOTIFY_RESET)) == 0) {
+        elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= total) {
+            waiting = false;
+            ESP_LOGE(TAG, "No reply after %d tries.", send_attempts);
+            return false;
+        }
+
+        // Resend every timeout, until it's been acked.
+        if (!acked && send_attempts < attempts &&
+            (send_attempts == 0 || elapsed - sent >= timeout)) {
+            ++send_attempts;
+            sent = elapsed;
+            tcpip_callback(send_in_tcpip, NULL);
+        }
+
+        // Until the next resend, or the end if there aren't any more.
+        if (acked || send_attempts >= attempts) {
+            wait = total - elapsed;
+        }
+        else {
+            wait = timeout - (elapsed - sent);
+        }
+
+        pending = 0;
+        xTaskNotifyWait(0, COAP_RAW_NOTIFY_REPLY | COAP_RAW_NOTIFY_RESET,
+                        &pending, wait);
+        events |= pending;
+    }
+
+    if (events & COAP_RAW_NOTIFY_RESET) {
+        ESP_LOGE(TAG, "The server reset our message.");
+        return false;
+    }
+
+    *reply = raw_reply.payload;
+    *reply_length = raw_reply.length;
+
+    return coap_raw_success(&raw_reply);
+}
+
+bool coap_raw_success(const coap_raw_reply_t *reply)
+{
+    // success is 2.05, as for libcoap.
+    if (reply->code != COAP_RESPONSE_CODE(205)) {
+        ESP_LOGE(TAG, "Received code %d.%02d back from the CoAP server.",
+                 reply->code >> 5, reply->code & 0x1F);
+        return false;
+    }
+
+    return true;
+}
+
+void coap_raw_close(void)
+{
+    tcpip_callback(close_in_tcpip, NULL);
+}
@@ -0,0 +1,185 @@
+/**
+ * @file
+ * Header file for coap_raw.c.
+ */
+
+#ifndef __COAP_RAW_H_
+#define __COAP_RAW_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Biggest message we'll build. This is RFC 7252's limit for a message which
+ * doesn't use blockwise transfers, which a full backlog comes well under.
+ */
+#define COAP_RAW_MAX_LEN 1152
+
+/**
+ * Length of the token we send. Four random bytes is plenty to tell our reply
+ * from a stray one.
+ */
+#define COAP_RAW_TOKEN_LEN 4
+
+/** Length of an empty ACK, which is just the header. */
+#define COAP_RAW_EMPTY_ACK_LEN 4
+
+/**
+ * Notification bits from the lwIP thread to the task waiting for a reply.
+ * These are clear of the bits the WiFi event handler and ESP-NOW use.
+ */
+#define COAP_RAW_NOTIFY_REPLY BIT10 /**< The reply came in. */
+#define COAP_RAW_NOTIFY_RESET BIT11 /**< The server reset our message. */
+
+/**
+ * What a message that came in means for the request in flight.
+ */
+typedef enum {
+    COAP_RAW_NOT_OURS,  /**< Nothing; it's for something else. */
+    COAP_RAW_ACKED,     /**< An empty ACK - the reply comes separately. */
+    COAP_RAW_REPLY,     /**< The reply. */
+    COAP_RAW_RESET,     /**< The server reset our message. */
+} coap_raw_match_t;
+
+/**
+ * The reply to the request in flight.
+ */
+typedef struct {
+    uint8_t code;               /**< Response code, e.g. 2.05. */
+    const uint8_t *payload;     /**< Payload, which points into the message
+                                     it came in. */
+    size_t length;              /**< Length of the payload. */
+    bool needs_ack;             /**< Whether it's a confirmable separate
+                                     response, which we have to ACK. */
+    uint16_t message_id;        /**< Its message ID, for the ACK. */
+} coap_raw_reply_t;
+
+/**
+ * Build the request template for a URI, unless it's already built.
+ *
+ * Only coap:// and coaps:// URIs with an IP address for the host can be sent
+ * this way. Anything else needs libcoap.
+ *
+ * @param uri [in] The URI to PUT to.
+ *
+ * @return true if the template is ready.
+ * @return false if the URI can't be sent this way.
+ */
+bool coap_raw_prepare(const char *uri);
+
+/**
+ * Check whether the template is for coaps://, so it has to be sent with
+ * dtls_put() rather than coap_raw_put().
+ *
+ * @return true if it is.
+ * @return false if it isn't.
+ */
+bool coap_raw_secure(void);
+
+/**
+ * @return the host the template is for, as an IP address string.
+ */
+const char *coap_raw_host(void);
+
+/**
+ * @return the port the template is for.
+ */
+uint16_t coap_raw_port(void);
+
+/**
+ * Fill in the template for a new message, with a new message ID and token.
+ *
+ * @param payload [in]  The payload.
+ * @param length  [in]  Its length.
+ * @param auth    [in]  The authentication option, AUTH_OPTION_LEN long, or
+ *                      NULL to leave it out.
+ * @param message [out] The message, which is good until the next call.
+ *
+ * @return the length of the message.
+ * @return 0 if there's no template, or the payload doesn't fit.
+ */
+size_t coap_raw_build(const char *payload, size_t length,
+                      const uint8_t *auth, const uint8_t **message);
+
+/**
+ * Work out what a message that came in means for the one we last built.
+ *
+ * @param data   [in]  The message.
+ * @param length [in]  Its length.
+ * @param reply  [out] If it's the reply, the reply, which points into data.
+ *
+ * @return what it is.
+ */
+coap_raw_match_t coap_raw_match(const uint8_t *data, size_t length,
+                                coap_raw_reply_t *reply);
+
+/**
+ * Find the payload of a CoAP message, by skipping its token and options.
+ *
+ * @param data    [in]  The message.
+ * @param length  [in]  Its length.
+ * @param payload [out] Where the payload starts, or length if there isn't
+ *                      one.
+ *
+ * @return true if the message is well formed.
+ * @return false if it isn't.
+ */
+bool coap_raw_find_payload(const uint8_t *data, size_t length,
+                           size_t *payload);
+
+/**
+ * Build an empty ACK, for a confirmable separate response.
+ *
+ * @param mid    [in]  Message ID of the response.
+ * @param buffer [out] Buffer of at least COAP_RAW_EMPTY_ACK_LEN.
+ *
+ * @return the length of the ACK.
+ */
+size_t coap_raw_empty_ack(uint16_t mid, uint8_t *buffer);
+
+/**
+ * Check whether a reply means the server accepted our request, and log it
+ * if it didn't.
+ *
+ * @param reply [in] The reply.
+ *
+ * @return true if it's 2.05.
+ * @return false if it's anything else.
+ */
+bool coap_raw_success(const coap_raw_reply_t *reply);
+
+/**
+ * PUT a payload with the template over plain UDP, and wait for the reply.
+ *
+ * The request is resent every timeout_ms until it's acked. If the server
+ * sends an empty ACK and replies separately, that's waited for too, up to the
+ * same total time.
+ *
+ * @param payload      [in]  The payload.
+ * @param length       [in]  Its length.
+ * @param auth         [in]  The authentication option, or NULL.
+ * @param timeout_ms   [in]  How long to wait for an ACK before resending.
+ * @param attempts     [in]  How many times to send it, at most.
+ * @param reply        [out] The reply's payload, which is good until the next
+ *                           call.
+ * @param reply_length [out] Its length.
+ *
+ * @return true if the server replied 2.05.
+ * @return false if it replied with anything else, or didn't reply.
+ *
+ * @note Only call this from the WiFi task, after coap_raw_prepare(), and
+ *       only for coap://.
+ */
+bool coap_raw_put(const char *payload, size_t length, const uint8_t *auth,
+                  uint32_t timeout_ms, int attempts, const uint8_t **reply,
+                  size_t *reply_length);
+
+/**
+ * Close the socket, if it's open. The template is kept.
+ *
+ * @note Only call this from the WiFi task.
+ */
+void coap_raw_close(void);
+
+#endif // __COAP_RAW_H_
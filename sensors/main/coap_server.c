@@ -0,0 +1,199 @@
+/**
+ * @file
+ * CoAP server, so the controller can observe the temperature of a mains
+ * powered puck rather than wait for it to report.
+ *
+ * This serves a single resource, /temperature, which reads the same as the
+ * first line of a report ("<station name>: <temperature>"). It supports
+ * Observe (RFC 7641), and observers are only notified when the reading
+ * changes, or on a heartbeat so they know we're still here.
+ *
+ * The server runs on the WiFi task, in between commands, because that's what
+ * owns the network. See wifi_task().
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "esp_log.h"
+
+#include "coap/coap.h"
+
+#include "coap_server.h"
+#include "config_storage.h"
+#include "temperature.h"
+
+static const char *TAG = "coap_server";
+
+static coap_context_t *server_ctx = NULL;
+static coap_resource_t *temperature_resource = NULL;
+
+/** Whether anything is observing /temperature. */
+static volatile bool observed = false;
+
+/**
+ * What /temperature reads, or empty if we haven't had a reading yet.
+ *
+ * Station name is MAX_STATION_NAME_LEN, then a colon and a space, then the
+ * temperature, which is MAX_TEMPERATURE_STR_LEN including the NUL.
+ */
+static char served[MAX_STATION_NAME_LEN + 2 + MAX_TEMPERATURE_STR_LEN];
+
+/**
+ * Handler for GET /temperature, including Observe registrations.
+ *
+ * @param ctx      context
+ * @param resource the resource
+ * @param session  session the request came in on
+ * @param request  the request
+ * @param token    token of the request
+ * @param query    query string of the request
+ * @param response response to fill in
+ */
+static void handle_get_temperature(coap_context_t *ctx,
+                                   coap_resource_t *resource,
+                                   coap_session_t *session,
+                                   coap_pdu_t *request,
+                                   coap_binary_t *token,
+                                   coap_string_t *query,
+                                   coap_pdu_t *response)
+{
+    uint8_t buf[4];
+
+    if (served[0] == '\0') {
+        // Nothing to serve yet. It'll be there after our first report.
+        response->code = COAP_RESPONSE_CODE(503);
+        return;
+    }
+
+    response->code = COAP_RESPONSE_CODE(205);
+
+    // Options have to be added in order of their number.
+    if (coap_find_observer(resource, session, token)) {
+        coap_add_option(response, COAP_OPTION_OBSERVE,
+                        coap_encode_var_safe(buf, sizeof(buf),
+                                             resource->observe), buf);
+    }
+
+    coap_add_option(response, COAP_OPTION_CONTENT_FORMAT,
+                    coap_encode_var_safe(buf, sizeof(buf),
+                                         COAP_MEDIATYPE_TEXT_PLAIN), buf);
+
+    // It's good until the next poll. An observer which hears nothing for
+    // longer than this should register again.
+    coap_add_option(response, COAP_OPTION_MAXAGE,
+                    coap_encode_var_safe(buf, sizeof(buf),
+                                         current_config.poll_time_sec), buf);
+
+    coap_add_data(response, strlen(served), (const uint8_t *)served);
+}
+
+bool coap_server_start(void)
+{
+    coap_address_t listen_addr;
+
+    if (server_ctx != NULL) {
+        return true;
+    }
+
+    coap_address_init(&listen_addr);
+    listen_addr.addr.sin.sin_family = AF_INET;
+    listen_addr.addr.sin.sin_port = htons(COAP_DEFAULT_PORT);
+    listen_addr.addr.sin.sin_addr.s_addr = INADDR_ANY;
+
+    server_ctx = coap_new_context(NULL);
+    if (!server_ctx) {
+        ESP_LOGE(TAG, "coap_new_context() failed");
+        return false;
+    }
+
+    if (!coap_new_endpoint(server_ctx, &listen_addr, COAP_PROTO_UDP)) {
+        ESP_LOGE(TAG, "coap_new_endpoint() failed");
+        coap_server_stop();
+        return false;
+    }
+
+    // Confirmable notifications, so an observer which has gone away is
+    // noticed and dropped. On mains power, the ACKs cost us nothing.
+    temperature_resource = coap_resource_init(
+                               coap_make_str_const(COAP_SERVER_RESOURCE),
+                               COAP_RESOURCE_FLAGS_NOTIFY_CON);
+    if (!temperature_resource) {
+        ESP_LOGE(TAG, "coap_resource_init() failed");
+        coap_server_stop();
+        return false;
+    }
+
+    coap_register_handler(temperature_resource, COAP_REQUEST_GET,
+                          handle_get_temperature);
+    coap_resource_set_get_observable(temperature_resource, 1);
+    coap_add_resource(server_ctx, temperature_resource);
+
+    ESP_LOGI(TAG, "Serving /" COAP_SERVER_RESOURCE " on port %d.",
+             COAP_DEFAULT_PORT);
+
+    return true;
+}
+
+void coap_server_stop(void)
+{
+    observed = false;
+
+    if (server_ctx != NULL) {
+        // This frees the resource, and its observers, too.
+        coap_free_context(server_ctx);
+        server_ctx = NULL;
+        temperature_resource = NULL;
+        ESP_LOGI(TAG, "Stopped.");
+    }
+}
+
+bool coap_server_running(void)
+{
+    return server_ctx != NULL;
+}
+
+void coap_server_run(uint32_t timeout_ms)
+{
+    int result;
+
+    if (server_ctx == NULL) {
+        return;
+    }
+
+    result = coap_run_once(server_ctx, timeout_ms);
+    if (result < 0) {
+        ESP_LOGE(TAG, "coap_run_once returned %d", result);
+    }
+
+    observed = temperature_resource->subscribers != NULL;
+}
+
+void coap_server_update(bool force)
+{
+    char temperature[MAX_TEMPERATURE_STR_LEN];
+    char latest[sizeof(served)];
+
+    if (temperature_resource == NULL) {
+        return;
+    }
+
+    format_temperature(temperature, sizeof(temperature), get_last_temp(),
+                       current_config.use_celsius);
+    snprintf(latest, sizeof(latest), "%s: %s", current_config.station_name,
+             temperature);
+
+    if (!force && strcmp(latest, served) == 0) {
+        return;
+    }
+
+    memcpy(served, latest, sizeof(served));
+
+    // The notifications go out the next time the server runs.
+    coap_resource_notify_observers(temperature_resource, NULL);
+}
+
+bool coap_server_is_observed(void)
+{
+    return observed;
+}
@@ -0,0 +1,75 @@
+/**
+ * @file
+ * Header file for coap_server.c.
+ */
+
+#ifndef __COAP_SERVER_H_
+#define __COAP_SERVER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/** Path of the resource the controller can observe. */
+#define COAP_SERVER_RESOURCE "temperature"
+
+/**
+ * How long the WiFi task spends serving CoAP before it checks for commands
+ * again, in ms. This is the most a command can be held up by the server.
+ */
+#define COAP_SERVER_POLL_MS 100
+
+/**
+ * Start serving /temperature on the default CoAP port.
+ *
+ * @note Only call this from the WiFi task, once WiFi is connected.
+ *
+ * @return true if the server is running.
+ * @return false if it couldn't be started.
+ */
+bool coap_server_start(void);
+
+/**
+ * Stop the server, if it's running. Any observers are dropped.
+ *
+ * @note Only call this from the WiFi task.
+ */
+void coap_server_stop(void);
+
+/**
+ * Check whether the server is running.
+ *
+ * @return true if it is.
+ * @return false if it isn't.
+ */
+bool coap_server_running(void);
+
+/**
+ * Handle requests for a while, and send any notifications that are due.
+ *
+ * @param timeout_ms [in] The longest to wait for a request.
+ *
+ * @note Only call this from the WiFi task.
+ */
+void coap_server_run(uint32_t timeout_ms);
+
+/**
+ * Update /temperature with the last reading, and notify observers if it has
+ * changed.
+ *
+ * @param force [in] Notify observers even if it hasn't changed, so they know
+ *                   we're still here.
+ *
+ * @note Only call this from the WiFi task.
+ */
+void coap_server_update(bool force);
+
+/**
+ * Check whether anybody is observing /temperature. This is safe to call from
+ * any task.
+ *
+ * @return true if something is.
+ * @return false if nothing is, or the server isn't running.
+ */
+bool coap_server_is_observed(void);
+
+#endif // __COAP_SERVER_H_
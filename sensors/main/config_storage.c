@@ -19,19 +19,30 @@
 #define NVS_STATION_NAME "sta"
 #define NVS_BITFIELD "bits"
 #define NVS_POLL_TIME_SEC "poll"
+#define NVS_HEARTBEAT_POLLS "hb"
 #define NVS_URI "uri"
 #define NVS_IP "ip"
 #define NVS_NETMASK "nm"
 #define NVS_GATEWAY "gw"
 #define NVS_DNS "dns"
+#define NVS_CONFIG_HASH "cfgh"
+#define NVS_RELAY_MAC "rmac"
+#define NVS_PSK "psk"
+#define NVS_AUTH_KEY "akey"
 
 #define NVS_BITFIELD_USE_CELSIUS 0x00000001
 #define NVS_BITFIELD_CACHE_AP    0x00000010
 #define NVS_BITFIELD_USE_DHCP    0x00000100
+#define NVS_BITFIELD_ADAPTIVE    0x00001000
+#define NVS_BITFIELD_FAST_OFF    0x00010000
+#define NVS_BITFIELD_MAINS       0x00100000
+#define NVS_BITFIELD_RELAY       0x01000000
+#define NVS_BITFIELD_RAW_COAP    0x10000000
 
 // defaults
 #define NVS_BITFIELD_DEFAULT (NVS_BITFIELD_USE_CELSIUS | NVS_BITFIELD_CACHE_AP)
 #define POLL_TIME_DEFAULT_SEC 600
+#define HEARTBEAT_POLLS_DEFAULT 1
 
 config_storage_t current_config;
 
@@ -97,6 +108,7 @@ bool read_config_from_nvs(config_storage_t *config)
     nvs_handle handle;
     esp_err_t ret;
     uint32_t bitfield;
+    size_t length;
 
     // zero our structure.
     memset(config, 0, sizeof(config_storage_t));
@@ -115,6 +127,7 @@ bool read_config_from_nvs(config_storage_t *config)
         // One thing we do have to do is set the default polling interval,
         // otherwise it will go nuts polling until the WDT resets it.
         config->poll_time_sec = POLL_TIME_DEFAULT_SEC;
+        config->heartbeat_polls = HEARTBEAT_POLLS_DEFAULT;
     }
     else {
         // Catch any other errors not related to it not being there.
@@ -157,6 +170,41 @@ bool read_config_from_nvs(config_storage_t *config)
             config->use_dhcp = false;
         }
 
+        if (bitfield & NVS_BITFIELD_ADAPTIVE) {
+            config->adaptive_poll = true;
+        }
+        else {
+            config->adaptive_poll = false;
+        }
+
+        if (bitfield & NVS_BITFIELD_FAST_OFF) {
+            config->fast_shutdown = true;
+        }
+        else {
+            config->fast_shutdown = false;
+        }
+
+        if (bitfield & NVS_BITFIELD_MAINS) {
+            config->mains_powered = true;
+        }
+        else {
+            config->mains_powered = false;
+        }
+
+        if (bitfield & NVS_BITFIELD_RELAY) {
+            config->espnow_relay = true;
+        }
+        else {
+            config->espnow_relay = false;
+        }
+
+        if (bitfield & NVS_BITFIELD_RAW_COAP) {
+            config->raw_coap = true;
+        }
+        else {
+            config->raw_coap = false;
+        }
+
         ret = nvs_get_u16(handle, NVS_POLL_TIME_SEC, &config->poll_time_sec);
         if (ret == ESP_ERR_NVS_NOT_FOUND) {
             config->poll_time_sec = POLL_TIME_DEFAULT_SEC;
@@ -164,6 +212,14 @@ bool read_config_from_nvs(config_storage_t *config)
         }
         ESP_ERROR_CHECK(ret);
 
+        ret = nvs_get_u16(handle, NVS_HEARTBEAT_POLLS,
+                          &config->heartbeat_polls);
+        if (ret == ESP_ERR_NVS_NOT_FOUND) {
+            config->heartbeat_polls = HEARTBEAT_POLLS_DEFAULT;
+            ret = ESP_OK;
+        }
+        ESP_ERROR_CHECK(ret);
+
         ESP_ERROR_CHECK(read_config_string_from_nvs(handle, NVS_URI,
             config->uri, sizeof(config->uri)));
 
@@ -173,6 +229,37 @@ bool read_config_from_nvs(config_storage_t *config)
         config->netmask.addr = read_ip_from_nvs(handle, NVS_NETMASK);
         config->gateway.addr = read_ip_from_nvs(handle, NVS_GATEWAY);
         config->dns.addr = read_ip_from_nvs(handle, NVS_DNS);
+
+        ret = nvs_get_u32(handle, NVS_CONFIG_HASH, &config->config_hash);
+        if (ret == ESP_ERR_NVS_NOT_FOUND) {
+            config->config_hash = 0;
+            ret = ESP_OK;
+        }
+        ESP_ERROR_CHECK(ret);
+
+        length = sizeof(config->relay_mac);
+        ret = nvs_get_blob(handle, NVS_RELAY_MAC, config->relay_mac, &length);
+        if (ret == ESP_ERR_NVS_NOT_FOUND) {
+            memset(config->relay_mac, 0, sizeof(config->relay_mac));
+            ret = ESP_OK;
+        }
+        ESP_ERROR_CHECK(ret);
+
+        length = sizeof(config->psk);
+        ret = nvs_get_blob(handle, NVS_PSK, config->psk, &length);
+        if (ret == ESP_ERR_NVS_NOT_FOUND) {
+            memset(config->psk, 0, sizeof(config->psk));
+            ret = ESP_OK;
+        }
+        ESP_ERROR_CHECK(ret);
+
+        length = sizeof(config->auth_key);
+        ret = nvs_get_blob(handle, NVS_AUTH_KEY, config->auth_key, &length);
+        if (ret == ESP_ERR_NVS_NOT_FOUND) {
+            memset(config->auth_key, 0, sizeof(config->auth_key));
+            ret = ESP_OK;
+        }
+        ESP_ERROR_CHECK(ret);
     }
 
     nvs_close(handle);
@@ -180,13 +267,17 @@ bool read_config_from_nvs(config_storage_t *config)
     return true;
 }
 
-bool write_config_to_nvs(config_storage_t *config)
+/**
+ * Helper function to pack the booleans in a config into a bitfield for NVS.
+ *
+ * @param config [in] config whose booleans to pack.
+ *
+ * @return the bitfield.
+ */
+static uint32_t config_bitfield(const config_storage_t *config)
 {
-    nvs_handle handle;
     uint32_t bitfield = 0;
 
-    ESP_ERROR_CHECK(nvs_open(NVS_CONFIG_NAMESPACE, NVS_READWRITE, &handle));
-
     if (config->use_celsius) {
         bitfield |= NVS_BITFIELD_USE_CELSIUS;
     }
@@ -208,22 +299,125 @@ bool write_config_to_nvs(config_storage_t *config)
         bitfield &= ~NVS_BITFIELD_USE_DHCP;
     }    
 
+    if (config->adaptive_poll) {
+        bitfield |= NVS_BITFIELD_ADAPTIVE;
+    }
+    else {
+        bitfield &= ~NVS_BITFIELD_ADAPTIVE;
+    }
+
+    if (config->fast_shutdown) {
+        bitfield |= NVS_BITFIELD_FAST_OFF;
+    }
+    else {
+        bitfield &= ~NVS_BITFIELD_FAST_OFF;
+    }
+
+    if (config->mains_powered) {
+        bitfield |= NVS_BITFIELD_MAINS;
+    }
+    else {
+        bitfield &= ~NVS_BITFIELD_MAINS;
+    }
+
+    if (config->espnow_relay) {
+        bitfield |= NVS_BITFIELD_RELAY;
+    }
+    else {
+        bitfield &= ~NVS_BITFIELD_RELAY;
+    }
+
+    if (config->raw_coap) {
+        bitfield |= NVS_BITFIELD_RAW_COAP;
+    }
+    else {
+        bitfield &= ~NVS_BITFIELD_RAW_COAP;
+    }
+
+    return bitfield;
+}
+
+/**
+ * Helper function to write a config to NVS.
+ *
+ * @param old_config [in] config which is in NVS now, so only the differences
+ *                        get written, or NULL to write everything.
+ * @param config     [in] config to write.
+ *
+ * @return true on success.
+ * @return false on failure.
+ */
+static bool write_config(const config_storage_t *old_config,
+                         const config_storage_t *config)
+{
+    nvs_handle handle;
+    uint32_t bitfield = config_bitfield(config);
+
+    ESP_ERROR_CHECK(nvs_open(NVS_CONFIG_NAMESPACE, NVS_READWRITE, &handle));
+
     // Write out our config items.
-    ESP_ERROR_CHECK(nvs_set_str(handle, NVS_SSID_NAME,
-                                config->ssid));
-    ESP_ERROR_CHECK(nvs_set_str(handle, NVS_PASS_NAME,
-                                config->pass));
-    ESP_ERROR_CHECK(nvs_set_str(handle, NVS_STATION_NAME,
-                                config->station_name));
-    ESP_ERROR_CHECK(nvs_set_u32(handle, NVS_BITFIELD, bitfield))
-    ESP_ERROR_CHECK(nvs_set_u16(handle, NVS_POLL_TIME_SEC,
-                                config->poll_time_sec));
-    ESP_ERROR_CHECK(nvs_set_str(handle, NVS_URI,
-                                config->uri));
-    ESP_ERROR_CHECK(nvs_set_u32(handle, NVS_IP, config->ipaddr.addr));
-    ESP_ERROR_CHECK(nvs_set_u32(handle, NVS_NETMASK, config->netmask.addr));
-    ESP_ERROR_CHECK(nvs_set_u32(handle, NVS_GATEWAY, config->gateway.addr));
-    ESP_ERROR_CHECK(nvs_set_u32(handle, NVS_DNS, config->dns.addr));
+    if (!old_config || strcmp(old_config->ssid, config->ssid) != 0) {
+        ESP_ERROR_CHECK(nvs_set_str(handle, NVS_SSID_NAME,
+                                    config->ssid));
+    }
+    if (!old_config || strcmp(old_config->pass, config->pass) != 0) {
+        ESP_ERROR_CHECK(nvs_set_str(handle, NVS_PASS_NAME,
+                                    config->pass));
+    }
+    if (!old_config ||
+        strcmp(old_config->station_name, config->station_name) != 0) {
+        ESP_ERROR_CHECK(nvs_set_str(handle, NVS_STATION_NAME,
+                                    config->station_name));
+    }
+    if (!old_config || config_bitfield(old_config) != bitfield) {
+        ESP_ERROR_CHECK(nvs_set_u32(handle, NVS_BITFIELD, bitfield))
+    }
+    if (!old_config || old_config->poll_time_sec != config->poll_time_sec) {
+        ESP_ERROR_CHECK(nvs_set_u16(handle, NVS_POLL_TIME_SEC,
+                                    config->poll_time_sec));
+    }
+    if (!old_config ||
+        old_config->heartbeat_polls != config->heartbeat_polls) {
+        ESP_ERROR_CHECK(nvs_set_u16(handle, NVS_HEARTBEAT_POLLS,
+                                    config->heartbeat_polls));
+    }
+    if (!old_config || strcmp(old_config->uri, config->uri) != 0) {
+        ESP_ERROR_CHECK(nvs_set_str(handle, NVS_URI,
+                                    config->uri));
+    }
+    if (!old_config || old_config->ipaddr.addr != config->ipaddr.addr) {
+        ESP_ERROR_CHECK(nvs_set_u32(handle, NVS_IP, config->ipaddr.addr));
+    }
+    if (!old_config || old_config->netmask.addr != config->netmask.addr) {
+        ESP_ERROR_CHECK(nvs_set_u32(handle, NVS_NETMASK,
+                                    config->netmask.addr));
+    }
+    if (!old_config || old_config->gateway.addr != config->gateway.addr) {
+        ESP_ERROR_CHECK(nvs_set_u32(handle, NVS_GATEWAY,
+                                    config->gateway.addr));
+    }
+    if (!old_config || old_config->dns.addr != config->dns.addr) {
+        ESP_ERROR_CHECK(nvs_set_u32(handle, NVS_DNS, config->dns.addr));
+    }
+    if (!old_config || old_config->config_hash != config->config_hash) {
+        ESP_ERROR_CHECK(nvs_set_u32(handle, NVS_CONFIG_HASH,
+                                    config->config_hash));
+    }
+    if (!old_config || memcmp(old_config->relay_mac, config->relay_mac,
+                              sizeof(config->relay_mac)) != 0) {
+        ESP_ERROR_CHECK(nvs_set_blob(handle, NVS_RELAY_MAC, config->relay_mac,
+                                     sizeof(config->relay_mac)));
+    }
+    if (!old_config || memcmp(old_config->psk, config->psk,
+                              sizeof(config->psk)) != 0) {
+        ESP_ERROR_CHECK(nvs_set_blob(handle, NVS_PSK, config->psk,
+                                     sizeof(config->psk)));
+    }
+    if (!old_config || memcmp(old_config->auth_key, config->auth_key,
+                              sizeof(config->auth_key)) != 0) {
+        ESP_ERROR_CHECK(nvs_set_blob(handle, NVS_AUTH_KEY, config->auth_key,
+                                     sizeof(config->auth_key)));
+    }
 
     nvs_commit(handle);
 
@@ -232,6 +426,59 @@ bool write_config_to_nvs(config_storage_t *config)
     return true;
 }
 
+bool write_config_to_nvs(config_storage_t *config)
+{
+    return write_config(NULL, config);
+}
+
+bool write_config_changes_to_nvs(const config_storage_t *old_config,
+                                 const config_storage_t *config)
+{
+    return write_config(old_config, config);
+}
+
+uint32_t config_changes(const config_storage_t *old_config,
+                        const config_storage_t *config)
+{
+    uint32_t changes = 0;
+
+    // The station name is the DHCP hostname, so it's a network change too.
+    if (strcmp(old_config->station_name, config->station_name) != 0) {
+        changes |= CONFIG_CHANGED_NAME | CONFIG_CHANGED_NETWORK;
+    }
+
+    if (strcmp(old_config->ssid, config->ssid) != 0 ||
+        strcmp(old_config->pass, config->pass) != 0 ||
+        old_config->cache_ap_info != config->cache_ap_info ||
+        old_config->use_dhcp != config->use_dhcp ||
+        old_config->ipaddr.addr != config->ipaddr.addr ||
+        old_config->netmask.addr != config->netmask.addr ||
+        old_config->gateway.addr != config->gateway.addr ||
+        old_config->dns.addr != config->dns.addr ||
+        old_config->espnow_relay != config->espnow_relay ||
+        memcmp(old_config->relay_mac, config->relay_mac,
+               sizeof(config->relay_mac)) != 0) {
+        changes |= CONFIG_CHANGED_NETWORK;
+    }
+
+    if (old_config->use_celsius != config->use_celsius ||
+        old_config->poll_time_sec != config->poll_time_sec ||
+        old_config->heartbeat_polls != config->heartbeat_polls ||
+        old_config->adaptive_poll != config->adaptive_poll ||
+        old_config->fast_shutdown != config->fast_shutdown ||
+        old_config->mains_powered != config->mains_powered ||
+        old_config->raw_coap != config->raw_coap ||
+        memcmp(old_config->psk, config->psk, sizeof(config->psk)) != 0 ||
+        memcmp(old_config->auth_key, config->auth_key,
+               sizeof(config->auth_key)) != 0 ||
+        strcmp(old_config->uri, config->uri) != 0 ||
+        old_config->config_hash != config->config_hash) {
+        changes |= CONFIG_CHANGED_OTHER;
+    }
+
+    return changes;
+}
+
 bool is_config_valid(config_storage_t *config)
 {
     // this is somewhat optimized for efficiency by using multiple returns, in
@@ -275,9 +522,68 @@ bool is_config_valid(config_storage_t *config)
         return false;
     }
 
+    // Same for the heartbeat.
+    if (config->heartbeat_polls < 1) {
+        return false;
+    }
+
+    // adaptive_poll only has 2 states, both valid
+
+    // fast_shutdown only has 2 states, both valid
+
+    // mains_powered only has 2 states, both valid
+
+    // espnow_relay only has 2 states, both valid, and relay_mac can be
+    // anything.
+
+    // raw_coap only has 2 states, both valid
+
+    // psk can be anything, and is only needed for coaps:// URIs.
+
+    // auth_key can be anything.
+
     if (strlen(config->uri) == 0) {
         return false;
     }
 
     return true;
-}
\ No newline at end of file
+}
+
+bool is_relay_set(const config_storage_t *config)
+{
+    int i;
+
+    for (i = 0; i < sizeof(config->relay_mac); ++i) {
+        if (config->relay_mac[i] != 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool is_psk_set(const config_storage_t *config)
+{
+    int i;
+
+    for (i = 0; i < sizeof(config->psk); ++i) {
+        if (config->psk[i] != 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool is_auth_key_set(const config_storage_t *config)
+{
+    int i;
+
+    for (i = 0; i < sizeof(config->auth_key); ++i) {
+        if (config->auth_key[i] != 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
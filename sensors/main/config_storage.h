@@ -21,6 +21,23 @@
 /** MAC address length in bytes (not the string) */
 #define MAC_ADDR_LEN 6
 
+/** DTLS pre-shared key length in bytes. */
+#define PSK_LEN 16
+
+/** Report authentication key length in bytes. */
+#define AUTH_KEY_LEN 16
+
+/**
+ * Bits returned by config_changes(), for what needs to be told about a config
+ * change.
+ */
+#define CONFIG_CHANGED_NETWORK 0x01 /**< WiFi needs to reconnect. */
+#define CONFIG_CHANGED_NAME    0x02 /**< The station name, which is also the
+                                         console prompt. */
+#define CONFIG_CHANGED_OTHER   0x04 /**< Anything else. These are all read
+                                         where they're used, so nothing needs
+                                         to be told. */
+
 /**
  * Configuration storage structure.
  */
@@ -39,12 +56,53 @@ typedef struct {
     bool use_celsius;                       /**< Whether to use Celsius or
                                                  Farenheit */
     uint16_t poll_time_sec;                 /**< Poll time in seconds. */
+    uint16_t heartbeat_polls;               /**< Report at least once every
+                                                 this many polls, even if the
+                                                 temperature hasn't changed.
+                                                 1 reports on every poll. */
+    bool adaptive_poll;                     /**< Poll more often while the
+                                                 temperature is moving or near
+                                                 the setpoint. poll_time_sec
+                                                 is then the longest
+                                                 interval. */
+    bool fast_shutdown;                     /**< After a report the
+                                                 controller accepted, go
+                                                 straight to deep sleep
+                                                 rather than shutting WiFi
+                                                 down gracefully. */
+    bool mains_powered;                     /**< Stay connected and sample
+                                                 continuously rather than
+                                                 deep sleeping, for pucks
+                                                 which aren't on batteries. */
+    bool espnow_relay;                      /**< Pass on reports from other
+                                                 pucks, received over
+                                                 ESP-NOW, to the controller.
+                                                 Only on mains power. */
+    uint8_t relay_mac[MAC_ADDR_LEN];        /**< Relay puck to send reports
+                                                 to over ESP-NOW, or all zero
+                                                 to send them straight to
+                                                 the controller. */
+    bool raw_coap;                          /**< Send reports with the
+                                                 minimal CoAP sender rather
+                                                 than libcoap, when the URI
+                                                 allows. */
+    uint8_t psk[PSK_LEN];                   /**< Key for coaps:// URIs, or
+                                                 all zero if there isn't
+                                                 one. */
+    uint8_t auth_key[AUTH_KEY_LEN];         /**< Key to authenticate reports
+                                                 with, or all zero not to. */
     char uri[MAX_URI_LEN+1];                /**< URI to which we should
                                                  publish. */
+    uint32_t config_hash;                   /**< Version of the last config
+                                                 the controller sent us, or 0
+                                                 if none. */
 } config_storage_t;
 
 extern config_storage_t current_config;
 
+/** Config being edited from the console, but not yet saved. */
+extern config_storage_t new_config;
+
 /**
  * Read a config from NVS.
  * @param [out] config Reference to configuration structure to
@@ -66,6 +124,32 @@ bool read_config_from_nvs(config_storage_t *config);
  */
 bool write_config_to_nvs(config_storage_t *config);
 
+/**
+ * Write only the parts of a config which have changed to NVS.
+ *
+ * This saves flash wear, and is a lot quicker than writing the lot.
+ *
+ * @param [in] old_config The config which is in NVS now.
+ * @param [in] config     The config to write.
+ *
+ * @return true on success.
+ * @return false on failure.
+ */
+bool write_config_changes_to_nvs(const config_storage_t *old_config,
+                                 const config_storage_t *config);
+
+/**
+ * Work out what changed between two configs.
+ *
+ * @param [in] old_config The old config.
+ * @param [in] config     The new config.
+ *
+ * @return a combination of the CONFIG_CHANGED_* bits, or 0 if nothing
+ *         changed.
+ */
+uint32_t config_changes(const config_storage_t *old_config,
+                        const config_storage_t *config);
+
 /**
  * Basic configuration check.
  *
@@ -79,4 +163,34 @@ bool write_config_to_nvs(config_storage_t *config);
  */
 bool is_config_valid(config_storage_t *config);
 
+/**
+ * Check whether a config sends its reports through a relay.
+ *
+ * @param config [in] configuration to check.
+ *
+ * @return true if relay_mac is set.
+ * @return false if it isn't.
+ */
+bool is_relay_set(const config_storage_t *config);
+
+/**
+ * Check whether a config has a DTLS pre-shared key.
+ *
+ * @param config [in] configuration to check.
+ *
+ * @return true if psk is set.
+ * @return false if it isn't.
+ */
+bool is_psk_set(const config_storage_t *config);
+
+/**
+ * Check whether a config has a report authentication key.
+ *
+ * @param config [in] configuration to check.
+ *
+ * @return true if auth_key is set.
+ * @return false if it isn't.
+ */
+bool is_auth_key_set(const config_storage_t *config);
+
 #endif // __CONFIG_STORAGE_H_
@@ -22,7 +22,12 @@
 #include "config_storage.h"
 #include "cmd_wifi.h"
 #include "cmd_temperature.h"
+#include "ds18b20_sensor.h"
+#if SIMULATE_DS18B20
+#include "cmd_sim.h"
+#endif // SIMULATE_DS18B20
 #include "priorities.h"
+#include "stacks.h"
 #include "version.h"
 
 // Plain prompt is the station name with a >, a space, and a NUL.
@@ -132,6 +137,9 @@ static void console_task(void *pvParameters)
     register_configure();
     register_wifi();
     register_temperature();
+#if SIMULATE_DS18B20
+    register_sim();
+#endif // SIMULATE_DS18B20
 
     printf("\n"
            LOG_COLOR(LOG_COLOR_BLUE)
@@ -208,5 +216,12 @@ static void console_task(void *pvParameters)
 
 void start_console(void)
 {
-    xTaskCreate(console_task, "console", 2048, NULL, CONSOLE_TASK_PRIORITY, NULL);
+    static StackType_t stack[CONSOLE_TASK_STACK_SIZE];
+    static StaticTask_t tcb;
+    TaskHandle_t handle;
+
+    handle = xTaskCreateStatic(console_task, "console",
+                               CONSOLE_TASK_STACK_SIZE, NULL,
+                               CONSOLE_TASK_PRIORITY, stack, &tcb);
+    stacks_watch(STACK_CONSOLE, handle, CONSOLE_TASK_STACK_SIZE);
 }
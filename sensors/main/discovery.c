@@ -0,0 +1,407 @@
+/**
+ * @file
+ * Finding the controller when it moves.
+ *
+ * Reports go fastest to an IP address, with no DNS lookup, but that breaks
+ * if the controller is renumbered. So when a report doesn't get through,
+ * the puck asks the LAN where the controller is, with a CoAP GET for
+ * /.well-known/core?rt=thermostat.controller, and keeps the address of
+ * whatever answers in NVS. From then on, reports go there instead of the
+ * configured host, until that fails too.
+ *
+ * The request goes to the "All CoAP Nodes" multicast group and to the
+ * broadcast address. The controller's CoAP server can't join a multicast
+ * group, but it hears broadcasts all the same.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "nvs.h"
+
+#include "lwip/ip_addr.h"
+
+#include "coap/coap.h"
+
+#include "discovery.h"
+#include "coap_raw.h"
+#include "config_storage.h"
+#include "rtc_storage.h"
+
+static const char *TAG = "discovery";
+
+#define NVS_DISCOVERY_NAMESPACE "mc-discovery"
+
+/** The configured host the controller was discovered for. */
+#define NVS_HOST_NAME "host"
+
+/** Where it was discovered. */
+#define NVS_ADDR_NAME "addr"
+
+/** Length of our token. */
+#define TOKEN_LEN 4
+
+/** The path and query we ask for. */
+#define WELL_KNOWN ".well-known"
+#define CORE "core"
+#define QUERY "rt=" DISCOVERY_RT
+
+/** What the controller's answer has to include. */
+#define LINK_ATTRIBUTE "rt=\"" DISCOVERY_RT "\""
+
+/** Longest answer we look at. Anything past this is ignored. */
+#define MAX_ANSWER_LEN 512
+
+/** Whether the cache has been read from NVS yet. */
+static bool loaded = false;
+
+/** The configured host the controller was discovered for, or empty. */
+static char cached_host[MAX_URI_LEN + 1];
+
+/** Where it was discovered. */
+static char cached_addr[MAX_IPV4_LEN];
+
+/** The URI with the discovered address swapped in. */
+static char uri_buffer[MAX_URI_LEN + MAX_IPV4_LEN + 1];
+
+/** What came in, which is too big for the stack. */
+static uint8_t answer[MAX_ANSWER_LEN + 1];
+
+/**
+ * Read the cache from NVS, the first time it's needed.
+ */
+static void load_cache(void)
+{
+    nvs_handle handle;
+    size_t length;
+    bool success = false;
+
+    if (loaded) {
+        return;
+    }
+    loaded = true;
+
+    if (nvs_open(NVS_DISCOVERY_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+        length = sizeof(cached_host);
+        if (nvs_get_str(handle, NVS_HOST_NAME, cached_host,
+                        &length) == ESP_OK) {
+            length = sizeof(cached_addr);
+            success = nvs_get_str(handle, NVS_ADDR_NAME, cached_addr,
+                                  &length) == ESP_OK;
+        }
+        nvs_close(handle);
+    }
+
+    if (!success) {
+        cached_host[0] = '\0';
+        cached_addr[0] = '\0';
+    }
+}
+
+/**
+ * Keep where the controller was discovered in NVS.
+ *
+ * @param host [in] The configured host it was discovered for.
+ * @param addr [in] Where it was discovered.
+ */
+static void save_cache(const char *host, const char *addr)
+{
+    nvs_handle handle;
+
+    strncpy(cached_host, host, sizeof(cached_host));
+    strncpy(cached_addr, addr, sizeof(cached_addr));
+
+    if (nvs_open(NVS_DISCOVERY_NAMESPACE, NVS_READWRITE, &handle) ==
+        ESP_OK) {
+        ESP_ERROR_CHECK(nvs_set_str(handle, NVS_HOST_NAME, cached_host));
+        ESP_ERROR_CHECK(nvs_set_str(handle, NVS_ADDR_NAME, cached_addr));
+        nvs_commit(handle);
+        nvs_close(handle);
+    }
+}
+
+/**
+ * Find the host in a URI.
+ *
+ * @param uri    [in]  The URI.
+ * @param host   [out] The host, NUL terminated.
+ * @param size   [in]  Size of host.
+ * @param start  [out] Where the host starts in uri.
+ * @param length [out] How long it is there.
+ *
+ * @return true on success.
+ * @return false if the URI doesn't parse, or the host doesn't fit.
+ */
+static bool split_host(const char *uri, char *host, size_t size,
+                       size_t *start, size_t *length)
+{
+    coap_uri_t parts;
+
+    if (coap_split_uri((const uint8_t *)uri, strlen(uri), &parts) != 0 ||
+        parts.host.length == 0 || parts.host.length >= size) {
+        return false;
+    }
+
+    memcpy(host, parts.host.s, parts.host.length);
+    host[parts.host.length] = '\0';
+    *start = parts.host.s - (const uint8_t *)uri;
+    *length = parts.host.length;
+
+    return true;
+}
+
+/**
+ * Check whether the cache applies to a configured host.
+ *
+ * @param host [in] The host.
+ *
+ * @return true if it does.
+ * @return false if it doesn't.
+ */
+static bool cache_applies(const char *host)
+{
+    load_cache();
+
+    return cached_addr[0] != '\0' && strcmp(cached_host, host) == 0;
+}
+
+const char *discovery_uri(const char *uri)
+{
+    char host[MAX_URI_LEN + 1];
+    size_t start;
+    size_t length;
+
+    if (!split_host(uri, host, sizeof(host), &start, &length) ||
+        !cache_applies(host)) {
+        return uri;
+    }
+
+    snprintf(uri_buffer, sizeof(uri_buffer), "%.*s%s%s", (int)start, uri,
+             cached_addr, uri + start + length);
+
+    return uri_buffer;
+}
+
+bool discovery_wanted(const char *uri)
+{
+    char host[MAX_URI_LEN + 1];
+    ip_addr_t addr;
+    size_t start;
+    size_t length;
+
+    if (!split_host(uri, host, sizeof(host), &start, &length) ||
+        cache_applies(host) || ipaddr_aton(host, &addr)) {
+        return false;
+    }
+
+    // Nothing answered last time, so don't hold up every report asking.
+    if (rtc_storage.discovery_skip > 0) {
+        --rtc_storage.discovery_skip;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Append an option to the request. Only short ones are needed here.
+ *
+ * @param buffer [in] The request.
+ * @param offset [in] Where the option goes.
+ * @param delta  [in] Option number, less that of the last option, under 13.
+ * @param value  [in] Option value, under 269 bytes.
+ *
+ * @return where the next one goes.
+ */
+static size_t add_option(uint8_t *buffer, size_t offset, uint8_t delta,
+                         const char *value)
+{
+    size_t length = strlen(value);
+
+    if (length < 13) {
+        buffer[offset++] = (delta << 4) | length;
+    }
+    else {
+        buffer[offset++] = (delta << 4) | 13;
+        buffer[offset++] = length - 13;
+    }
+
+    memcpy(buffer + offset, value, length);
+    return offset + length;
+}
+
+/**
+ * Send the request to the multicast group and to the broadcast address.
+ *
+ * @param sock    [in] Our socket.
+ * @param request [in] The request.
+ * @param length  [in] Its length.
+ */
+static void send_request(int sock, const uint8_t *request, size_t length)
+{
+    struct sockaddr_in to;
+
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(COAP_DEFAULT_PORT);
+
+    to.sin_addr.s_addr = inet_addr(DISCOVERY_GROUP);
+    if (sendto(sock, request, length, 0, (struct sockaddr *)&to,
+               sizeof(to)) < 0) {
+        ESP_LOGW(TAG, "Sending to " DISCOVERY_GROUP " failed.");
+    }
+
+    to.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+    if (sendto(sock, request, length, 0, (struct sockaddr *)&to,
+               sizeof(to)) < 0) {
+        ESP_LOGW(TAG, "Broadcasting failed.");
+    }
+}
+
+/**
+ * Check whether something that came in is the controller's answer.
+ *
+ * @param length [in] How much of answer came in.
+ * @param token  [in] Our token.
+ *
+ * @return true if it is.
+ * @return false if it isn't.
+ */
+static bool is_answer(size_t length, const uint8_t *token)
+{
+    size_t payload;
+
+    if (length < 4 + TOKEN_LEN || (answer[0] >> 6) != 1 ||
+        (answer[0] & 0x0F) != TOKEN_LEN ||
+        memcmp(answer + 4, token, TOKEN_LEN) != 0 ||
+        answer[1] != COAP_RESPONSE_CODE(205) ||
+        !coap_raw_find_payload(answer, length, &payload)) {
+        return false;
+    }
+
+    answer[length] = '\0';
+    return strstr((const char *)answer + payload, LINK_ATTRIBUTE) != NULL;
+}
+
+/**
+ * Ask where the controller is.
+ *
+ * @param found [out] Its address, MAX_IPV4_LEN long.
+ *
+ * @return true if it answered.
+ * @return false if it didn't.
+ */
+static bool query(char *found)
+{
+    uint8_t request[64];
+    uint8_t token[TOKEN_LEN];
+    uint32_t random = esp_random();
+    struct sockaddr_in from;
+    socklen_t from_len;
+    struct timeval timeout;
+    TickType_t start = xTaskGetTickCount();
+    TickType_t elapsed;
+    TickType_t limit = DISCOVERY_TIMEOUT_MS / portTICK_PERIOD_MS;
+    ip4_addr_t addr;
+    size_t offset;
+    ssize_t length;
+    int enable = 1;
+    int sock;
+    bool success = false;
+
+    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "socket failed");
+        return false;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &enable, sizeof(enable));
+
+    // A non-confirmable GET, as RFC 7252 says multicast requests must be.
+    memcpy(token, &random, sizeof(token));
+    random = esp_random();
+    request[0] = (1 << 6) | (COAP_MESSAGE_NON << 4) | TOKEN_LEN;
+    request[1] = COAP_REQUEST_GET;
+    request[2] = random >> 8;
+    request[3] = random & 0xFF;
+    memcpy(request + 4, token, TOKEN_LEN);
+    offset = 4 + TOKEN_LEN;
+    offset = add_option(request, offset, COAP_OPTION_URI_PATH, WELL_KNOWN);
+    offset = add_option(request, offset, 0, CORE);
+    offset = add_option(request, offset,
+                        COAP_OPTION_URI_QUERY - COAP_OPTION_URI_PATH, QUERY);
+
+    send_request(sock, request, offset);
+
+    // Anything else on the LAN which speaks CoAP may answer too, so keep
+    // going until it's the controller.
+    while (!success) {
+        elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= limit) {
+            break;
+        }
+
+        timeout.tv_sec = 0;
+        timeout.tv_usec = (limit - elapsed) * portTICK_PERIOD_MS * 1000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout));
+
+        from_len = sizeof(from);
+        length = recvfrom(sock, answer, MAX_ANSWER_LEN, 0,
+                          (struct sockaddr *)&from, &from_len);
+        if (length > 0 && is_answer(length, token)) {
+            addr.addr = from.sin_addr.s_addr;
+            ip4addr_ntoa_r(&addr, found, MAX_IPV4_LEN);
+            success = true;
+        }
+    }
+
+    close(sock);
+
+    return success;
+}
+
+bool discover_controller(const char *uri)
+{
+    char host[MAX_URI_LEN + 1];
+    char found[MAX_IPV4_LEN];
+    const char *current;
+    size_t start;
+    size_t length;
+
+    if (!split_host(uri, host, sizeof(host), &start, &length)) {
+        return false;
+    }
+
+    if (!query(found)) {
+        ESP_LOGW(TAG, "The controller didn't answer.");
+        rtc_storage.discovery_skip = DISCOVERY_RETRY_REPORTS;
+        return false;
+    }
+
+    current = cache_applies(host) ? cached_addr : host;
+    if (strcmp(current, found) == 0) {
+        ESP_LOGI(TAG, "The controller is still at %s.", found);
+        return false;
+    }
+
+    ESP_LOGW(TAG, "The controller is at %s now.", found);
+    save_cache(host, found);
+
+    return true;
+}
+
+const char *discovery_address(void)
+{
+    load_cache();
+
+    return cached_addr[0] != '\0' ? cached_addr : NULL;
+}
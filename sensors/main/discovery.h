@@ -0,0 +1,83 @@
+/**
+ * @file
+ * Header file for discovery.c.
+ */
+
+#ifndef __DISCOVERY_H_
+#define __DISCOVERY_H_
+
+#include <stdbool.h>
+
+/** The IPv4 "All CoAP Nodes" multicast group, from RFC 7252. */
+#define DISCOVERY_GROUP "224.0.1.187"
+
+/**
+ * The resource type the controller lists its report resource under, in its
+ * /.well-known/core.
+ */
+#define DISCOVERY_RT "thermostat.controller"
+
+/**
+ * How long to wait for the controller to answer, in ms. It's on the same LAN,
+ * so it's normally a few ms, but NodeRED can be slow to get round to it.
+ */
+#define DISCOVERY_TIMEOUT_MS 1000
+
+/**
+ * How many reports to send without asking where the controller is first,
+ * after nothing answered. That's about two hours at the default poll
+ * interval, so a controller that can't answer only costs a query now and
+ * then, not DISCOVERY_TIMEOUT_MS on every wake.
+ */
+#define DISCOVERY_RETRY_REPORTS 12
+
+/**
+ * Work out the URI to send reports to.
+ *
+ * If the controller was discovered at a new address, this is uri with its
+ * host swapped for that address. That only applies while uri's host is the
+ * one it was discovered for, so changing the URI's host forgets it.
+ *
+ * @param uri [in] The configured URI.
+ *
+ * @return the URI to use, which is good until the next call.
+ */
+const char *discovery_uri(const char *uri);
+
+/**
+ * Check whether it's worth discovering the controller before sending to a
+ * URI, which is when its host is a name rather than an IP address, and
+ * nothing's been discovered for it yet. That saves a DNS lookup on every
+ * wake after the first.
+ *
+ * If nothing answered last time, it isn't, for the next
+ * DISCOVERY_RETRY_REPORTS calls.
+ *
+ * @param uri [in] The configured URI.
+ *
+ * @return true if it is.
+ * @return false if it isn't.
+ */
+bool discovery_wanted(const char *uri);
+
+/**
+ * Look for the controller, with a multicast CoAP GET for its
+ * /.well-known/core, and keep its address in NVS if it's moved.
+ *
+ * @param uri [in] The configured URI.
+ *
+ * @return true if it was found somewhere other than discovery_uri() had it,
+ *         so it's worth trying again.
+ * @return false if it wasn't found, or it's where we thought it was.
+ *
+ * @note Only call this from the WiFi task, while connected.
+ */
+bool discover_controller(const char *uri);
+
+/**
+ * @return the controller's discovered address, as a string.
+ * @return NULL if there isn't one.
+ */
+const char *discovery_address(void);
+
+#endif // __DISCOVERY_H_
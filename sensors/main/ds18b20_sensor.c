@@ -0,0 +1,367 @@
+/**
+ * @file
+ * DS18B20 temperature sensor driver.
+ */
+
+#include "esp_log.h"
+#include <driver/gpio.h>
+#include <ds18x20.h>
+#include <onewire.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "temperature.h"
+#include "ds18b20_sensor.h"
+#if SIMULATE_DS18B20
+#include "ds18b20_sim.h"
+#endif // SIMULATE_DS18B20
+
+static const char *TAG = "ds18b20";
+
+// These need to match init_sensor_gpios() in main.c.
+#define SENSOR_GPIO GPIO_NUM_12
+#define POWER_GPIO GPIO_NUM_13
+
+/* For our config, we want to turn off the high 3 bits and leave the others
+ * alone. Note that, strictly speaking, the DS18B20 only cares about bits 5
+ * and 6 - bit 7 is always zero. But, some other sensors have that high bit
+ * and can use it for other resolutions. But, clearing it should result in the
+ * standard behavior and not bother the actual DS18B20.
+ */
+
+/* Values for the config register for various conversion precisions and
+ * conversion times in ms.
+ *
+ * Note that various third party sensors may use these bits for other purposes;
+ * if so, add them as necessary. This is only tested with the actual Dallas /
+ * Maxim DS18B20.
+ */
+#define DS18B20_12BIT 0x7F
+#define DS18B20_12BIT_TIME 750
+#define DS18B20_11BIT 0x5F
+#define DS18B20_11BIT_TIME 375
+#define DS18B20_10BIT 0x3F
+#define DS18B20_10BIT_TIME 188
+#define DS18B20_9BIT  0x1F
+#define DS18B20_9BIT_TIME 94
+
+/*
+ * Precision and delay selection.
+ */
+#define SENSOR_CONFIG_REG_VALUE DS18B20_12BIT
+#define MEASUREMENT_DELAY_MS DS18B20_12BIT_TIME
+
+/*
+ * The DS18B20 power on reset value (85C), in sensor units.
+ */
+#define DS18B20_POWER_ON_VALUE (85 * TEMP_UNITS_PER_DEGREE)
+
+/*
+ * DS18B20 ALARM SEARCH ROM command. Only devices whose last conversion was at
+ * or above TH, or at or below TL, respond to it.
+ */
+#define DS18B20_ALARM_SEARCH 0xEC
+
+/**
+ * Turn on our sensor.
+ *
+ * @return true, always.
+ */
+static bool ds18b20_power_on(void)
+{
+    /* Turn on the power, and set pullup mode on comms pin so the bus works.
+     * The internal pullup violates the datasheet recommendations, but works,
+     * and saves us an external resistor.
+     */
+    ESP_ERROR_CHECK(gpio_set_level(POWER_GPIO, 1));
+    ESP_ERROR_CHECK(gpio_set_pull_mode(SENSOR_GPIO, GPIO_PULLUP_ONLY));
+
+#if SIMULATE_DS18B20
+    ds18b20_sim_set_power(true);
+#endif // SIMULATE_DS18B20
+
+    return true;
+}
+
+/**
+ * Turn on our sensor and wait for it to settle, for when it's the only thing
+ * we're talking to.
+ */
+static void sensor_on(void)
+{
+    ds18b20_power_on();
+
+    vTaskDelay(SENSOR_ON_DELAY_MS / portTICK_PERIOD_MS);
+}
+
+/**
+ * Turn off our sensor.
+ */
+static void ds18b20_power_off(void)
+{
+    /* We've now gotten the temperature, turn off the power and bus lines,
+     * and pull the bus line down avoid current leakage across the pullup.
+     */
+    ESP_ERROR_CHECK(gpio_set_level(SENSOR_GPIO, 0));
+    ESP_ERROR_CHECK(gpio_set_level(POWER_GPIO, 0));
+    ESP_ERROR_CHECK(gpio_set_pull_mode(SENSOR_GPIO, GPIO_PULLDOWN_ONLY));
+
+#if SIMULATE_DS18B20
+    ds18b20_sim_set_power(false);
+#endif // SIMULATE_DS18B20
+}
+
+/**
+ * Read the raw temperature back from the sensor.
+ *
+ * This is what ds18b20_read_temperature does, minus the conversion to float -
+ * bytes 0 and 1 of the scratchpad are the reading as a signed 16 bit count of
+ * 1/16 degrees C, which is exactly what we want. The library checks the CRC.
+ *
+ * @param temperature [out] pointer to variable to receive the
+ *                          temperature. Only valid on ESP_OK.
+ *
+ * @return an esp_err_t as returned by ds18x20_read_scratchpad.
+ */
+static esp_err_t read_raw_temperature(int16_t *temperature)
+{
+    uint8_t scratchpad[8];
+    esp_err_t ret;
+
+    ret = ds18x20_read_scratchpad(SENSOR_GPIO, DS18X20_ANY, scratchpad);
+    if (ret == ESP_OK) {
+        *temperature = (int16_t)((scratchpad[1] << 8) | scratchpad[0]);
+    }
+
+    return ret;
+}
+
+/**
+ * Start a conversion.
+ *
+ * @return true if the conversion started.
+ * @return false on failure.
+ */
+static bool ds18b20_start_conversion(void)
+{
+    esp_err_t ret;
+    int count;
+
+    // Start measuring. false here means don't wait.
+    ret = ds18x20_measure(SENSOR_GPIO, DS18X20_ANY, false);
+    count = 0;
+    // occasionally we'll fail to start the conversion, so retry until
+    // it succeeds or we give up.
+    while (ret != ESP_OK && count < 5) {
+        ret = ds18x20_measure(SENSOR_GPIO, DS18X20_ANY, false);
+        ++count;
+    }
+    if (count > 0) {
+        ESP_LOGW(TAG, "It took %d tries to start measurement.", count + 1);
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error starting measurement: %s", esp_err_to_name(ret));
+    }
+
+    return ret == ESP_OK;
+}
+
+/**
+ * @return the conversion time for our configured precision.
+ */
+static uint32_t ds18b20_ready_time_ms(void)
+{
+    return MEASUREMENT_DELAY_MS;
+}
+
+/**
+ * Read the temperature back once the conversion is done.
+ *
+ * @param readings [out] the temperature fields are filled in on success.
+ *
+ * @return true if the temperature read succeeded.
+ * @return false if the temperature read failed.
+ */
+static bool ds18b20_read(sensor_readings_t *readings)
+{
+    esp_err_t ret;
+    int16_t temperature;
+    int count;
+
+    ret = read_raw_temperature(&temperature);
+    count = 0;
+    // occasionally we'll get corrupt data (detectable via bad CRC)
+    // so retry the read until it succeeds or we give up.
+    while (ret != ESP_OK && count < 5) {
+        ret = read_raw_temperature(&temperature);
+        ++count;
+    }
+    if (count > 0) {
+        ESP_LOGW(TAG, "It took %d tries to read the temperature.", count + 1);
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error reading temperature: %s", esp_err_to_name(ret));
+        return false;
+    }
+
+    if (temperature == DS18B20_POWER_ON_VALUE) {
+        /* 85 is the power on reset value and sometimes our call to kick off
+         * a temperature conversion silently fails, resulting in no
+         * conversion happening. Since this is for residential HVAC, if we're
+         * ever in that temperature range, no amount of AC is ever going to
+         * save us. So, it's fair to treat this as out of range and sample
+         * again, even though doing so might put us into an infinite loop if
+         * it were ever to get that warm. I'm willing to take that risk.
+         */
+        ESP_LOGW(TAG, "Discarding default reading of 85");
+        return false;
+    }
+
+    readings->temperature = temperature;
+    readings->temperature_valid = true;
+
+    return true;
+}
+
+const sensor_driver_t ds18b20_driver = {
+    .name = "DS18B20",
+    .power_on = ds18b20_power_on,
+    .start_conversion = ds18b20_start_conversion,
+    .ready_time_ms = ds18b20_ready_time_ms,
+    .read = ds18b20_read,
+    .power_off = ds18b20_power_off,
+};
+
+#if CHECK_DS18B20_CONFIG
+bool ds18b20_check_and_fix_configuration(void)
+{
+    // scratchpad holds 8 bytes of data
+    uint8_t scratchpad[8] = {};
+
+    bool success = false;
+    int count = 0;
+    esp_err_t ret;
+
+    sensor_on();
+
+    while (!success && count < 5 ) {
+        ret = ds18x20_read_scratchpad(SENSOR_GPIO, DS18X20_ANY, scratchpad);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Error reading scratchpad: %s",
+                    esp_err_to_name(ret));
+        }
+        else {
+            // The config register is byte index 4
+            if (scratchpad[4] == SENSOR_CONFIG_REG_VALUE) {
+                ESP_LOGI(TAG, "Temperature sensor config is correct.");
+                success = true;
+            }
+            else {
+                scratchpad[4] = SENSOR_CONFIG_REG_VALUE;
+
+                ESP_LOGI(TAG,
+                        "Temperature sensor config is incorrect - rewriting.");
+
+                // We only write bytes 2-4, to the scratchpad.
+                ret = ds18x20_write_scratchpad(SENSOR_GPIO,
+                                            DS18X20_ANY,
+                                            &scratchpad[2]);
+                if (ret != ESP_OK) {
+                    ESP_LOGE(TAG, "Error writing scratchpad: %s",
+                            esp_err_to_name(ret));
+                }
+                else {
+                    // And then save it once it's written.
+                    ret = ds18x20_copy_scratchpad(SENSOR_GPIO, DS18X20_ANY);
+                    if (ret != ESP_OK) {
+                        ESP_LOGE(TAG, "Error copying scratchpad: %s",
+                                esp_err_to_name(ret));
+                    }
+                    else {
+                        success = true;
+                    }
+                }
+            }
+        }
+        ++count;
+    }
+
+    ds18b20_power_off();
+
+    return success;
+}
+#endif // CHECK_DS18B20_CONFIG
+
+alarm_result_t ds18b20_check_alarm(int8_t alarm_high, int8_t alarm_low,
+                                   int16_t *temperature)
+{
+    // TH, TL, config register - in the order the sensor expects them.
+    uint8_t scratchpad[3] = {
+        (uint8_t)alarm_high,
+        (uint8_t)alarm_low,
+        SENSOR_CONFIG_REG_VALUE,
+    };
+    alarm_result_t result = ALARM_ERROR;
+    esp_err_t ret;
+    int bits;
+    int count;
+
+    sensor_on();
+
+    ret = ds18x20_write_scratchpad(SENSOR_GPIO, DS18X20_ANY, scratchpad);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error writing alarm thresholds: %s",
+                 esp_err_to_name(ret));
+    }
+    else {
+        ret = ds18x20_measure(SENSOR_GPIO, DS18X20_ANY, false);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Error starting measurement: %s",
+                     esp_err_to_name(ret));
+        }
+        else {
+            vTaskDelay((MEASUREMENT_DELAY_MS / portTICK_PERIOD_MS) + 1);
+
+            if (!onewire_reset(SENSOR_GPIO)) {
+                ESP_LOGE(TAG, "No presence pulse for alarm search.");
+            }
+            else if (!onewire_write(SENSOR_GPIO, DS18B20_ALARM_SEARCH)) {
+                ESP_LOGE(TAG, "Error sending alarm search.");
+            }
+            else {
+                bits = onewire_read(SENSOR_GPIO);
+                if (bits < 0) {
+                    ESP_LOGE(TAG, "Error reading alarm search response.");
+                }
+                else if ((bits & 0x03) == 0x03) {
+                    result = ALARM_CLEAR;
+                }
+                else {
+                    // The sensor is still powered, so the conversion is still
+                    // in the scratchpad. Read it out while we're here.
+                    ret = read_raw_temperature(temperature);
+                    count = 0;
+                    while (ret != ESP_OK && count < 5) {
+                        ret = read_raw_temperature(temperature);
+                        ++count;
+                    }
+                    if (ret != ESP_OK) {
+                        ESP_LOGE(TAG, "Error reading temperature: %s",
+                                 esp_err_to_name(ret));
+                    }
+                    else if (*temperature == DS18B20_POWER_ON_VALUE) {
+                        // Conversion silently failed, see ds18b20_read().
+                        ESP_LOGW(TAG, "Discarding default reading of 85");
+                    }
+                    else {
+                        result = ALARM_TRIPPED;
+                    }
+                }
+            }
+        }
+    }
+
+    ds18b20_power_off();
+
+    return result;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file
+ * Header file for ds18b20_sensor.c.
+ */
+
+#ifndef __DS18B20_SENSOR_H_
+#define __DS18B20_SENSOR_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sensors.h"
+
+/*
+ * If we are running the DS18B20 in its default mode (12 bit resolution), we
+ * don't need to update the config because new parts will be set to the
+ * defaults. However, if not, this needs to be set to 1 so we update the config
+ * accordingly.
+ */
+#define CHECK_DS18B20_CONFIG 1
+
+/*
+ * Set this to 1 to replace the DS18B20 with the simulator in ds18b20_sim.c,
+ * so the acquisition code can be exercised and timed on a bare board. See the
+ * "sim" console command for fault injection.
+ */
+#define SIMULATE_DS18B20 0
+
+/**
+ * Results of ds18b20_check_alarm().
+ */
+typedef enum {
+    ALARM_CLEAR,    /**< Inside the thresholds. */
+    ALARM_TRIPPED,  /**< Outside the thresholds; the reading is valid. */
+    ALARM_ERROR,    /**< Something went wrong talking to the sensor. */
+} alarm_result_t;
+
+/**
+ * The DS18B20 driver, for the table in sensors.c.
+ */
+extern const sensor_driver_t ds18b20_driver;
+
+#if CHECK_DS18B20_CONFIG
+/**
+ * Check and (optionally) fix the configuration.
+ *
+ * @return true the configuration was or is now correct.
+ * @return false if there was any sort of error.
+ */
+bool ds18b20_check_and_fix_configuration(void);
+#endif // CHECK_DS18B20_CONFIG
+
+/**
+ * Do a conversion and see if it trips the alarm thresholds.
+ *
+ * This is the entirety of a radio-off wake, so it does the bare minimum: write
+ * TH/TL/config to the scratchpad, convert, and do an ALARM SEARCH to see if
+ * the sensor flagged it. We only read the temperature back if it did.
+ *
+ * With only one sensor on the bus we don't need to walk the whole search -
+ * any device in alarm pulls one of the first two bits (the ROM bit and its
+ * complement) low, so if both come back high, nobody is in alarm. The
+ * remaining slots of the byte read look like writing 1s to the device, which
+ * just deselects it, and the next reset clears the search anyway.
+ *
+ * @param alarm_high  [in]  TH register value, in whole degrees C.
+ * @param alarm_low   [in]  TL register value, in whole degrees C.
+ * @param temperature [out] pointer to variable to receive the
+ *                          temperature, in 1/16 degree C. Only valid if the
+ *                          function returns ALARM_TRIPPED.
+ *
+ * @return ALARM_CLEAR if the temperature is still inside the thresholds.
+ * @return ALARM_TRIPPED if it has moved outside of them.
+ * @return ALARM_ERROR if anything went wrong, so the caller can fall back to
+ *         a full read and report the problem rather than hiding it.
+ */
+alarm_result_t ds18b20_check_alarm(int8_t alarm_high, int8_t alarm_low,
+                                   int16_t *temperature);
+
+#endif // __DS18B20_SENSOR_H_
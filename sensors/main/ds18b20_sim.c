@@ -0,0 +1,305 @@
+/**
+ * @file
+ * Simulated DS18B20, for exercising the acquisition code without a sensor.
+ *
+ * This stands in for the ds18x20 and onewire library calls made by
+ * ds18b20_sensor.c (see ds18b20_sim.h), and models the parts of the sensor's
+ * behavior that our retry logic has to cope with - missing presence pulses,
+ * corrupt reads, conversions that silently don't happen and leave the 85C
+ * power on value behind, and conversion times that depend on resolution.
+ *
+ * The EEPROM copy of TH/TL/config is kept in RTC memory, so it persists
+ * across deep sleep like the real thing, but not across a power cycle. So are
+ * the settings, so a scenario set up from the console carries on over as many
+ * wakes as it takes.
+ */
+
+#include "ds18b20_sensor.h"
+
+#if SIMULATE_DS18B20
+
+#include <string.h> // for memcpy, memset
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "temperature.h"
+#include "ds18b20_sim.h"
+
+static const char *TAG = "ds18b20_sim";
+
+#define DS18B20_COPY_SCRATCHPAD_TIME_MS 10
+#define DS18B20_ALARM_SEARCH 0xEC
+
+/** Arbitrary value marking the simulated EEPROM as initialized. */
+#define SIM_EEPROM_MAGIC 0x53494D45
+
+/** Arbitrary value marking the settings as initialized. */
+#define SIM_SETTINGS_MAGIC 0x53494D53
+
+/** Temperature reported until it's set from the console. */
+#define SIM_DEFAULT_TEMPERATURE (20 * TEMP_UNITS_PER_DEGREE)
+
+/*
+ * Factory defaults for TH, TL and config - 75C, 70C and 12 bit.
+ */
+#define DS18B20_DEFAULT_TH 0x4B
+#define DS18B20_DEFAULT_TL 0x46
+#define DS18B20_DEFAULT_CONFIG 0x7F
+
+/*
+ * Scratchpad layout.
+ */
+#define SCRATCHPAD_TEMP_LSB 0
+#define SCRATCHPAD_TEMP_MSB 1
+#define SCRATCHPAD_TH 2
+#define SCRATCHPAD_TL 3
+#define SCRATCHPAD_CONFIG 4
+#define SCRATCHPAD_CRC 8
+#define SCRATCHPAD_LEN 9
+
+RTC_DATA_ATTR ds18b20_sim_settings_t ds18b20_sim_settings;
+
+ds18b20_sim_stats_t ds18b20_sim_stats;
+
+RTC_DATA_ATTR static uint32_t settings_magic;
+RTC_DATA_ATTR static uint32_t eeprom_magic;
+RTC_DATA_ATTR static uint8_t eeprom[3];
+
+static bool powered = false;
+static uint8_t scratchpad[SCRATCHPAD_LEN];
+static uint8_t last_command;
+
+static bool conversion_pending = false;
+static bool conversion_stuck = false;
+static int64_t conversion_start_us;
+
+/**
+ * Decide whether to inject a fault.
+ *
+ * @param rate Percent chance of the fault.
+ *
+ * @return true if the fault should happen this time.
+ */
+static bool inject(uint8_t rate)
+{
+    if (rate > 0 && esp_random() % 100 < rate) {
+        ++ds18b20_sim_stats.faults;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @return the conversion time, in ms, for the current settings.
+ */
+static uint32_t conversion_time_ms(void)
+{
+    // Indexed by the R1 and R0 bits of the config register.
+    static const uint32_t times[] = { 94, 188, 375, 750 };
+
+    if (ds18b20_sim_settings.conversion_ms > 0) {
+        return ds18b20_sim_settings.conversion_ms;
+    }
+
+    return times[(scratchpad[SCRATCHPAD_CONFIG] >> 5) & 0x03];
+}
+
+/**
+ * Finish any conversion whose time is up.
+ *
+ * @return true if no conversion is still in progress.
+ */
+static bool update_conversion(void)
+{
+    int16_t temperature;
+    int unused_bits;
+
+    if (!conversion_pending) {
+        return true;
+    }
+
+    if (esp_timer_get_time() - conversion_start_us <
+        (int64_t)conversion_time_ms() * 1000) {
+        return false;
+    }
+
+    conversion_pending = false;
+
+    if (!conversion_stuck) {
+        // Lower resolutions leave the low bits undefined; the real part
+        // zeroes them.
+        unused_bits = 3 - ((scratchpad[SCRATCHPAD_CONFIG] >> 5) & 0x03);
+        temperature = ds18b20_sim_settings.temperature &
+                      ~((1 << unused_bits) - 1);
+
+        scratchpad[SCRATCHPAD_TEMP_LSB] = (uint8_t)(temperature & 0xFF);
+        scratchpad[SCRATCHPAD_TEMP_MSB] = (uint8_t)((temperature >> 8) & 0xFF);
+    }
+
+    return true;
+}
+
+/**
+ * Check whether the last conversion is outside TH and TL.
+ *
+ * @return true if the sensor would respond to an ALARM SEARCH.
+ */
+static bool in_alarm(void)
+{
+    int16_t temperature = (int16_t)((scratchpad[SCRATCHPAD_TEMP_MSB] << 8) |
+                                    scratchpad[SCRATCHPAD_TEMP_LSB]);
+    int whole = temperature >> 4;
+
+    return whole >= (int8_t)scratchpad[SCRATCHPAD_TH] ||
+           whole <= (int8_t)scratchpad[SCRATCHPAD_TL];
+}
+
+void ds18b20_sim_init(void)
+{
+    if (settings_magic != SIM_SETTINGS_MAGIC) {
+        memset(&ds18b20_sim_settings, 0, sizeof(ds18b20_sim_settings));
+        ds18b20_sim_settings.temperature = SIM_DEFAULT_TEMPERATURE;
+        settings_magic = SIM_SETTINGS_MAGIC;
+    }
+}
+
+void ds18b20_sim_set_power(bool on)
+{
+    ds18b20_sim_init();
+
+    if (on && !powered) {
+        if (eeprom_magic != SIM_EEPROM_MAGIC) {
+            eeprom[0] = DS18B20_DEFAULT_TH;
+            eeprom[1] = DS18B20_DEFAULT_TL;
+            eeprom[2] = DS18B20_DEFAULT_CONFIG;
+            eeprom_magic = SIM_EEPROM_MAGIC;
+        }
+
+        scratchpad[SCRATCHPAD_TEMP_LSB] = 0x50;
+        scratchpad[SCRATCHPAD_TEMP_MSB] = 0x05;
+        memcpy(&scratchpad[SCRATCHPAD_TH], eeprom, sizeof(eeprom));
+        scratchpad[5] = 0xFF;
+        scratchpad[6] = 0x0C;
+        scratchpad[7] = 0x10;
+        conversion_pending = false;
+    }
+
+    powered = on;
+}
+
+void ds18b20_sim_reset_stats(void)
+{
+    memset(&ds18b20_sim_stats, 0, sizeof(ds18b20_sim_stats));
+}
+
+bool ds18b20_sim_onewire_reset(gpio_num_t pin)
+{
+    ++ds18b20_sim_stats.resets;
+    last_command = 0;
+
+    return powered && !inject(ds18b20_sim_settings.no_presence_rate);
+}
+
+bool ds18b20_sim_onewire_write(gpio_num_t pin, uint8_t v)
+{
+    last_command = v;
+
+    return true;
+}
+
+int ds18b20_sim_onewire_read(gpio_num_t pin)
+{
+    if (!powered) {
+        // Nothing pulling the bus up.
+        return 0x00;
+    }
+
+    if (last_command == DS18B20_ALARM_SEARCH) {
+        update_conversion();
+
+        // First bit is bit 0 of the family code (0x28), then its complement,
+        // then 1s as nothing else answers. Without an alarm, nobody answers
+        // at all.
+        return in_alarm() ? 0xFE : 0xFF;
+    }
+
+    return 0xFF;
+}
+
+esp_err_t ds18b20_sim_measure(gpio_num_t pin, ds18x20_addr_t addr, bool wait)
+{
+    if (!ds18b20_sim_onewire_reset(pin)) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    ++ds18b20_sim_stats.conversions;
+    conversion_pending = true;
+    conversion_stuck = inject(ds18b20_sim_settings.stuck_rate);
+    conversion_start_us = esp_timer_get_time();
+
+    if (wait) {
+        vTaskDelay(conversion_time_ms() / portTICK_PERIOD_MS + 1);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t ds18b20_sim_read_scratchpad(gpio_num_t pin, ds18x20_addr_t addr,
+                                      uint8_t *buffer)
+{
+    if (!ds18b20_sim_onewire_reset(pin)) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    ++ds18b20_sim_stats.scratchpad_reads;
+
+    if (!update_conversion()) {
+        // The real part just gives back whatever was there before.
+        ++ds18b20_sim_stats.early_reads;
+        ESP_LOGW(TAG, "Scratchpad read before conversion finished.");
+    }
+
+    if (inject(ds18b20_sim_settings.crc_error_rate)) {
+        // This is what the library returns when the CRC doesn't match.
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    scratchpad[SCRATCHPAD_CRC] = onewire_crc8(scratchpad, SCRATCHPAD_CRC);
+    // The library reads all 9 bytes, checks the CRC and gives back 8.
+    memcpy(buffer, scratchpad, SCRATCHPAD_CRC);
+
+    return ESP_OK;
+}
+
+esp_err_t ds18b20_sim_write_scratchpad(gpio_num_t pin, ds18x20_addr_t addr,
+                                       uint8_t *buffer)
+{
+    if (!ds18b20_sim_onewire_reset(pin)) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    memcpy(&scratchpad[SCRATCHPAD_TH], buffer, 3);
+
+    return ESP_OK;
+}
+
+esp_err_t ds18b20_sim_copy_scratchpad(gpio_num_t pin, ds18x20_addr_t addr)
+{
+    if (!ds18b20_sim_onewire_reset(pin)) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    ++ds18b20_sim_stats.eeprom_writes;
+    memcpy(eeprom, &scratchpad[SCRATCHPAD_TH], sizeof(eeprom));
+
+    vTaskDelay(DS18B20_COPY_SCRATCHPAD_TIME_MS / portTICK_PERIOD_MS);
+
+    return ESP_OK;
+}
+
+#endif // SIMULATE_DS18B20
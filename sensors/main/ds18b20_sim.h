@@ -0,0 +1,101 @@
+/**
+ * @file
+ * Header file for ds18b20_sim.c.
+ *
+ * This is only included by ds18b20_sensor.c when SIMULATE_DS18B20 is set. It
+ * redirects the ds18x20 and onewire calls it makes to the simulator, so the
+ * driver code itself is exactly what runs against real hardware.
+ */
+
+#ifndef __DS18B20_SIM_H_
+#define __DS18B20_SIM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+// Pull in the real declarations first, so the types are there and the
+// redirects below don't rename the real prototypes.
+#include <ds18x20.h>
+#include <onewire.h>
+
+/**
+ * Fault injection and timing settings for the simulator. Rates are percent
+ * chances per operation.
+ */
+typedef struct {
+    int16_t temperature;        /**< Temperature to report, in 1/16
+                                     degree C. */
+    uint8_t no_presence_rate;   /**< Chance of a missing presence pulse. */
+    uint8_t crc_error_rate;     /**< Chance of a corrupt scratchpad read. */
+    uint8_t stuck_rate;         /**< Chance a conversion silently doesn't
+                                     happen, leaving the old value (or 85C
+                                     after power on) in the scratchpad. */
+    uint32_t conversion_ms;     /**< Conversion time, or 0 to use the
+                                     datasheet time for the resolution in the
+                                     config register. */
+} ds18b20_sim_settings_t;
+
+/**
+ * Counters for what the simulator saw, so retry behavior can be checked.
+ */
+typedef struct {
+    uint32_t resets;            /**< Bus resets. */
+    uint32_t conversions;       /**< Conversions started. */
+    uint32_t scratchpad_reads;  /**< Scratchpad reads. */
+    uint32_t eeprom_writes;     /**< Copies of the scratchpad to EEPROM. */
+    uint32_t early_reads;       /**< Reads before a conversion finished. */
+    uint32_t faults;            /**< Faults injected, of all kinds. */
+} ds18b20_sim_stats_t;
+
+/**
+ * The current settings. These can be changed at any time, and are kept in RTC
+ * memory, so they last until a power cycle.
+ *
+ * @note Call ds18b20_sim_init() before using them.
+ */
+extern ds18b20_sim_settings_t ds18b20_sim_settings;
+
+/**
+ * The counters, since boot or the last ds18b20_sim_reset_stats().
+ */
+extern ds18b20_sim_stats_t ds18b20_sim_stats;
+
+/**
+ * Set up the settings with their defaults after a power cycle. Otherwise,
+ * they're left as they were before the deep sleep.
+ */
+void ds18b20_sim_init(void);
+
+/**
+ * Tell the simulator the sensor has been powered on or off.
+ *
+ * Powering on reloads the scratchpad from EEPROM and resets the temperature
+ * to 85C, as the real part does.
+ *
+ * @param on true for on, false for off.
+ */
+void ds18b20_sim_set_power(bool on);
+
+/**
+ * Zero the counters.
+ */
+void ds18b20_sim_reset_stats(void);
+
+esp_err_t ds18b20_sim_measure(gpio_num_t pin, ds18x20_addr_t addr, bool wait);
+esp_err_t ds18b20_sim_read_scratchpad(gpio_num_t pin, ds18x20_addr_t addr,
+                                      uint8_t *buffer);
+esp_err_t ds18b20_sim_write_scratchpad(gpio_num_t pin, ds18x20_addr_t addr,
+                                       uint8_t *buffer);
+esp_err_t ds18b20_sim_copy_scratchpad(gpio_num_t pin, ds18x20_addr_t addr);
+bool ds18b20_sim_onewire_reset(gpio_num_t pin);
+bool ds18b20_sim_onewire_write(gpio_num_t pin, uint8_t v);
+int ds18b20_sim_onewire_read(gpio_num_t pin);
+
+#define ds18x20_measure ds18b20_sim_measure
+#define ds18x20_read_scratchpad ds18b20_sim_read_scratchpad
+#define ds18x20_write_scratchpad ds18b20_sim_write_scratchpad
+#define ds18x20_copy_scratchpad ds18b20_sim_copy_scratchpad
+#define onewire_reset ds18b20_sim_onewire_reset
+#define onewire_write ds18b20_sim_onewire_write
+#define onewire_read ds18b20_sim_onewire_read
+
+#endif // __DS18B20_SIM_H_
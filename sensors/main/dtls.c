@@ -0,0 +1,511 @@
+/**
+ * @file
+ * CoAP over DTLS, with a pre-shared key.
+ *
+ * The libcoap in this SDK is built without DTLS, so this uses mbedtls
+ * directly, and sends the same prebuilt request as the minimal CoAP sender.
+ * See coap_raw.c.
+ *
+ * The full handshake costs several round trips and a fair bit of CPU, which
+ * a battery puck would pay on every wake. So once it's done, the session's ID
+ * and master secret are kept in RTC memory, which survives deep sleep, and
+ * offered to the server next time. If the server still has the session, that
+ * gets an abbreviated handshake, which is one round trip and no key exchange.
+ * If it doesn't, it just does a full handshake, and that session is kept
+ * instead.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+#include "mbedtls/ssl.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/error.h"
+
+#include "dtls.h"
+#include "coap_raw.h"
+#include "config_storage.h"
+#include "rtc_storage.h"
+
+static const char *TAG = "dtls";
+
+/** Longest port number string - "65535\0" */
+#define MAX_PORT_LEN 6
+
+/**
+ * Ciphersuites we offer, in order of preference. These are the PSK only
+ * ones, so there's no public key maths at all. CCM_8 is the one RFC 7252
+ * asks for; the others are there in case the server doesn't do it.
+ */
+static const int ciphersuites[] = {
+    MBEDTLS_TLS_PSK_WITH_AES_128_CCM_8,
+    MBEDTLS_TLS_PSK_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_PSK_WITH_AES_128_CBC_SHA256,
+    0
+};
+
+/**
+ * The timer mbedtls needs to resend handshake messages. mbedtls has one, but
+ * it isn't built for this SDK, so this is the same thing on esp_timer.
+ */
+typedef struct {
+    int64_t start_us;   /**< When it was set. */
+    uint32_t int_ms;    /**< Intermediate delay. */
+    uint32_t fin_ms;    /**< Final delay, or 0 if it's cancelled. */
+} dtls_timer_t;
+
+static mbedtls_ssl_context ssl;
+static mbedtls_ssl_config conf;
+static mbedtls_net_context net;
+static dtls_timer_t timer;
+
+/** Whether the above are set up and the handshake is done. */
+static bool session_open = false;
+
+/** What came in, which is too big for the stack. */
+static uint8_t received[COAP_RAW_MAX_LEN];
+
+/**
+ * Log an mbedtls error.
+ *
+ * @param what   [in] What returned it.
+ * @param result [in] What it returned.
+ */
+static void log_error(const char *what, int result)
+{
+    char message[64];
+
+    mbedtls_strerror(result, message, sizeof(message));
+    ESP_LOGE(TAG, "%s returned -0x%04x: %s", what, -result, message);
+}
+
+/**
+ * Random numbers for mbedtls, from the hardware RNG.
+ *
+ * @param ctx    [in]  Unused.
+ * @param output [out] Where to put them.
+ * @param length [in]  How many bytes.
+ *
+ * @return 0, always.
+ */
+static int random_bytes(void *ctx, unsigned char *output, size_t length)
+{
+    uint32_t value;
+    size_t chunk;
+
+    while (length > 0) {
+        value = esp_random();
+        chunk = length < sizeof(value) ? length : sizeof(value);
+        memcpy(output, &value, chunk);
+        output += chunk;
+        length -= chunk;
+    }
+
+    return 0;
+}
+
+/**
+ * Set or cancel the timer.
+ *
+ * @param ctx    [in] The timer.
+ * @param int_ms [in] Intermediate delay.
+ * @param fin_ms [in] Final delay, or 0 to cancel it.
+ */
+static void timer_set(void *ctx, uint32_t int_ms, uint32_t fin_ms)
+{
+    dtls_timer_t *t = ctx;
+
+    t->start_us = esp_timer_get_time();
+    t->int_ms = int_ms;
+    t->fin_ms = fin_ms;
+}
+
+/**
+ * Check the timer.
+ *
+ * @param ctx [in] The timer.
+ *
+ * @return -1 if it's cancelled.
+ * @return 0 if neither delay has passed.
+ * @return 1 if only the intermediate one has.
+ * @return 2 if the final one has.
+ */
+static int timer_get(void *ctx)
+{
+    dtls_timer_t *t = ctx;
+    uint32_t elapsed_ms;
+
+    if (t->fin_ms == 0) {
+        return -1;
+    }
+
+    elapsed_ms = (esp_timer_get_time() - t->start_us) / 1000;
+    if (elapsed_ms >= t->fin_ms) {
+        return 2;
+    }
+    if (elapsed_ms >= t->int_ms) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Tear down everything, without telling the server.
+ */
+static void teardown(void)
+{
+    mbedtls_net_free(&net);
+    mbedtls_ssl_free(&ssl);
+    mbedtls_ssl_config_free(&conf);
+    session_open = false;
+}
+
+/**
+ * Forget the session kept in RTC memory, so the next handshake is a full
+ * one.
+ */
+static void forget_session(void)
+{
+    rtc_storage.dtls_session_valid = false;
+    memset(rtc_storage.dtls_master, 0, sizeof(rtc_storage.dtls_master));
+}
+
+/**
+ * Offer the session kept in RTC memory to the server, if there is one.
+ *
+ * @return true if one was offered.
+ * @return false if there wasn't one.
+ */
+static bool offer_session(void)
+{
+    mbedtls_ssl_session session;
+    int result;
+
+    if (!rtc_storage.dtls_session_valid) {
+        return false;
+    }
+
+    mbedtls_ssl_session_init(&session);
+    session.ciphersuite = rtc_storage.dtls_ciphersuite;
+    session.compression = MBEDTLS_SSL_COMPRESS_NULL;
+    session.id_len = rtc_storage.dtls_id_len;
+    memcpy(session.id, rtc_storage.dtls_id, sizeof(session.id));
+    memcpy(session.master, rtc_storage.dtls_master, sizeof(session.master));
+
+    result = mbedtls_ssl_set_session(&ssl, &session);
+    mbedtls_ssl_session_free(&session);
+
+    if (result != 0) {
+        log_error("mbedtls_ssl_set_session", result);
+        forget_session();
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Keep the session we ended up with in RTC memory, unless it's the one we
+ * offered.
+ *
+ * @param offered [in] Whether we offered the one in RTC memory.
+ *
+ * @return true if the server resumed the one we offered.
+ * @return false if it's a new one.
+ */
+static bool keep_session(bool offered)
+{
+    mbedtls_ssl_session session;
+    bool resumed = false;
+    int result;
+
+    mbedtls_ssl_session_init(&session);
+
+    result = mbedtls_ssl_get_session(&ssl, &session);
+    if (result != 0) {
+        log_error("mbedtls_ssl_get_session", result);
+        forget_session();
+    }
+    // The server answers with the ID we offered only if it resumed it.
+    else if (offered && session.id_len == rtc_storage.dtls_id_len &&
+             memcmp(session.id, rtc_storage.dtls_id, session.id_len) == 0) {
+        resumed = true;
+    }
+    // No ID means the server has no session cache, so there's nothing to
+    // resume next time.
+    else if (session.id_len == 0 ||
+             session.id_len > sizeof(rtc_storage.dtls_id)) {
+        forget_session();
+    }
+    else {
+        rtc_storage.dtls_ciphersuite = session.ciphersuite;
+        rtc_storage.dtls_id_len = session.id_len;
+        memcpy(rtc_storage.dtls_id, session.id, session.id_len);
+        memcpy(rtc_storage.dtls_master, session.master,
+               sizeof(rtc_storage.dtls_master));
+        rtc_storage.dtls_session_valid = true;
+    }
+
+    mbedtls_ssl_session_free(&session);
+
+    return resumed;
+}
+
+/**
+ * Set up mbedtls, connect the socket and do the handshake.
+ *
+ * @param resume [in] Whether to offer the session kept in RTC memory.
+ *
+ * @return true if the handshake is done.
+ * @return false if it isn't, in which case everything is torn down again.
+ */
+static bool handshake(bool resume)
+{
+    int64_t start = esp_timer_get_time();
+    char port[MAX_PORT_LEN];
+    bool offered = false;
+    int result;
+
+    mbedtls_net_init(&net);
+    mbedtls_ssl_init(&ssl);
+    mbedtls_ssl_config_init(&conf);
+
+    result = mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT,
+                                         MBEDTLS_SSL_TRANSPORT_DATAGRAM,
+                                         MBEDTLS_SSL_PRESET_DEFAULT);
+    if (result != 0) {
+        log_error("mbedtls_ssl_config_defaults", result);
+        goto fail;
+    }
+
+    mbedtls_ssl_conf_rng(&conf, random_bytes, NULL);
+    mbedtls_ssl_conf_ciphersuites(&conf, ciphersuites);
+    mbedtls_ssl_conf_handshake_timeout(&conf, DTLS_HANDSHAKE_MIN_MS,
+                                       DTLS_HANDSHAKE_MAX_MS);
+    // Tickets would need more RTC memory than a session ID, and the server
+    // would have to keep its ticket key across restarts anyway.
+    mbedtls_ssl_conf_session_tickets(&conf,
+                                     MBEDTLS_SSL_SESSION_TICKETS_DISABLED);
+
+    result = mbedtls_ssl_conf_psk(&conf, current_config.psk,
+                                  sizeof(current_config.psk),
+                                  (const unsigned char *)
+                                  current_config.station_name,
+                                  strlen(current_config.station_name));
+    if (result != 0) {
+        log_error("mbedtls_ssl_conf_psk", result);
+        goto fail;
+    }
+
+    result = mbedtls_ssl_setup(&ssl, &conf);
+    if (result != 0) {
+        log_error("mbedtls_ssl_setup", result);
+        goto fail;
+    }
+
+    // The host is always an IP address, so this doesn't do a DNS lookup.
+    snprintf(port, sizeof(port), "%u", coap_raw_port());
+    result = mbedtls_net_connect(&net, coap_raw_host(), port,
+                                 MBEDTLS_NET_PROTO_UDP);
+    if (result != 0) {
+        log_error("mbedtls_net_connect", result);
+        goto fail;
+    }
+
+    mbedtls_ssl_set_bio(&ssl, &net, mbedtls_net_send, NULL,
+                        mbedtls_net_recv_timeout);
+    mbedtls_ssl_set_timer_cb(&ssl, &timer, timer_set, timer_get);
+
+    if (resume) {
+        offered = offer_session();
+    }
+
+    do {
+        result = mbedtls_ssl_handshake(&ssl);
+    } while (result == MBEDTLS_ERR_SSL_WANT_READ ||
+             result == MBEDTLS_ERR_SSL_WANT_WRITE);
+
+    if (result != 0) {
+        log_error("mbedtls_ssl_handshake", result);
+        goto fail;
+    }
+
+    if (keep_session(offered)) {
+        ESP_LOGI(TAG, "Resumed handshake took %ums.",
+                 (uint32_t)((esp_timer_get_time() - start) / 1000));
+    }
+    else {
+        ESP_LOGI(TAG, "Full handshake took %ums.",
+                 (uint32_t)((esp_timer_get_time() - start) / 1000));
+    }
+
+    session_open = true;
+    return true;
+
+fail:
+    teardown();
+    return false;
+}
+
+/**
+ * Open the DTLS session, unless it's already open.
+ *
+ * @return true if it's open.
+ * @return false if it couldn't be.
+ */
+static bool dtls_open(void)
+{
+    if (session_open) {
+        return true;
+    }
+
+    if (handshake(true)) {
+        return true;
+    }
+
+    // The server may have thrown away the session we offered in a way that
+    // fails the handshake, rather than falling back to a full one. Either
+    // way, don't offer it again.
+    if (rtc_storage.dtls_session_valid) {
+        ESP_LOGW(TAG, "Resuming failed, trying a full handshake.");
+        forget_session();
+        return handshake(false);
+    }
+
+    return false;
+}
+
+/**
+ * Send a record.
+ *
+ * @param data   [in] What to send.
+ * @param length [in] Its length.
+ *
+ * @return true if it was sent.
+ * @return false if it wasn't.
+ */
+static bool dtls_write(const uint8_t *data, size_t length)
+{
+    int result;
+
+    do {
+        result = mbedtls_ssl_write(&ssl, data, length);
+    } while (result == MBEDTLS_ERR_SSL_WANT_READ ||
+             result == MBEDTLS_ERR_SSL_WANT_WRITE);
+
+    if (result < 0) {
+        log_error("mbedtls_ssl_write", result);
+        return false;
+    }
+
+    return true;
+}
+
+bool dtls_put(const char *payload, size_t length, const uint8_t *auth,
+              uint32_t timeout_ms, int attempts, const uint8_t **reply,
+              size_t *reply_length)
+{
+    TickType_t start;
+    TickType_t timeout = timeout_ms / portTICK_PERIOD_MS;
+    TickType_t total = timeout * attempts;
+    TickType_t sent = 0;
+    TickType_t elapsed;
+    TickType_t wait;
+    const uint8_t *message;
+    size_t message_length;
+    uint8_t ack[COAP_RAW_EMPTY_ACK_LEN];
+    coap_raw_reply_t raw_reply;
+    bool acked = false;
+    int send_attempts = 0;
+    int result;
+
+    if (!coap_raw_secure() || !dtls_open()) {
+        return false;
+    }
+
+    message_length = coap_raw_build(payload, length, auth, &message);
+    if (message_length == 0) {
+        return false;
+    }
+
+    // This is the same resend loop as coap_raw_put(), but reading in line
+    // rather than being called back.
+    start = xTaskGetTickCount();
+    while (true) {
+        elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= total) {
+            ESP_LOGE(TAG, "No reply after %d tries.", send_attempts);
+            break;
+        }
+
+        if (!acked && send_attempts < attempts &&
+            (send_attempts == 0 || elapsed - sent >= timeout)) {
+            ++send_attempts;
+            sent = elapsed;
+            if (!dtls_write(message, message_length)) {
+                break;
+            }
+        }
+
+        if (acked || send_attempts >= attempts) {
+            wait = total - elapsed;
+        }
+        else {
+            wait = timeout - (elapsed - sent);
+        }
+
+        mbedtls_ssl_conf_read_timeout(&conf, wait * portTICK_PERIOD_MS);
+        result = mbedtls_ssl_read(&ssl, received, sizeof(received));
+        if (result == MBEDTLS_ERR_SSL_TIMEOUT ||
+            result == MBEDTLS_ERR_SSL_WANT_READ ||
+            result == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            continue;
+        }
+        if (result <= 0) {
+            if (result != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+                log_error("mbedtls_ssl_read", result);
+            }
+            break;
+        }
+
+        switch (coap_raw_match(received, result, &raw_reply)) {
+            case COAP_RAW_RESET:
+                ESP_LOGE(TAG, "The server reset our message.");
+                dtls_close();
+                return false;
+            case COAP_RAW_ACKED:
+                acked = true;
+                break;
+            case COAP_RAW_REPLY:
+                if (raw_reply.needs_ack) {
+                    dtls_write(ack, coap_raw_empty_ack(raw_reply.message_id,
+                                                       ack));
+                }
+                if (!current_config.mains_powered) {
+                    dtls_close();
+                }
+                *reply = raw_reply.payload;
+                *reply_length = raw_reply.length;
+                return coap_raw_success(&raw_reply);
+            default:
+                break;
+        }
+    }
+
+    // Start from scratch next time, in case it's the session that's broken.
+    dtls_close();
+    return false;
+}
+
+void dtls_close(void)
+{
+    if (session_open) {
+        mbedtls_ssl_close_notify(&ssl);
+        teardown();
+    }
+}
@@ -0,0 +1,66 @@
+/**
+ * @file
+ * Header file for dtls.c.
+ */
+
+#ifndef __DTLS_H_
+#define __DTLS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Longest DTLS session ID, from the spec. */
+#define DTLS_SESSION_ID_LEN 32
+
+/** Length of a DTLS master secret, from the spec. */
+#define DTLS_MASTER_LEN 48
+
+/**
+ * How long to wait for a handshake message before resending ours, at first,
+ * in ms. This doubles on each resend. The handshake is made of the same kind
+ * of round trip as a CoAP request, so it uses the same timeout.
+ */
+#define DTLS_HANDSHAKE_MIN_MS 500
+
+/** Longest to wait for a handshake message, in ms, before giving up. */
+#define DTLS_HANDSHAKE_MAX_MS 4000
+
+/**
+ * PUT a payload to a coaps:// server over DTLS, and wait for the reply.
+ *
+ * The PSK is current_config.psk, and the identity is the station name. If a
+ * session was saved in RTC memory on an earlier wake, it's resumed with an
+ * abbreviated handshake; otherwise, a full handshake is done, and its session
+ * is saved for next time.
+ *
+ * On mains power, the session is kept open afterwards for the next send.
+ *
+ * @param payload      [in]  The payload.
+ * @param length       [in]  Its length.
+ * @param auth         [in]  The authentication option, or NULL.
+ * @param timeout_ms   [in]  How long to wait for an ACK before resending.
+ * @param attempts     [in]  How many times to send it, at most.
+ * @param reply        [out] The reply's payload, which is good until the next
+ *                           call.
+ * @param reply_length [out] Its length.
+ *
+ * @return true if the server replied 2.05.
+ * @return false if it replied with anything else, or didn't reply, or the
+ *         handshake failed.
+ *
+ * @note Only call this from the WiFi task, after coap_raw_prepare() has
+ *       built a template for a coaps:// URI.
+ */
+bool dtls_put(const char *payload, size_t length, const uint8_t *auth,
+              uint32_t timeout_ms, int attempts, const uint8_t **reply,
+              size_t *reply_length);
+
+/**
+ * Close the DTLS session, if one is open. It can still be resumed later.
+ *
+ * @note Only call this from the WiFi task.
+ */
+void dtls_close(void);
+
+#endif // __DTLS_H_
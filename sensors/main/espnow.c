@@ -0,0 +1,285 @@
+/**
+ * @file
+ * ESP-NOW transport.
+ *
+ * A battery puck which uses this doesn't associate with the AP at all. It
+ * starts the radio on the AP's channel, which it knows from the AP info
+ * cache, and sends its report to a relay puck in a single frame. The relay is
+ * a mains powered puck, which is always connected, and forwards what it
+ * receives to the controller over CoAP. See relay_forward() in wifi.c.
+ *
+ * The relay acks each frame at the MAC layer, which is all the sender hears
+ * back - it doesn't get the controller's reply.
+ *
+ * Only the puck that took a reading has its auth_key, so it signs the report
+ * itself and puts the option in the frame's header, and the relay forwards it
+ * as it is. See ESPNOW_HEADER_LEN.
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_wifi.h"
+#include "esp_now.h"
+
+#include "espnow.h"
+#include "queues.h"
+
+static const char *TAG = "espnow";
+
+/** Whether ESP-NOW is started. */
+static bool started = false;
+
+/** The task which started ESP-NOW, which is the one to tell about sends. */
+static TaskHandle_t sender = NULL;
+
+/** MAC of the relay we send to. */
+static uint8_t relay_mac[ESP_NOW_ETH_ALEN];
+
+/**
+ * Callback for when a frame we sent was acked, or wasn't.
+ *
+ * @param mac_addr [in] Who it was sent to.
+ * @param status   [in] How it went.
+ */
+static void send_callback(const uint8_t *mac_addr,
+                          esp_now_send_status_t status)
+{
+    xTaskNotify(sender, status == ESP_NOW_SEND_SUCCESS ?
+                        ESPNOW_NOTIFY_SENT : ESPNOW_NOTIFY_NOT_SENT,
+                eSetBits);
+}
+
+/**
+ * Build a frame: the header, then the report.
+ *
+ * @param frame  [out] Where to build it, ESP_NOW_MAX_DATA_LEN long.
+ * @param data   [in]  The report.
+ * @param length [in]  Its length, at most ESPNOW_MAX_REPORT_LEN.
+ * @param auth   [in]  Authentication option, or NULL.
+ *
+ * @return the length of the frame.
+ */
+static size_t build_frame(uint8_t *frame, const char *data, size_t length,
+                          const uint8_t *auth)
+{
+    size_t used = 0;
+
+    if (auth != NULL) {
+        frame[used++] = AUTH_OPTION_LEN;
+        memcpy(frame + used, auth, AUTH_OPTION_LEN);
+        used += AUTH_OPTION_LEN;
+    }
+    else {
+        frame[used++] = 0;
+    }
+
+    memcpy(frame + used, data, length);
+    return used + length;
+}
+
+/**
+ * Queue a frame's report for the relay to forward.
+ *
+ * @param mac_addr [in] Who sent it.
+ * @param data     [in] The frame.
+ * @param length   [in] Its length.
+ *
+ * @return true if it was queued.
+ * @return false if it wasn't.
+ */
+static bool queue_frame(const uint8_t *mac_addr, const uint8_t *data,
+                        size_t length)
+{
+    relay_frame_t frame;
+    size_t auth_length;
+
+    if (length == 0 || length > ESP_NOW_MAX_DATA_LEN) {
+        ESP_LOGW(TAG, "Dropping a frame of %u bytes.", length);
+        return false;
+    }
+
+    // Anything else in range can send us frames, so check the header.
+    auth_length = data[0];
+    if ((auth_length != 0 && auth_length != AUTH_OPTION_LEN) ||
+        length <= 1 + auth_length ||
+        length - 1 - auth_length > ESPNOW_MAX_REPORT_LEN) {
+        ESP_LOGW(TAG, "Dropping a malformed frame.");
+        return false;
+    }
+
+    memcpy(frame.mac, mac_addr, sizeof(frame.mac));
+    frame.has_auth = (auth_length != 0);
+    memcpy(frame.auth, data + 1, auth_length);
+    data += 1 + auth_length;
+    length -= 1 + auth_length;
+    frame.length = length;
+    memcpy(frame.data, data, length);
+    frame.data[length] = '\0';
+
+    // This runs in the WiFi driver's task, so it mustn't wait. If the queue
+    // is full, the sender's report goes into its backlog next time instead.
+    if (xQueueSend(relay_queue, &frame, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Relay queue is full, dropping a frame.");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Callback for a frame received from another puck.
+ *
+ * @param mac_addr [in] Who sent it.
+ * @param data     [in] What they sent.
+ * @param length   [in] How long it is.
+ */
+static void receive_callback(const uint8_t *mac_addr, const uint8_t *data,
+                             int length)
+{
+    queue_frame(mac_addr, data, length);
+}
+
+/**
+ * Start ESP-NOW and register our callbacks.
+ *
+ * @return true on success.
+ * @return false on failure.
+ */
+static bool start(void)
+{
+    esp_err_t result;
+
+    if (started) {
+        return true;
+    }
+
+    sender = xTaskGetCurrentTaskHandle();
+
+    result = esp_now_init();
+    if (result != ESP_OK) {
+        ESP_LOGE(TAG, "esp_now_init failed: %s", esp_err_to_name(result));
+        return false;
+    }
+
+    ESP_ERROR_CHECK(esp_now_register_send_cb(send_callback));
+    ESP_ERROR_CHECK(esp_now_register_recv_cb(receive_callback));
+
+    started = true;
+    return true;
+}
+
+bool espnow_start(const uint8_t *relay, uint8_t channel)
+{
+    esp_now_peer_info_t peer = {};
+    esp_err_t result;
+
+    if (!start()) {
+        return false;
+    }
+
+    memcpy(relay_mac, relay, sizeof(relay_mac));
+
+    if (!esp_now_is_peer_exist(relay_mac)) {
+        memcpy(peer.peer_addr, relay_mac, sizeof(peer.peer_addr));
+        peer.channel = channel;
+        peer.ifidx = ESP_IF_WIFI_STA;
+        peer.encrypt = false;
+
+        result = esp_now_add_peer(&peer);
+        if (result != ESP_OK) {
+            ESP_LOGE(TAG, "esp_now_add_peer failed: %s",
+                     esp_err_to_name(result));
+            espnow_stop();
+            return false;
+        }
+    }
+
+    ESP_LOGI(TAG, "Sending to %02x:%02x:%02x:%02x:%02x:%02x on channel %d.",
+             relay_mac[0], relay_mac[1], relay_mac[2], relay_mac[3],
+             relay_mac[4], relay_mac[5], channel);
+
+    return true;
+}
+
+bool espnow_listen(void)
+{
+    if (!start()) {
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Relaying reports from other pucks.");
+    return true;
+}
+
+void espnow_stop(void)
+{
+    if (started) {
+        // This drops the peers, too.
+        esp_now_deinit();
+        started = false;
+    }
+}
+
+bool espnow_send(const char *data, size_t length, const uint8_t *auth)
+{
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    TickType_t start_ticks = xTaskGetTickCount();
+    TickType_t timeout = ESPNOW_SEND_TIMEOUT_MS / portTICK_PERIOD_MS;
+    TickType_t elapsed;
+    uint32_t events = 0;
+    uint32_t pending;
+    esp_err_t result;
+
+    if (!started || length > ESPNOW_MAX_REPORT_LEN) {
+        return false;
+    }
+
+    // Forget about any earlier frame.
+    xTaskNotifyWait(ESPNOW_NOTIFY_SENT | ESPNOW_NOTIFY_NOT_SENT, 0, NULL, 0);
+
+    result = esp_now_send(relay_mac, frame,
+                          build_frame(frame, data, length, auth));
+    if (result != ESP_OK) {
+        ESP_LOGE(TAG, "esp_now_send failed: %s", esp_err_to_name(result));
+        return false;
+    }
+
+    // Other notifications can wake us first, so keep waiting until ours
+    // arrives. Those are left for whoever is waiting for them.
+    while ((events & (ESPNOW_NOTIFY_SENT | ESPNOW_NOTIFY_NOT_SENT)) == 0) {
+        elapsed = xTaskGetTickCount() - start_ticks;
+        if (elapsed >= timeout) {
+            ESP_LOGE(TAG, "Timeout waiting for the relay's ack.");
+            return false;
+        }
+
+        pending = 0;
+        xTaskNotifyWait(0, ESPNOW_NOTIFY_SENT | ESPNOW_NOTIFY_NOT_SENT,
+                        &pending, timeout - elapsed);
+        events |= pending;
+    }
+
+    if (events & ESPNOW_NOTIFY_NOT_SENT) {
+        ESP_LOGE(TAG, "The relay didn't ack.");
+        return false;
+    }
+
+    return true;
+}
+
+bool espnow_loopback(const char *data, size_t length, const uint8_t *auth)
+{
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    uint8_t mac[ESP_NOW_ETH_ALEN];
+
+    if (length > ESPNOW_MAX_REPORT_LEN) {
+        return false;
+    }
+
+    ESP_ERROR_CHECK(esp_wifi_get_mac(ESP_IF_WIFI_STA, mac));
+
+    return queue_frame(mac, frame, build_frame(frame, data, length, auth));
+}
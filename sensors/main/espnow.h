@@ -0,0 +1,119 @@
+/**
+ * @file
+ * Header file for espnow.c.
+ */
+
+#ifndef __ESPNOW_H_
+#define __ESPNOW_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_now.h"
+
+#include "auth.h"
+
+/**
+ * Set to 1 to hand reports to our own relay queue rather than send them over
+ * the air, so the ESP-NOW sender and relay paths can both be exercised on one
+ * puck, with no second puck and no radio traffic but the relay's own CoAP.
+ */
+#define LOOPBACK_ESPNOW 0
+
+/**
+ * How long to wait for the MAC layer to say whether the relay acked a frame.
+ * This is a single frame on a known channel, so it's normally a few ms.
+ */
+#define ESPNOW_SEND_TIMEOUT_MS 50
+
+/**
+ * Notification bits from the ESP-NOW send callback to the WiFi task. These
+ * are clear of the bits the WiFi event handler uses.
+ */
+#define ESPNOW_NOTIFY_SENT     BIT8 /**< The relay acked the frame. */
+#define ESPNOW_NOTIFY_NOT_SENT BIT9 /**< It didn't. */
+
+/**
+ * Length of the header on each frame: a byte giving the length of the
+ * authentication option, which is 0 or AUTH_OPTION_LEN, then the option.
+ * Room for it is always left, so the biggest report doesn't depend on whether
+ * there's a key.
+ */
+#define ESPNOW_HEADER_LEN (1 + AUTH_OPTION_LEN)
+
+/** Biggest report that fits in a frame, after the header. */
+#define ESPNOW_MAX_REPORT_LEN (ESP_NOW_MAX_DATA_LEN - ESPNOW_HEADER_LEN)
+
+/**
+ * A report received over ESP-NOW, as queued for the relay to forward.
+ */
+typedef struct {
+    uint8_t mac[ESP_NOW_ETH_ALEN];          /**< Who sent it. */
+    bool has_auth;                          /**< Whether it came signed. */
+    uint8_t auth[AUTH_OPTION_LEN];          /**< The sender's authentication
+                                                 option, to forward as it
+                                                 is, if has_auth. */
+    uint8_t length;                         /**< Length of data. */
+    char data[ESPNOW_MAX_REPORT_LEN + 1];   /**< The report, NUL terminated. */
+} relay_frame_t;
+
+/**
+ * Start ESP-NOW, to send reports to a relay.
+ *
+ * @param relay   [in] MAC of the relay puck.
+ * @param channel [in] Channel the relay is on, which is the AP's.
+ *
+ * @return true on success.
+ * @return false on failure.
+ *
+ * @note Only call this from the WiFi task, once the radio is started.
+ */
+bool espnow_start(const uint8_t *relay, uint8_t channel);
+
+/**
+ * Start ESP-NOW, to receive reports from other pucks and queue them on
+ * relay_queue.
+ *
+ * @return true on success.
+ * @return false on failure.
+ *
+ * @note Only call this from the WiFi task, once WiFi is connected.
+ */
+bool espnow_listen(void);
+
+/**
+ * Stop ESP-NOW, if it's started. This is safe to call in any state.
+ *
+ * @note Only call this from the WiFi task, before the radio is stopped.
+ */
+void espnow_stop(void);
+
+/**
+ * Send a report to the relay, and wait for it to be acked.
+ *
+ * @param data   [in] The report.
+ * @param length [in] Its length, at most ESPNOW_MAX_REPORT_LEN.
+ * @param auth   [in] Authentication option for the relay to forward with
+ *                    it, AUTH_OPTION_LEN long, or NULL if it isn't signed.
+ *
+ * @return true if the relay acked it.
+ * @return false if it didn't, or it couldn't be sent.
+ *
+ * @note Only call this from the WiFi task, after espnow_start().
+ */
+bool espnow_send(const char *data, size_t length, const uint8_t *auth);
+
+/**
+ * Queue a report for the relay as if it had come in over the air. This is
+ * how LOOPBACK_ESPNOW sends.
+ *
+ * @param data   [in] The report.
+ * @param length [in] Its length, at most ESPNOW_MAX_REPORT_LEN.
+ * @param auth   [in] Authentication option, as for espnow_send().
+ *
+ * @return true if it was queued.
+ * @return false if the queue was full.
+ */
+bool espnow_loopback(const char *data, size_t length, const uint8_t *auth);
+
+#endif // __ESPNOW_H_
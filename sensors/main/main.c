@@ -85,11 +85,10 @@ void app_main(void)
 
     // read config pre-zeroes the structure passed in, so there's no explicit
     // need to zero current_config on boot.
-    if (read_config_from_nvs(&current_config)) {
-        // Once we've read in our config, enable wifi.
-        wifi_enable();
-    }
-    else {
+    //
+    // Note that we don't enable WiFi here - the temperature task does that
+    // once it has decided this wake needs to report.
+    if (!read_config_from_nvs(&current_config)) {
         ESP_LOGE(TAG, "Error reading NVS config - no configuration applied.");
     }
 
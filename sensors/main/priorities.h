@@ -1,6 +1,6 @@
 /**
  * @file
- * Lists of priorities for all tasks.
+ * Lists of priorities and stack sizes for all tasks.
  */
 
 #include "freertos/FreeRTOSConfig.h"
@@ -12,4 +12,14 @@
 #define TEMP_TASK_PRIORITY     ((UBaseType_t)(configMAX_PRIORITIES - 3))
 #define WIFI_TASK_PRIORITY     ((UBaseType_t)(configMAX_PRIORITIES - 4))
 
+// Every task's stack and TCB is allocated statically, so they're counted in
+// the link map, and there's no heap to find for them on every wake.
+#if !configSUPPORT_STATIC_ALLOCATION
+#error "Static allocation has to be enabled in FreeRTOSConfig.h."
+#endif
+
+#define CONSOLE_TASK_STACK_SIZE 2048
+#define TEMP_TASK_STACK_SIZE    2048
+#define WIFI_TASK_STACK_SIZE    (5 * 1024)
+
 #endif // __PRIORITIES_H_
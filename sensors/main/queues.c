@@ -6,16 +6,34 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 
 #include "queues.h"
+#include "wifi.h"
+#include "espnow.h"
 
 QueueHandle_t wifi_queue = NULL;
+QueueHandle_t relay_queue = NULL;
+SemaphoreHandle_t backlog_lock = NULL;
+
+/** Storage for the queues, so they don't come out of the heap. */
+static uint8_t wifi_queue_storage[WIFI_QUEUE_LENGTH * sizeof(wifi_command_t)];
+static StaticQueue_t wifi_queue_buffer;
+static uint8_t relay_queue_storage[RELAY_QUEUE_LENGTH *
+                                   sizeof(relay_frame_t)];
+static StaticQueue_t relay_queue_buffer;
+static StaticSemaphore_t backlog_lock_buffer;
 
 bool create_queues(void)
 {
-    wifi_queue = xQueueCreate(WIFI_QUEUE_LENGTH, sizeof(uint8_t));
+    wifi_queue = xQueueCreateStatic(WIFI_QUEUE_LENGTH, sizeof(wifi_command_t),
+                                    wifi_queue_storage, &wifi_queue_buffer);
+    relay_queue = xQueueCreateStatic(RELAY_QUEUE_LENGTH,
+                                     sizeof(relay_frame_t),
+                                     relay_queue_storage, &relay_queue_buffer);
+    backlog_lock = xSemaphoreCreateMutexStatic(&backlog_lock_buffer);
 
-    if (wifi_queue == NULL) {
+    if (wifi_queue == NULL || relay_queue == NULL || backlog_lock == NULL) {
         return false;
     }
 
@@ -9,6 +9,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 
 // 2 should be enough - we'll queue and off and on without blocking.
 #define WIFI_QUEUE_LENGTH 2
@@ -18,8 +19,23 @@
  */
 extern QueueHandle_t wifi_queue;
 
+// Reports are forwarded as soon as the WiFi task gets to them, so this only
+// needs to cover a few pucks waking at once.
+#define RELAY_QUEUE_LENGTH 8
+
+/**
+ * Reports from other pucks, received over ESP-NOW, for the relay to forward.
+ */
+extern QueueHandle_t relay_queue;
+
+/**
+ * Lock on the backlog, which both the temperature and WiFi tasks use. See
+ * backlog.c.
+ */
+extern SemaphoreHandle_t backlog_lock;
+
 /**
- * Create our queues.
+ * Create our queues, and the backlog lock.
  *
  * @return true on success
  * @return false on failure
@@ -0,0 +1,352 @@
+/**
+ * @file
+ * Handle what the controller tells us in its reply to a report.
+ *
+ * Replying costs the controller nothing, and we're awake and listening for it
+ * anyway, so this is the cheapest way to get anything to a battery puck.
+ *
+ * That includes config. The controller versions the settings it wants us to
+ * have with a hash, and we report the one we last applied on every report.
+ * When they differ, it sends them all with the new hash, as "cfg.<item>"
+ * lines named as for "config set", and a "cfg" line with the hash. We only
+ * write to flash if something actually changed.
+ */
+
+#include <stdlib.h> // for strtol, strtoul, strtoull
+#include <string.h> // for memcmp, memcpy, strchr, strcmp, strncpy
+#include "esp_log.h"
+
+#include "reply.h"
+#include "schedule.h"
+#include "config_storage.h"
+
+static const char *TAG = "reply";
+
+/**
+ * The current config, with whatever the controller sent applied. Static
+ * because it's too big to go on the stack of the CoAP handler.
+ */
+static config_storage_t downlink_config;
+
+/** Whether the controller sent a config version in this reply. */
+static bool downlink_received;
+
+/**
+ * Handler for one field of the reply.
+ *
+ * @param value [in] The value, NUL terminated.
+ *
+ * @return true if the value was valid and has been applied.
+ * @return false if it was invalid.
+ */
+typedef bool (*reply_handler_t)(const char *value);
+
+typedef struct {
+    const char *key;
+    reply_handler_t handler;
+} reply_field_t;
+
+/**
+ * Handle "time", the controller's clock in ms since the epoch.
+ */
+static bool handle_time(const char *value)
+{
+    char *end;
+    uint64_t controller_ms = strtoull(value, &end, 10);
+
+    if (*end != '\0' || controller_ms == 0) {
+        return false;
+    }
+
+    schedule_sync(controller_ms);
+    return true;
+}
+
+/**
+ * Handle "slot", the offset in seconds into each poll interval (by the
+ * controller's clock) at which we should report.
+ */
+static bool handle_slot(const char *value)
+{
+    char *end;
+    unsigned long slot_s = strtoul(value, &end, 10);
+
+    if (*end != '\0' || slot_s > UINT16_MAX) {
+        return false;
+    }
+
+    schedule_set_slot((uint16_t)slot_s);
+    return true;
+}
+
+/**
+ * Handle "setpoint", what our zone is being held to, in 1/16 degree C.
+ */
+static bool handle_setpoint(const char *value)
+{
+    char *end;
+    long setpoint = strtol(value, &end, 10);
+
+    if (*end != '\0' || setpoint > INT16_MAX || setpoint < INT16_MIN) {
+        return false;
+    }
+
+    schedule_set_setpoint((int16_t)setpoint);
+    return true;
+}
+
+/**
+ * Keep a poll interval from the controller short enough that we report at
+ * least every HEARTBEAT_MAX_S, or it would think we were dead.
+ *
+ * @param poll_s The interval, in seconds.
+ *
+ * @return the interval to use.
+ */
+static unsigned long cap_poll(unsigned long poll_s)
+{
+    if (poll_s > HEARTBEAT_MAX_S) {
+        ESP_LOGW(TAG, "Polling every %lus would look dead to the controller, "
+                      "using %us.", poll_s, HEARTBEAT_MAX_S);
+        return HEARTBEAT_MAX_S;
+    }
+
+    return poll_s;
+}
+
+/**
+ * Handle "poll", the poll interval the controller wants, in seconds.
+ */
+static bool handle_poll(const char *value)
+{
+    char *end;
+    unsigned long poll_s = strtoul(value, &end, 10);
+
+    if (*end != '\0' || poll_s > UINT16_MAX) {
+        return false;
+    }
+
+    poll_s = cap_poll(poll_s);
+
+    schedule_set_poll_hint((uint16_t)poll_s);
+    return true;
+}
+
+/**
+ * Handle "cfg", the version of the config the controller sent, in hex.
+ */
+static bool handle_config_hash(const char *value)
+{
+    char *end;
+    unsigned long hash = strtoul(value, &end, 16);
+
+    if (*end != '\0' || *value == '\0') {
+        return false;
+    }
+
+    downlink_config.config_hash = hash;
+    downlink_received = true;
+    return true;
+}
+
+/**
+ * Handle "cfg.polling", poll_time_sec.
+ */
+static bool handle_config_polling(const char *value)
+{
+    char *end;
+    unsigned long poll_s = strtoul(value, &end, 10);
+
+    if (*end != '\0' || poll_s < 1 || poll_s > UINT16_MAX) {
+        return false;
+    }
+
+    downlink_config.poll_time_sec = (uint16_t)cap_poll(poll_s);
+    return true;
+}
+
+/**
+ * Handle "cfg.heartbeat", heartbeat_polls.
+ */
+static bool handle_config_heartbeat(const char *value)
+{
+    char *end;
+    unsigned long polls = strtoul(value, &end, 10);
+
+    if (*end != '\0' || polls < 1 || polls > UINT16_MAX) {
+        return false;
+    }
+
+    downlink_config.heartbeat_polls = (uint16_t)polls;
+    return true;
+}
+
+/**
+ * Handle "cfg.unit", use_celsius, as C or F.
+ */
+static bool handle_config_unit(const char *value)
+{
+    if (strcmp(value, "C") == 0) {
+        downlink_config.use_celsius = true;
+    }
+    else if (strcmp(value, "F") == 0) {
+        downlink_config.use_celsius = false;
+    }
+    else {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Handle "cfg.adaptive", adaptive_poll.
+ */
+static bool handle_config_adaptive(const char *value)
+{
+    if (strcmp(value, "Y") == 0) {
+        downlink_config.adaptive_poll = true;
+    }
+    else if (strcmp(value, "N") == 0) {
+        downlink_config.adaptive_poll = false;
+    }
+    else {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Handle "cfg.uri", uri.
+ */
+static bool handle_config_uri(const char *value)
+{
+    if (*value == '\0' || strlen(value) > MAX_URI_LEN) {
+        return false;
+    }
+
+    strncpy(downlink_config.uri, value, sizeof(downlink_config.uri));
+    return true;
+}
+
+/**
+ * Apply the config the controller sent, if it's any different.
+ */
+static void apply_downlink_config(void)
+{
+    bool console_unchanged;
+
+    if (memcmp(&downlink_config, &current_config,
+               sizeof(current_config)) == 0) {
+        return;
+    }
+
+    if (!is_config_valid(&downlink_config)) {
+        ESP_LOGE(TAG, "Config %08x from the controller is invalid, ignoring "
+                      "it.", downlink_config.config_hash);
+        return;
+    }
+
+    // If nobody's editing the config on the console, keep its copy up to
+    // date. If they are, they get to overwrite this when they save.
+    console_unchanged = memcmp(&new_config, &current_config,
+                               sizeof(current_config)) == 0;
+
+    if (!write_config_changes_to_nvs(&current_config, &downlink_config)) {
+        ESP_LOGE(TAG, "Failed to save config %08x from the controller.",
+                 downlink_config.config_hash);
+        return;
+    }
+
+    memcpy(&current_config, &downlink_config, sizeof(current_config));
+    if (console_unchanged) {
+        memcpy(&new_config, &current_config, sizeof(new_config));
+    }
+
+    ESP_LOGW(TAG, "Applied config %08x from the controller.",
+             current_config.config_hash);
+}
+
+static const reply_field_t fields[] = {
+    {"time", handle_time},
+    {"slot", handle_slot},
+    {"setpoint", handle_setpoint},
+    {"poll", handle_poll},
+    {"cfg", handle_config_hash},
+    {"cfg.polling", handle_config_polling},
+    {"cfg.heartbeat", handle_config_heartbeat},
+    {"cfg.unit", handle_config_unit},
+    {"cfg.adaptive", handle_config_adaptive},
+    {"cfg.uri", handle_config_uri},
+};
+
+/**
+ * Handle one "key=value" line.
+ *
+ * @param line [in,out] The line, NUL terminated. This is modified.
+ */
+static void parse_line(char *line)
+{
+    char *value = strchr(line, '=');
+    int i;
+
+    if (value == NULL) {
+        ESP_LOGW(TAG, "Ignoring malformed line \"%s\".", line);
+        return;
+    }
+
+    *value++ = '\0';
+
+    for (i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+        if (strcmp(line, fields[i].key) == 0) {
+            if (!fields[i].handler(value)) {
+                ESP_LOGW(TAG, "Ignoring bad value \"%s\" for %s.", value,
+                         line);
+            }
+            return;
+        }
+    }
+
+    ESP_LOGI(TAG, "Ignoring unknown key %s.", line);
+}
+
+void reply_parse(const uint8_t *data, size_t length)
+{
+    // Static because it's too big to go on the stack of the CoAP handler.
+    static char buffer[REPLY_MAX_LEN + 1];
+    char *line;
+    char *next;
+
+    if (length > REPLY_MAX_LEN) {
+        ESP_LOGW(TAG, "Reply is %u bytes, only looking at the first %d.",
+                 length, REPLY_MAX_LEN);
+        length = REPLY_MAX_LEN;
+    }
+
+    memcpy(buffer, data, length);
+    buffer[length] = '\0';
+
+    // Hints only last until the next reply, so the controller can stop
+    // sending them.
+    schedule_clear_hints();
+
+    // Config is only applied if the reply has a version for it.
+    memcpy(&downlink_config, &current_config, sizeof(downlink_config));
+    downlink_received = false;
+
+    for (line = buffer; line != NULL; line = next) {
+        next = strchr(line, '\n');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+
+        if (*line != '\0') {
+            parse_line(line);
+        }
+    }
+
+    if (downlink_received) {
+        apply_downlink_config();
+    }
+}
@@ -0,0 +1,31 @@
+/**
+ * @file
+ * Header file for reply.c.
+ */
+
+#ifndef __REPLY_H_
+#define __REPLY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Longest reply payload we'll look at, not including the NUL. Anything past
+ * this is ignored. This leaves room for a full config from the controller,
+ * including a URI of MAX_URI_LEN.
+ */
+#define REPLY_MAX_LEN 1023
+
+/**
+ * Handle the payload of the controller's reply to a report.
+ *
+ * The payload is one "key=value" per line. Keys we don't know are ignored, so
+ * the controller can send things newer pucks understand without upsetting
+ * older ones.
+ *
+ * @param data   [in] The payload. Need not be NUL terminated.
+ * @param length [in] Length of the payload.
+ */
+void reply_parse(const uint8_t *data, size_t length);
+
+#endif // __REPLY_H_
@@ -0,0 +1,61 @@
+/**
+ * @file
+ * Functions to keep state in RTC memory between deep sleeps.
+ *
+ * This is the same idea as ap_cache_storage.c, but for things which change on
+ * every wake and would wear out the flash if they went to NVS.
+ */
+#include <stddef.h> // for offsetof
+#include <string.h> // for memset
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "rtc_storage.h"
+
+/** Arbitrary value marking the structure as initialized by us. */
+#define RTC_STORAGE_MAGIC 0x4D435254
+
+RTC_DATA_ATTR rtc_storage_t rtc_storage;
+
+/**
+ * Compute a checksum over everything but the checksum itself.
+ *
+ * This is 32 bit FNV-1a, which is small and plenty good enough to tell
+ * retained contents from power on garbage.
+ *
+ * @return the checksum.
+ */
+static uint32_t compute_checksum(void)
+{
+    const uint8_t *data = (const uint8_t *)&rtc_storage;
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < offsetof(rtc_storage_t, checksum); ++i) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+bool read_rtc_storage(void)
+{
+    // RTC memory is only retained across deep sleep, so don't trust it after
+    // any other sort of reset, even if it happens to look valid.
+    if (esp_reset_reason() == ESP_RST_DEEPSLEEP &&
+        rtc_storage.magic == RTC_STORAGE_MAGIC &&
+        rtc_storage.checksum == compute_checksum()) {
+        return true;
+    }
+
+    memset(&rtc_storage, 0, sizeof(rtc_storage));
+    rtc_storage.magic = RTC_STORAGE_MAGIC;
+    write_rtc_storage();
+
+    return false;
+}
+
+void write_rtc_storage(void)
+{
+    rtc_storage.checksum = compute_checksum();
+}
@@ -0,0 +1,148 @@
+/**
+ * @file
+ * Header file for rtc_storage.c.
+ */
+
+#ifndef __RTC_STORAGE_H_
+#define __RTC_STORAGE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "temp_filter.h"
+#include "backlog.h"
+#include "dtls.h"
+#include "stacks.h"
+
+/**
+ * State which we keep in RTC memory so it survives deep sleep.
+ *
+ * This is lost on a power cycle (and is garbage afterward), so it is validated
+ * on boot and zeroed if it can't be trusted. Anything in here must therefore
+ * have a sane all-zeroes default.
+ */
+typedef struct {
+    uint32_t magic;                 /**< Set to RTC_STORAGE_MAGIC when valid. */
+    bool alarm_valid;               /**< Whether alarm_high and alarm_low
+                                         have been set from a reported
+                                         reading. */
+    int8_t alarm_high;              /**< DS18B20 TH register value. */
+    int8_t alarm_low;               /**< DS18B20 TL register value. */
+    uint16_t polls_since_report;    /**< Number of radio-off wakes since we
+                                         last reported a temperature. */
+    int16_t filter_window[FILTER_WINDOW_LEN]; /**< Recent readings, in 1/16
+                                                   degree C. */
+    uint8_t filter_count;           /**< Number of valid readings in
+                                         filter_window. */
+    uint8_t filter_next;            /**< Where the next reading goes in
+                                         filter_window. */
+    uint8_t filter_rejects;         /**< Number of readings rejected in a
+                                         row. */
+    uint8_t budget_phase;           /**< wake_phase_t the last wake was in
+                                         when its budget ran out, or
+                                         WAKE_PHASE_NONE. */
+    uint16_t budget_expiries;       /**< Number of wakes whose budget ran out
+                                         since power on. */
+    uint8_t failure_streak;         /**< Number of reports in a row which
+                                         failed. */
+    uint16_t backoff_polls;         /**< Number of wakes left to keep the
+                                         radio off before trying again. */
+    uint64_t clock_ms;              /**< The puck's clock, in ms since cold
+                                         boot, as of this boot. */
+    backlog_entry_t backlog[BACKLOG_RTC_LEN]; /**< Undelivered readings,
+                                                   oldest first. */
+    uint8_t backlog_count;          /**< Number of entries in backlog. */
+    uint8_t backlog_flash_head;     /**< Slot of the oldest chunk of
+                                         readings in flash. */
+    uint8_t backlog_flash_count;    /**< Number of chunks of readings in
+                                         flash. */
+    bool sync_valid;                /**< Whether sync_controller_ms and
+                                         sync_clock_ms have been set. */
+    uint64_t sync_controller_ms;    /**< The controller's clock at the last
+                                         sync, in ms since the epoch. */
+    uint64_t sync_clock_ms;         /**< Our clock at the last sync. */
+    bool slot_valid;                /**< Whether slot_s has been set. */
+    uint16_t slot_s;                /**< Offset into the poll interval at
+                                         which we report, by the controller's
+                                         clock. */
+    uint32_t sleep_since_sync_ms;   /**< Total deep sleep we've asked for
+                                         since the last sync. */
+    uint16_t wakes_since_sync;      /**< Number of deep sleeps since the last
+                                         sync. */
+    int32_t drift_ppm;              /**< How much longer than asked for the
+                                         RTC sleeps, in parts per million. */
+    uint16_t boot_ms;               /**< How long we're awake before our
+                                         clock starts, in ms. */
+    int64_t fit_ss;                 /**< Running sums for learning
+                                         drift_ppm and boot_ms. See
+                                         learn_drift() in schedule.c. */
+    int64_t fit_sw;                 /**< As above. */
+    int64_t fit_ww;                 /**< As above. */
+    int64_t fit_se;                 /**< As above. */
+    int64_t fit_we;                 /**< As above. */
+    bool trend_valid;               /**< Whether trend_temp and trend_time_s
+                                         have been set. */
+    int16_t trend_temp;             /**< Reading at the start of the trend
+                                         window, in 1/16 degree C. */
+    uint32_t trend_time_s;          /**< schedule_clock_s() when trend_temp
+                                         was taken. */
+    int16_t trend_latest;           /**< Last reading, in 1/16 degree C. */
+    uint16_t trend_rate;            /**< How fast the temperature is moving,
+                                         in 1/16 degree C per hour. */
+    bool trend_stable;              /**< Whether it barely moved over the
+                                         last trend window. */
+    bool setpoint_valid;            /**< Whether setpoint has been set. */
+    int16_t setpoint;               /**< Our zone's setpoint from the
+                                         controller, in 1/16 degree C. */
+    uint16_t poll_hint_s;           /**< Poll interval the controller asked
+                                         for, or 0 for none. */
+    uint16_t graceful_off_ms;       /**< How long WiFi last took to shut down
+                                         gracefully, or 0 if not yet. */
+    uint16_t fast_off_ms;           /**< How long WiFi last took to shut down
+                                         the fast way, or 0 if not yet. */
+    uint32_t libcoap_send_us;       /**< How long the last report took to send
+                                         with libcoap, in us, or 0 if not
+                                         yet. */
+    uint32_t raw_send_us;           /**< As above, with the minimal CoAP
+                                         sender. */
+    bool dtls_session_valid;        /**< Whether the DTLS session below can
+                                         be resumed. */
+    uint16_t dtls_ciphersuite;      /**< Ciphersuite of the session. */
+    uint8_t dtls_id_len;            /**< Length of dtls_id. */
+    uint8_t dtls_id[DTLS_SESSION_ID_LEN]; /**< Session ID the server gave
+                                               us. */
+    uint8_t dtls_master[DTLS_MASTER_LEN]; /**< The session's master
+                                               secret. */
+    uint32_t auth_seq;              /**< Last report authentication
+                                         sequence number used. */
+    uint32_t auth_seq_limit;        /**< End of the block of them reserved
+                                         in NVS, or 0 if none is. */
+    uint16_t stack_peak[STACK_MAX]; /**< Most of each task's stack used
+                                         since power on, in bytes. */
+    uint8_t discovery_skip;         /**< Reports left to send before asking
+                                         where the controller is up front
+                                         again, after nothing answered. */
+    uint32_t checksum;              /**< Checksum of all the above. Must be
+                                         last. */
+} rtc_storage_t;
+
+extern rtc_storage_t rtc_storage;
+
+/**
+ * Validate the RTC storage after boot.
+ *
+ * If we didn't wake from deep sleep, or the contents fail validation, it is
+ * zeroed.
+ *
+ * @return true if the contents were valid and retained.
+ * @return false if the contents were reset.
+ */
+bool read_rtc_storage(void);
+
+/**
+ * Update the checksum so the current contents survive the next deep sleep.
+ *
+ * @note Call this after any modification and before going to sleep.
+ */
+void write_rtc_storage(void);
+
+#endif // __RTC_STORAGE_H_
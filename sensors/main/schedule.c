@@ -0,0 +1,458 @@
+/**
+ * @file
+ * Decides when we wake and whether we report.
+ *
+ * When the AP or the controller is down, every puck in the house would
+ * otherwise spend 10+ seconds on every wake trying to reach it. So, after a
+ * failure we back off exponentially, and the wakes in between only sample.
+ *
+ * For the same reason, when everything comes back after a power cut, we don't
+ * want every puck reporting in the same second for ever after. The controller
+ * gives each one a slot in the poll interval, and we line our sleeps up with
+ * it.
+ *
+ * Lining up with a slot, and not looking dead to the controller, both need us
+ * to know how long we actually slept. The RTC that times deep sleep can be off
+ * by several percent, and our clock doesn't start until a while after we
+ * wake. So we learn both from the controller's clock. Our own clock is left
+ * uncorrected, and the correction is worked out from the sleeps since the last
+ * sync whenever it's needed.
+ *
+ * Finally, a fixed poll interval is either too slow while the HVAC is cycling
+ * or wastes batteries overnight in an empty zone. In adaptive mode we poll
+ * faster while the temperature is moving or near the setpoint the controller
+ * gives us, and the controller can ask for an interval outright.
+ */
+
+#include <stdlib.h> // for abs
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+#include "schedule.h"
+#include "rtc_storage.h"
+#include "config_storage.h"
+
+static const char *TAG = "schedule";
+
+/**
+ * Longest sleep, in seconds, and most wakes, between syncs that learn_drift()
+ * learns from. These keep every product of its sums inside an int64. Anything
+ * longer is an outage or a very long poll, and there's plenty to learn from
+ * the normal syncs either side of it.
+ */
+#define FIT_MAX_SLEEP_S ((1 << 13) - 1)
+#define FIT_MAX_WAKES ((1 << 5) - 1)
+
+/**
+ * Fractions of a wake that learn_drift() counts wakes in. The sums lose a
+ * little to rounding each time they decay, and the wake ones are small enough
+ * that it would swamp the fit without this.
+ */
+#define FIT_WAKE_UNIT 32
+
+void schedule_report_succeeded(void)
+{
+    if (rtc_storage.failure_streak > 0) {
+        ESP_LOGW(TAG, "Reported after %u failures, ending backoff.",
+                 rtc_storage.failure_streak);
+    }
+
+    rtc_storage.failure_streak = 0;
+    rtc_storage.backoff_polls = 0;
+}
+
+void schedule_report_failed(void)
+{
+    uint32_t max_polls;
+    uint32_t polls;
+
+    if (rtc_storage.failure_streak < BACKOFF_MAX_STREAK) {
+        ++rtc_storage.failure_streak;
+    }
+
+    // Skip 1, 3, 7, ... polls, so the time between attempts doubles each
+    // time - but not past BACKOFF_MAX_S. This is recomputed from the poll
+    // interval in use every time, so a config change, or adaptive polling
+    // speeding up, takes effect right away.
+    polls = (1u << rtc_storage.failure_streak) - 1;
+
+    max_polls = BACKOFF_MAX_S / schedule_interval_s();
+    if (max_polls > 0) {
+        // The attempt itself is a poll too.
+        --max_polls;
+    }
+    if (polls > max_polls) {
+        polls = max_polls;
+    }
+
+    rtc_storage.backoff_polls = (uint16_t)polls;
+
+    ESP_LOGW(TAG, "Report failed (%u in a row), skipping the radio for "
+                  "%u polls.", rtc_storage.failure_streak, polls);
+}
+
+/**
+ * Get the puck's clock.
+ *
+ * @return ms since cold boot.
+ */
+static uint64_t clock_ms(void)
+{
+    // esp_timer counts from this boot.
+    return rtc_storage.clock_ms + esp_timer_get_time() / 1000;
+}
+
+uint32_t schedule_clock_s(void)
+{
+    return (uint32_t)(clock_ms() / 1000);
+}
+
+/**
+ * Work out how far our clock has fallen behind since the last sync, from the
+ * RTC drift and boot overhead we've learned.
+ *
+ * @return the correction, in ms.
+ */
+static int64_t clock_correction_ms(void)
+{
+    return (int64_t)rtc_storage.sleep_since_sync_ms * rtc_storage.drift_ppm /
+               1000000 +
+           (int64_t)rtc_storage.wakes_since_sync * rtc_storage.boot_ms;
+}
+
+/**
+ * Age a running sum for learn_drift(), so older syncs count for less.
+ *
+ * @param sum The sum.
+ *
+ * @return what's left of it.
+ */
+static int64_t decay(int64_t sum)
+{
+    return sum * (8 - DRIFT_LEARN_RATE) / 8;
+}
+
+/**
+ * Learn from how far our clock fell behind since the last sync.
+ *
+ * The error is drift * sleep + boot * wakes, so this is a least squares fit
+ * of drift and boot to the history of syncs, with older ones counting for
+ * less. It's all integer, since there's no FPU to do it in float. Sleep is in
+ * seconds and error in ms, and FIT_MAX_SLEEP_S and FIT_MAX_WAKES bound them.
+ *
+ * @param error_ms How far behind the controller our clock was, in ms.
+ */
+static void learn_drift(int32_t error_ms)
+{
+    int64_t sleep_s = (rtc_storage.sleep_since_sync_ms + 500) / 1000;
+    int64_t wakes = rtc_storage.wakes_since_sync;
+    int64_t ss;
+    int64_t sw;
+    int64_t ww;
+    int64_t det;
+    int64_t numerator;
+    int64_t drift; // ppm
+    int64_t boot;  // ms
+
+    if (sleep_s > FIT_MAX_SLEEP_S || wakes > FIT_MAX_WAKES) {
+        ESP_LOGI(TAG, "Too long since the last sync to learn from.");
+        return;
+    }
+    wakes *= FIT_WAKE_UNIT;
+
+    rtc_storage.fit_ss = decay(rtc_storage.fit_ss) + sleep_s * sleep_s;
+    rtc_storage.fit_sw = decay(rtc_storage.fit_sw) + sleep_s * wakes;
+    rtc_storage.fit_ww = decay(rtc_storage.fit_ww) + wakes * wakes;
+    rtc_storage.fit_se = decay(rtc_storage.fit_se) + sleep_s * error_ms;
+    rtc_storage.fit_we = decay(rtc_storage.fit_we) + wakes * error_ms;
+
+    ss = rtc_storage.fit_ss;
+    sw = rtc_storage.fit_sw;
+    ww = rtc_storage.fit_ww;
+    det = ss * ww - sw * sw;
+
+    if (det > 0 && det * 1000 > ss * ww) {
+        // Drift comes out in ms per s, which is parts per thousand, so it's
+        // scaled up to ppm in two parts to keep the remainder.
+        numerator = rtc_storage.fit_se * ww - rtc_storage.fit_we * sw;
+        drift = numerator / det;
+        if (drift > DRIFT_MAX_PPM / 1000) {
+            drift = DRIFT_MAX_PPM;
+        }
+        else if (drift < -DRIFT_MAX_PPM / 1000) {
+            drift = -DRIFT_MAX_PPM;
+        }
+        else {
+            drift = drift * 1000 + numerator % det * 1000 / det;
+        }
+
+        // Whatever drift doesn't account for is down to the wakes.
+        boot = (rtc_storage.fit_we * 1000 - sw * drift) * FIT_WAKE_UNIT /
+               (ww * 1000);
+    }
+    else if (ss > 0) {
+        // Every sync so far has had the same sleep per wake, so we can't tell
+        // the two apart. It doesn't matter, though - as long as that doesn't
+        // change, putting it all down to drift corrects it just as well.
+        drift = rtc_storage.fit_se * 1000 / ss;
+        boot = 0;
+    }
+    else {
+        // There's been no sleep to learn from since the sync, or it's all
+        // decayed away, so keep what we had.
+        return;
+    }
+
+    if (drift > DRIFT_MAX_PPM) {
+        drift = DRIFT_MAX_PPM;
+    }
+    else if (drift < -DRIFT_MAX_PPM) {
+        drift = -DRIFT_MAX_PPM;
+    }
+
+    if (boot > BOOT_MAX_MS) {
+        boot = BOOT_MAX_MS;
+    }
+    else if (boot < 0) {
+        boot = 0;
+    }
+
+    rtc_storage.drift_ppm = (int32_t)drift;
+    rtc_storage.boot_ms = (uint16_t)boot;
+
+    ESP_LOGI(TAG, "Clock was %d ms behind over %u ms of sleep and %u wakes. "
+                  "RTC drift now %d ppm, boot %u ms.", error_ms,
+             rtc_storage.sleep_since_sync_ms, rtc_storage.wakes_since_sync,
+             rtc_storage.drift_ppm, rtc_storage.boot_ms);
+}
+
+uint32_t schedule_prepare_deep_sleep(uint32_t sleep_ms)
+{
+    // The other way around from clock_correction_ms(), so that we actually
+    // sleep for sleep_ms.
+    if (sleep_ms > rtc_storage.boot_ms) {
+        sleep_ms = (uint64_t)(sleep_ms - rtc_storage.boot_ms) * 1000000 /
+                   (1000000 + rtc_storage.drift_ppm);
+    }
+
+    // esp_timer counts from this boot.
+    rtc_storage.clock_ms += esp_timer_get_time() / 1000 + sleep_ms;
+
+    if (rtc_storage.sleep_since_sync_ms <= UINT32_MAX - sleep_ms) {
+        rtc_storage.sleep_since_sync_ms += sleep_ms;
+    }
+    if (rtc_storage.wakes_since_sync < UINT16_MAX) {
+        ++rtc_storage.wakes_since_sync;
+    }
+
+    return sleep_ms;
+}
+
+bool schedule_skip_radio(void)
+{
+    if (rtc_storage.backoff_polls > 0) {
+        --rtc_storage.backoff_polls;
+        return true;
+    }
+
+    return false;
+}
+
+void schedule_sync(uint64_t controller_ms)
+{
+    int64_t error_ms;
+
+    if (rtc_storage.sync_valid && rtc_storage.wakes_since_sync > 0) {
+        error_ms = (int64_t)(controller_ms - rtc_storage.sync_controller_ms) -
+                   (int64_t)(clock_ms() - rtc_storage.sync_clock_ms);
+
+        // If it's out by more than we'd believe of the RTC, it's more likely
+        // the controller's clock was set, so don't learn from it.
+        if (error_ms > (int64_t)rtc_storage.sleep_since_sync_ms *
+                           DRIFT_MAX_PPM / 1000000 +
+                       (int64_t)rtc_storage.wakes_since_sync * BOOT_MAX_MS ||
+            error_ms < -(int64_t)rtc_storage.sleep_since_sync_ms *
+                           DRIFT_MAX_PPM / 1000000) {
+            ESP_LOGW(TAG, "Controller clock moved by %d ms, not learning from "
+                          "it.", (int32_t)error_ms);
+        }
+        else {
+            learn_drift((int32_t)error_ms);
+        }
+    }
+
+    rtc_storage.sleep_since_sync_ms = 0;
+    rtc_storage.wakes_since_sync = 0;
+    rtc_storage.sync_controller_ms = controller_ms;
+    rtc_storage.sync_clock_ms = clock_ms();
+    rtc_storage.sync_valid = true;
+}
+
+void schedule_set_slot(uint16_t slot_s)
+{
+    if (!rtc_storage.slot_valid || rtc_storage.slot_s != slot_s) {
+        ESP_LOGI(TAG, "Assigned slot %u s.", slot_s);
+    }
+
+    rtc_storage.slot_s = slot_s;
+    rtc_storage.slot_valid = true;
+}
+
+uint32_t schedule_sleep_ms(uint32_t sleep_ms)
+{
+    uint16_t period_s = schedule_interval_s();
+    uint32_t period_ms = period_s * 1000;
+    uint32_t min_sleep_ms = SLOT_MIN_SLEEP_S * 1000;
+    uint64_t controller_ms;
+    uint32_t phase_ms;
+    uint32_t slot_ms;
+    uint32_t until_slot_ms;
+    uint32_t jitter_ms;
+
+    if (rtc_storage.sync_valid && rtc_storage.slot_valid) {
+        // Where we are in the interval, by the controller's clock.
+        controller_ms = rtc_storage.sync_controller_ms + clock_ms() -
+                        rtc_storage.sync_clock_ms + clock_correction_ms();
+        phase_ms = controller_ms % period_ms;
+        slot_ms = (rtc_storage.slot_s % period_s) * 1000;
+
+        until_slot_ms = (slot_ms + period_ms - phase_ms) % period_ms;
+
+        // Don't let this stop a short poll interval ever sleeping.
+        if (min_sleep_ms > period_ms / 2) {
+            min_sleep_ms = period_ms / 2;
+        }
+
+        // If it's too close, waiting for the one after would sleep longer
+        // than the interval, so just sleep the interval and catch it next
+        // time round.
+        if (until_slot_ms >= min_sleep_ms && until_slot_ms < sleep_ms) {
+            sleep_ms = until_slot_ms;
+        }
+    }
+    else if (!rtc_storage.sync_valid) {
+        // Once we've heard from the controller, we've already been spread
+        // out by when we each got through, so don't keep reporting early
+        // for ever if it never gives us a slot. Only ever shorten it, so we
+        // can't look dead to the controller.
+        jitter_ms = esp_random() % (period_ms / 100 * SLOT_JITTER_PCT + 1);
+        if (jitter_ms < sleep_ms) {
+            sleep_ms -= jitter_ms;
+        }
+    }
+
+    return sleep_ms;
+}
+
+void schedule_clear_hints(void)
+{
+    rtc_storage.setpoint_valid = false;
+    rtc_storage.poll_hint_s = 0;
+}
+
+void schedule_set_setpoint(int16_t setpoint)
+{
+    rtc_storage.setpoint = setpoint;
+    rtc_storage.setpoint_valid = true;
+}
+
+void schedule_set_poll_hint(uint16_t poll_s)
+{
+    rtc_storage.poll_hint_s = poll_s;
+}
+
+void schedule_note_reading(int16_t temperature)
+{
+    uint32_t now_s = schedule_clock_s();
+    uint32_t elapsed_s = now_s - rtc_storage.trend_time_s;
+    uint32_t change;
+    uint32_t rate;
+
+    rtc_storage.trend_latest = temperature;
+
+    // Only judge the trend over a whole window, so a step or two of the
+    // sensor between short polls doesn't look like a fast change. Until then,
+    // we go by the last window.
+    if (rtc_storage.trend_valid && elapsed_s < ADAPT_TREND_WINDOW_S) {
+        return;
+    }
+
+    if (rtc_storage.trend_valid) {
+        change = abs(temperature - rtc_storage.trend_temp);
+        rtc_storage.trend_stable = change <= ADAPT_NOISE;
+        if (rtc_storage.trend_stable) {
+            rtc_storage.trend_rate = 0;
+        }
+        else {
+            rate = change * 3600 / elapsed_s;
+            rtc_storage.trend_rate = rate > UINT16_MAX ? UINT16_MAX : rate;
+        }
+    }
+
+    rtc_storage.trend_temp = temperature;
+    rtc_storage.trend_time_s = now_s;
+    rtc_storage.trend_valid = true;
+}
+
+void schedule_note_steady(void)
+{
+    rtc_storage.trend_rate = 0;
+}
+
+uint16_t schedule_interval_s(void)
+{
+    uint32_t interval_s = current_config.poll_time_sec;
+    uint32_t stable_max_s;
+
+    // Adapting only saves battery. On mains power, we poll as often as we're
+    // configured to all the time.
+    if (!current_config.adaptive_poll || current_config.mains_powered) {
+        return interval_s;
+    }
+
+    if (rtc_storage.poll_hint_s != 0) {
+        interval_s = rtc_storage.poll_hint_s;
+    }
+    else if (rtc_storage.trend_rate >= ADAPT_FAST_RATE) {
+        interval_s = ADAPT_MIN_POLL_S;
+    }
+    else if (rtc_storage.setpoint_valid && rtc_storage.trend_valid &&
+             abs(rtc_storage.trend_latest - rtc_storage.setpoint) <=
+                 ADAPT_NEAR_SETPOINT) {
+        interval_s /= ADAPT_NEAR_DIVISOR;
+    }
+    else if (rtc_storage.trend_stable) {
+        // Nothing's happening, so save the battery, but not so much the
+        // controller thinks we're dead.
+        stable_max_s = HEARTBEAT_MAX_S / current_config.heartbeat_polls;
+        interval_s *= ADAPT_STABLE_MULTIPLIER;
+        if (interval_s > stable_max_s) {
+            interval_s = stable_max_s;
+        }
+        if (interval_s < current_config.poll_time_sec) {
+            interval_s = current_config.poll_time_sec;
+        }
+    }
+
+    if (interval_s < ADAPT_MIN_POLL_S) {
+        interval_s = ADAPT_MIN_POLL_S;
+    }
+
+    return (uint16_t)interval_s;
+}
+
+uint16_t schedule_heartbeat_polls(void)
+{
+    uint32_t max_polls = HEARTBEAT_MAX_S / schedule_interval_s();
+
+    if (max_polls < 1) {
+        max_polls = 1;
+    }
+
+    if (current_config.heartbeat_polls > max_polls) {
+        return (uint16_t)max_polls;
+    }
+
+    return current_config.heartbeat_polls;
+}
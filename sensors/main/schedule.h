@@ -0,0 +1,241 @@
+/**
+ * @file
+ * Header file for schedule.c.
+ */
+
+#ifndef __SCHEDULE_H_
+#define __SCHEDULE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Longest time, in seconds, between attempts to report while backing off.
+ */
+#define BACKOFF_MAX_S 3600
+
+/**
+ * Cap on the failure streak, so the shift in the backoff calculation can't
+ * overflow. 2^8 polls is well past BACKOFF_MAX_S for any sane poll interval.
+ */
+#define BACKOFF_MAX_STREAK 8
+
+/**
+ * Longest we go without reporting, in seconds, however the heartbeat is set.
+ * The controller stops using a sensor it hasn't heard from in its TOO_LONG
+ * (11 minutes), so this leaves a minute for the sleep running long and the
+ * report itself. Raise both together.
+ */
+#define HEARTBEAT_MAX_S 600
+
+/**
+ * Shortest sleep, in seconds, when moving to our slot. If the slot comes up
+ * sooner than this, we don't report twice in a row for it, but sleep our
+ * normal interval and move to it from there.
+ */
+#define SLOT_MIN_SLEEP_S 30
+
+/**
+ * Most we shorten each sleep by, as a percentage of the poll interval, until
+ * we first hear from the controller. This spreads out pucks which all came up
+ * at once after a power cut.
+ */
+#define SLOT_JITTER_PCT 25
+
+/**
+ * Shortest poll interval, in seconds, in adaptive mode.
+ */
+#define ADAPT_MIN_POLL_S 60
+
+/**
+ * In adaptive mode, a temperature changing at least this fast is moving
+ * quickly, in 1/16 degree C per hour (so this is 1C per hour).
+ */
+#define ADAPT_FAST_RATE (1 * 16)
+
+/**
+ * In adaptive mode, how long we watch the temperature for, in seconds, before
+ * deciding how fast it's moving. Over a single short poll, one step of the
+ * sensor would look like a fast change.
+ */
+#define ADAPT_TREND_WINDOW_S 600
+
+/**
+ * In adaptive mode, the most the temperature can change over
+ * ADAPT_TREND_WINDOW_S and still be stable, in 1/16 degree C. That's a few
+ * steps of the sensor, which is only noise.
+ */
+#define ADAPT_NOISE 3
+
+/**
+ * In adaptive mode, while the temperature is stable and not near the
+ * setpoint, we poll this many times less often, though never so seldom that
+ * the heartbeat goes past HEARTBEAT_MAX_S.
+ */
+#define ADAPT_STABLE_MULTIPLIER 2
+
+/**
+ * In adaptive mode, a temperature within this of the setpoint is near it, in
+ * 1/16 degree C (so this is 1C).
+ */
+#define ADAPT_NEAR_SETPOINT (1 * 16)
+
+/**
+ * In adaptive mode, near the setpoint we poll this many times as often.
+ */
+#define ADAPT_NEAR_DIVISOR 4
+
+/**
+ * How much each new sync counts for when learning the RTC drift, in 1/8s.
+ * The rest is what we'd learned before.
+ */
+#define DRIFT_LEARN_RATE 1
+
+/**
+ * Largest RTC drift we believe, in parts per million. The datasheet allows a
+ * few percent; anything past this is the controller's clock jumping.
+ */
+#define DRIFT_MAX_PPM 100000
+
+/**
+ * Largest boot overhead we believe, in ms.
+ */
+#define BOOT_MAX_MS 2000
+
+/**
+ * Record that this wake reported successfully, ending any backoff.
+ */
+void schedule_report_succeeded(void);
+
+/**
+ * Record that this wake failed to report - either WiFi didn't connect or the
+ * controller didn't accept the reading.
+ *
+ * Each failure in a row doubles the number of polls until the next attempt,
+ * up to BACKOFF_MAX_S.
+ */
+void schedule_report_failed(void);
+
+/**
+ * Check whether this wake has to keep the radio off because we're backing
+ * off. Counts this wake against the backoff if so, so only call it once per
+ * wake.
+ *
+ * @return true if we must not try to report this wake.
+ * @return false if we may.
+ */
+bool schedule_skip_radio(void);
+
+/**
+ * Get the puck's clock.
+ *
+ * There's no wall clock, so this counts from the last cold boot, and carries
+ * across deep sleep by adding on how long we asked to sleep for.
+ *
+ * @return seconds since cold boot.
+ */
+uint32_t schedule_clock_s(void);
+
+/**
+ * Account for a deep sleep we're about to go into, so the clock is right when
+ * we wake, and correct it for what we've learned about the RTC.
+ *
+ * @param sleep_ms How long we want to sleep for.
+ *
+ * @return how long to ask esp_deep_sleep() for, in ms.
+ *
+ * @note Call write_rtc_storage() after this.
+ */
+uint32_t schedule_prepare_deep_sleep(uint32_t sleep_ms);
+
+/**
+ * Record the controller's clock, as of now.
+ *
+ * If we've synced before, this also compares how long the controller says
+ * it's been with how long we think it's been, and learns how far off the RTC
+ * is while we deep sleep, and how long we spend booting before our clock
+ * starts.
+ *
+ * @param controller_ms The controller's clock, in ms since the epoch.
+ */
+void schedule_sync(uint64_t controller_ms);
+
+/**
+ * Record the slot the controller assigned us.
+ *
+ * @param slot_s Offset, in seconds, into each poll interval (by the
+ *               controller's clock) at which we should wake. This is taken
+ *               modulo the poll interval.
+ */
+void schedule_set_slot(uint16_t slot_s);
+
+/**
+ * Work out how long to sleep before the next poll.
+ *
+ * If we have a slot, this is however long it is until it next comes up.
+ * Before we've first heard from the controller, it's the given time, less some
+ * random jitter. Otherwise, it's just the given time. Either way, it's never
+ * longer than the given time, so we can't look dead to the controller.
+ *
+ * @param sleep_ms How long we'd sleep for without a slot.
+ *
+ * @return how long to sleep for, in ms.
+ */
+uint32_t schedule_sleep_ms(uint32_t sleep_ms);
+
+/**
+ * Forget everything the controller told us in its last reply which only
+ * holds until the next one.
+ */
+void schedule_clear_hints(void);
+
+/**
+ * Record the setpoint the controller says our zone is being held to.
+ *
+ * @param setpoint In 1/16 degree C.
+ */
+void schedule_set_setpoint(int16_t setpoint);
+
+/**
+ * Record the poll interval the controller wants us to use.
+ *
+ * @param poll_s In seconds. 0 leaves it up to us.
+ */
+void schedule_set_poll_hint(uint16_t poll_s);
+
+/**
+ * Record a reading, for working out how fast the temperature is moving.
+ *
+ * @param temperature In 1/16 degree C, after filtering.
+ */
+void schedule_note_reading(int16_t temperature);
+
+/**
+ * Record that the temperature hasn't moved enough to trip the alarm, so we
+ * know it's not moving quickly without taking a reading.
+ */
+void schedule_note_steady(void);
+
+/**
+ * Get how many polls we can go between reports.
+ *
+ * This is heartbeat_polls, but no more than fit in HEARTBEAT_MAX_S at the
+ * current poll interval, so the controller doesn't think we're dead.
+ *
+ * @return the number of polls, at least 1.
+ */
+uint16_t schedule_heartbeat_polls(void);
+
+/**
+ * Get the poll interval to use.
+ *
+ * This is poll_time_sec unless adaptive polling is on (and we're not on mains
+ * power), in which case it's whatever the controller asked for or, if
+ * nothing, shorter while the temperature is moving quickly or is near the
+ * setpoint, and longer while it's stable.
+ *
+ * @return the interval, in seconds.
+ */
+uint16_t schedule_interval_s(void);
+
+#endif // __SCHEDULE_H_
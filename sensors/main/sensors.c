@@ -0,0 +1,105 @@
+/**
+ * @file
+ * Table of measurement drivers, and concurrent sampling across all of them.
+ *
+ * To add a sensor, implement a sensor_driver_t for it and add it to
+ * sensor_drivers below.
+ */
+
+#include <string.h> // for memset
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "sensors.h"
+#include "ds18b20_sensor.h"
+#include "sht3x_sensor.h"
+
+static const char *TAG = "sensors";
+
+/**
+ * All the sensors on this puck.
+ */
+static const sensor_driver_t *const sensor_drivers[] = {
+    &ds18b20_driver,
+#if USE_SHT3X
+    &sht3x_driver,
+#endif // USE_SHT3X
+};
+
+#define NUM_SENSOR_DRIVERS \
+    (sizeof(sensor_drivers) / sizeof(sensor_drivers[0]))
+
+bool sample_sensors(sensor_readings_t *readings)
+{
+    bool usable[NUM_SENSOR_DRIVERS];
+    TickType_t ready_ticks[NUM_SENSOR_DRIVERS];
+    int order[NUM_SENSOR_DRIVERS];
+    int num_started = 0;
+    bool success = true;
+    TickType_t now_ticks;
+    int index;
+    int i;
+    int j;
+
+    memset(readings, 0, sizeof(*readings));
+
+    for (i = 0; i < NUM_SENSOR_DRIVERS; ++i) {
+        usable[i] = sensor_drivers[i]->power_on();
+        if (!usable[i]) {
+            ESP_LOGE(TAG, "Error powering on %s.", sensor_drivers[i]->name);
+            success = false;
+        }
+    }
+
+    vTaskDelay(SENSOR_ON_DELAY_MS / portTICK_PERIOD_MS);
+
+    // Kick off every conversion, and keep a list of them sorted by when
+    // they'll be ready. There are only ever a handful, so insertion sort.
+    for (i = 0; i < NUM_SENSOR_DRIVERS; ++i) {
+        if (!usable[i]) {
+            continue;
+        }
+
+        if (!sensor_drivers[i]->start_conversion()) {
+            ESP_LOGE(TAG, "Error starting %s conversion.",
+                     sensor_drivers[i]->name);
+            success = false;
+            continue;
+        }
+
+        // Add 1 extra tick just to be certain we have given ample time.
+        ready_ticks[i] = xTaskGetTickCount() +
+                         sensor_drivers[i]->ready_time_ms() /
+                         portTICK_PERIOD_MS + 1;
+
+        for (j = num_started;
+             j > 0 && ready_ticks[order[j - 1]] > ready_ticks[i];
+             --j) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+        ++num_started;
+    }
+
+    // And collect them as they finish.
+    for (j = 0; j < num_started; ++j) {
+        index = order[j];
+
+        now_ticks = xTaskGetTickCount();
+        if (ready_ticks[index] > now_ticks) {
+            vTaskDelay(ready_ticks[index] - now_ticks);
+        }
+
+        if (!sensor_drivers[index]->read(readings)) {
+            ESP_LOGE(TAG, "Error reading %s.", sensor_drivers[index]->name);
+            success = false;
+        }
+    }
+
+    for (i = 0; i < NUM_SENSOR_DRIVERS; ++i) {
+        sensor_drivers[i]->power_off();
+    }
+
+    return success;
+}
@@ -0,0 +1,99 @@
+/**
+ * @file
+ * Header file for sensors.c.
+ *
+ * This is the interface every measurement driver implements, so temp_task()
+ * can sample all of them at once without knowing what's attached.
+ */
+
+#ifndef __SENSORS_H_
+#define __SENSORS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Everything we measure on a wake. Each driver fills in only the fields it
+ * owns and sets the matching valid flag.
+ */
+typedef struct {
+    bool temperature_valid;     /**< Whether temperature was read. */
+    int16_t temperature;        /**< Temperature, in 1/16 degree C. */
+    bool humidity_valid;        /**< Whether humidity was read. */
+    uint16_t humidity;          /**< Relative humidity, in 1/10 percent. */
+} sensor_readings_t;
+
+/**
+ * A measurement driver.
+ *
+ * The operations are split up so that conversions on different sensors can
+ * overlap - temp_task() powers everything on, starts every conversion, and
+ * then reads each one back as it becomes ready. So, none of these should
+ * block for the length of a conversion.
+ */
+typedef struct {
+    /** Name, for logging. */
+    const char *name;
+
+    /**
+     * Power on the sensor and get its bus ready. The caller waits
+     * SENSOR_ON_DELAY_MS after all sensors are powered, so this shouldn't.
+     *
+     * @return true on success.
+     * @return false if the sensor can't be used this wake.
+     */
+    bool (*power_on)(void);
+
+    /**
+     * Start a conversion, and return without waiting for it.
+     *
+     * @return true on success.
+     * @return false on failure.
+     */
+    bool (*start_conversion)(void);
+
+    /**
+     * @return how long, in ms, after start_conversion() the result is ready.
+     */
+    uint32_t (*ready_time_ms)(void);
+
+    /**
+     * Read the result of the conversion back.
+     *
+     * @param readings [out] structure to fill in the fields for this sensor.
+     *
+     * @return true if the reading is valid.
+     * @return false on failure.
+     */
+    bool (*read)(sensor_readings_t *readings);
+
+    /**
+     * Power off the sensor and leave its bus in its lowest power state.
+     */
+    void (*power_off)(void);
+} sensor_driver_t;
+
+/*
+ * Delay in MS after sensor on to wait before doing something. This allows for
+ * power to settle, capacitors to charge, etc.
+ *
+ * Note that anything less than 10 does nothing because portTICK_PERIOD_MS is
+ * 10.
+ */
+#define SENSOR_ON_DELAY_MS 10
+
+/**
+ * Sample every registered sensor.
+ *
+ * All conversions run concurrently, so the wake is as long as the slowest
+ * sensor rather than the sum of all of them.
+ *
+ * @param readings [out] the readings. Zeroed first, so anything which
+ *                       couldn't be read has its valid flag clear.
+ *
+ * @return true if every sensor was read successfully.
+ * @return false if any sensor failed.
+ */
+bool sample_sensors(sensor_readings_t *readings);
+
+#endif // __SENSORS_H_
@@ -0,0 +1,146 @@
+/**
+ * @file
+ * SHT3x humidity sensor driver.
+ *
+ * This is optional - see USE_SHT3X. The sensor goes on the D1 Mini's I2C pins
+ * (D2/GPIO4 for SDA, D1/GPIO5 for SCL), and is powered from GPIO14 along with
+ * its pullups, so it draws nothing while we sleep.
+ */
+
+#include "sht3x_sensor.h"
+
+#if USE_SHT3X
+
+#include "esp_log.h"
+#include <driver/gpio.h>
+#include <sht3x.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static const char *TAG = "sht3x";
+
+#define SHT3X_SDA_GPIO GPIO_NUM_4
+#define SHT3X_SCL_GPIO GPIO_NUM_5
+// This needs to match init_sensor_gpios() in main.c.
+#define SHT3X_POWER_GPIO GPIO_NUM_14
+
+/*
+ * We only ever want one reading per wake, at the best precision.
+ */
+#define SHT3X_REPEATABILITY SHT3X_HIGH
+
+static sht3x_t sht3x_dev;
+
+/**
+ * Whether the I2C descriptor has been set up. This only has to happen once.
+ */
+static bool descriptor_ready = false;
+
+/**
+ * Turn on our sensor.
+ *
+ * @return true on success.
+ * @return false if we couldn't set up the I2C bus.
+ */
+static bool sht3x_power_on(void)
+{
+    esp_err_t ret;
+
+    ESP_ERROR_CHECK(gpio_set_level(SHT3X_POWER_GPIO, 1));
+
+    if (!descriptor_ready) {
+        ret = i2cdev_init();
+        if (ret == ESP_OK) {
+            ret = sht3x_init_desc(&sht3x_dev, SHT3X_I2C_ADDR_GND, I2C_NUM_0,
+                                  SHT3X_SDA_GPIO, SHT3X_SCL_GPIO);
+        }
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Error setting up I2C: %s", esp_err_to_name(ret));
+            return false;
+        }
+        descriptor_ready = true;
+    }
+
+    return true;
+}
+
+/**
+ * Start a single shot conversion.
+ *
+ * @return true if the conversion started.
+ * @return false on failure.
+ */
+static bool sht3x_start_conversion(void)
+{
+    esp_err_t ret;
+
+    ret = sht3x_start_measurement(&sht3x_dev, SHT3X_SINGLE_SHOT,
+                                  SHT3X_REPEATABILITY);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error starting measurement: %s", esp_err_to_name(ret));
+    }
+
+    return ret == ESP_OK;
+}
+
+/**
+ * @return the conversion time for our repeatability setting.
+ */
+static uint32_t sht3x_ready_time_ms(void)
+{
+    // The library gives us this in ticks.
+    return sht3x_get_measurement_duration(SHT3X_REPEATABILITY) *
+           portTICK_PERIOD_MS;
+}
+
+/**
+ * Read the humidity back once the conversion is done.
+ *
+ * The temperature from this sensor is ignored; the DS18B20 is the one we
+ * trust for that.
+ *
+ * @param readings [out] the humidity fields are filled in on success.
+ *
+ * @return true if the read succeeded.
+ * @return false on failure.
+ */
+static bool sht3x_read(sensor_readings_t *readings)
+{
+    sht3x_raw_data_t raw;
+    uint32_t humidity;
+    esp_err_t ret;
+
+    // The library checks the CRC.
+    ret = sht3x_get_raw_data(&sht3x_dev, raw);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error reading humidity: %s", esp_err_to_name(ret));
+        return false;
+    }
+
+    // RH = 100 * raw / (2^16 - 1), which we want in tenths. Kept in integer
+    // math for the same reason as the temperature.
+    humidity = (raw[3] << 8) | raw[4];
+    readings->humidity = (uint16_t)((humidity * 1000 + 32767) / 65535);
+    readings->humidity_valid = true;
+
+    return true;
+}
+
+/**
+ * Turn off our sensor.
+ */
+static void sht3x_power_off(void)
+{
+    ESP_ERROR_CHECK(gpio_set_level(SHT3X_POWER_GPIO, 0));
+}
+
+const sensor_driver_t sht3x_driver = {
+    .name = "SHT3x",
+    .power_on = sht3x_power_on,
+    .start_conversion = sht3x_start_conversion,
+    .ready_time_ms = sht3x_ready_time_ms,
+    .read = sht3x_read,
+    .power_off = sht3x_power_off,
+};
+
+#endif // USE_SHT3X
@@ -0,0 +1,24 @@
+/**
+ * @file
+ * Header file for sht3x_sensor.c.
+ */
+
+#ifndef __SHT3X_SENSOR_H_
+#define __SHT3X_SENSOR_H_
+
+#include "sensors.h"
+
+/*
+ * Set this to 1 if the puck has an SHT3x humidity sensor fitted. The stock
+ * puck doesn't, so it's off by default.
+ */
+#define USE_SHT3X 0
+
+#if USE_SHT3X
+/**
+ * The SHT3x driver, for the table in sensors.c.
+ */
+extern const sensor_driver_t sht3x_driver;
+#endif // USE_SHT3X
+
+#endif // __SHT3X_SENSOR_H_
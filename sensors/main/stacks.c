@@ -0,0 +1,98 @@
+/**
+ * @file
+ * Stack use tracking.
+ *
+ * Task stack sizes are a guess until something measures them. This keeps the
+ * deepest each of our tasks has gone, since power on, in RTC memory, so it
+ * covers real wakes with WiFi, DNS, CoAP and logging all in play, and sends
+ * it with the reports. That gives hard numbers to shrink the stacks to.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "stacks.h"
+#include "rtc_storage.h"
+
+/**
+ * A task being watched.
+ */
+typedef struct {
+    const char *name;           /**< Name in the report. */
+    TaskHandle_t handle;        /**< Its handle, or NULL if not started. */
+    uint32_t size;              /**< Stack depth it was created with. */
+} watched_t;
+
+/** Our tasks. The names have to match STACKS_LINE_LEN. */
+static watched_t watched[STACK_MAX] = {
+    [STACK_TEMP] = { .name = "temp" },
+    [STACK_WIFI] = { .name = "wifi" },
+    [STACK_CONSOLE] = { .name = "console" },
+};
+
+/**
+ * Work out how much of a task's stack it has used this boot.
+ *
+ * @param task [in] The task.
+ *
+ * @return the most it has used, in bytes, or 0 if it isn't running.
+ */
+static uint32_t used_now(const watched_t *task)
+{
+    if (task->handle == NULL) {
+        return 0;
+    }
+
+    return (task->size - uxTaskGetStackHighWaterMark(task->handle)) *
+           sizeof(StackType_t);
+}
+
+void stacks_watch(stack_task_t task, TaskHandle_t handle, uint32_t size)
+{
+    watched[task].handle = handle;
+    watched[task].size = size;
+}
+
+void stacks_update(void)
+{
+    uint32_t used;
+    int i;
+
+    for (i = 0; i < STACK_MAX; ++i) {
+        used = used_now(&watched[i]);
+        if (used > rtc_storage.stack_peak[i]) {
+            rtc_storage.stack_peak[i] = used;
+        }
+    }
+}
+
+void stacks_format(char *buffer, size_t size)
+{
+    size_t used;
+    int i;
+
+    stacks_update();
+
+    snprintf(buffer, size, "\nstack=");
+    for (i = 0; i < STACK_MAX; ++i) {
+        used = strlen(buffer);
+        snprintf(buffer + used, size - used, "%s%s:%u/%u", i > 0 ? "," : "",
+                 watched[i].name, rtc_storage.stack_peak[i],
+                 watched[i].size * sizeof(StackType_t));
+    }
+}
+
+void stacks_print(void)
+{
+    int i;
+
+    stacks_update();
+
+    printf("Task\t\tSize\tNow\tPeak\n");
+    for (i = 0; i < STACK_MAX; ++i) {
+        printf("%-8s\t%u\t%u\t%u\n", watched[i].name,
+               watched[i].size * sizeof(StackType_t), used_now(&watched[i]),
+               rtc_storage.stack_peak[i]);
+    }
+    printf("\nIn bytes. Peak is since power on.\n");
+}
@@ -0,0 +1,61 @@
+/**
+ * @file
+ * Header file for stacks.c.
+ */
+
+#ifndef __STACKS_H_
+#define __STACKS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/**
+ * Our tasks, whose stack use is tracked.
+ */
+typedef enum {
+    STACK_TEMP,                 /**< The temperature task. */
+    STACK_WIFI,                 /**< The WiFi task. */
+    STACK_CONSOLE,              /**< The console task. */
+    STACK_MAX,
+} stack_task_t;
+
+/**
+ * Length of the report line: "\nstack=", the task names, and for each task, a
+ * colon, up to 5 digits, a slash, up to 5 digits and a comma.
+ */
+#define STACKS_LINE_LEN (7 + 4 + 4 + 7 + STACK_MAX * (1 + 5 + 1 + 5 + 1))
+
+/**
+ * Start tracking a task's stack.
+ *
+ * @param task   [in] Which task it is.
+ * @param handle [in] Its handle.
+ * @param size   [in] The stack depth it was created with.
+ */
+void stacks_watch(stack_task_t task, TaskHandle_t handle, uint32_t size);
+
+/**
+ * Fold how much of each task's stack has been used this boot into the peaks
+ * kept in RTC memory.
+ *
+ * @note Call this before write_rtc_storage() when going to sleep.
+ */
+void stacks_update(void);
+
+/**
+ * Format the peak stack use of each task, since power on, as a report line:
+ * "\nstack=temp:<used>/<size>,..." in bytes.
+ *
+ * @param buffer [out] Buffer to receive it. Always NUL terminated.
+ * @param size   [in]  Size of buffer; STACKS_LINE_LEN + 1 is enough.
+ */
+void stacks_format(char *buffer, size_t size);
+
+/**
+ * Print each task's stack size and use to the console.
+ */
+void stacks_print(void);
+
+#endif // __STACKS_H_
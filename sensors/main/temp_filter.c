@@ -0,0 +1,91 @@
+/**
+ * @file
+ * Plausibility filter and smoothing for temperature readings.
+ *
+ * This does on the sensor what the controller does with MAX_TEMP_DELTA, but
+ * before we've spent the energy to bring up the radio.
+ */
+
+#include <stdlib.h> // for abs
+#include <string.h> // for memcpy
+#include "esp_log.h"
+
+#include "temp_filter.h"
+#include "rtc_storage.h"
+
+static const char *TAG = "filter";
+
+/**
+ * Get the median of the readings currently in the window.
+ *
+ * @return the median. Only meaningful if the window is not empty.
+ */
+static int16_t window_median(void)
+{
+    int16_t sorted[FILTER_WINDOW_LEN];
+    int16_t value;
+    int count = rtc_storage.filter_count;
+    int i;
+    int j;
+
+    memcpy(sorted, rtc_storage.filter_window, sizeof(sorted));
+
+    // Insertion sort - there are only ever a handful of items.
+    for (i = 1; i < count; ++i) {
+        value = sorted[i];
+        for (j = i - 1; j >= 0 && sorted[j] > value; --j) {
+            sorted[j + 1] = sorted[j];
+        }
+        sorted[j + 1] = value;
+    }
+
+    return sorted[count / 2];
+}
+
+/**
+ * Add a reading to the window, replacing the oldest one if it is full.
+ *
+ * @param reading The reading to add.
+ */
+static void window_add(int16_t reading)
+{
+    rtc_storage.filter_window[rtc_storage.filter_next] = reading;
+    rtc_storage.filter_next = (rtc_storage.filter_next + 1) % FILTER_WINDOW_LEN;
+    if (rtc_storage.filter_count < FILTER_WINDOW_LEN) {
+        ++rtc_storage.filter_count;
+    }
+}
+
+bool filter_temperature(int16_t reading, int16_t *smoothed)
+{
+    bool accepted = true;
+
+    if (rtc_storage.filter_count > 0 &&
+        abs(reading - window_median()) > FILTER_MAX_DELTA) {
+
+        ++rtc_storage.filter_rejects;
+
+        if (rtc_storage.filter_rejects < FILTER_MAX_REJECTS) {
+            ESP_LOGW(TAG, "Rejecting implausible reading %d (median %d).",
+                     reading, window_median());
+            accepted = false;
+        }
+        else {
+            // It's been saying this for long enough that we believe it - start
+            // over from here.
+            ESP_LOGW(TAG, "Accepting reading %d after %d rejections.",
+                     reading, rtc_storage.filter_rejects);
+            rtc_storage.filter_count = 0;
+            rtc_storage.filter_next = 0;
+        }
+    }
+
+    if (accepted) {
+        rtc_storage.filter_rejects = 0;
+        window_add(reading);
+    }
+
+    *smoothed = window_median();
+
+    return accepted;
+}
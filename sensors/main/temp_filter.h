@@ -0,0 +1,48 @@
+/**
+ * @file
+ * Header file for temp_filter.c.
+ */
+
+#ifndef __TEMP_FILTER_H_
+#define __TEMP_FILTER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Number of readings we take the median of. This lives in RTC memory, so keep
+ * it small. It should be odd so the median is an actual reading.
+ */
+#define FILTER_WINDOW_LEN 3
+
+/**
+ * Largest plausible difference between a reading and the median of the
+ * window, in 1/16 degree C (so this is 5C).
+ *
+ * Anything further out than this is almost always the sensor misbehaving on
+ * low batteries rather than the room actually changing that fast.
+ */
+#define FILTER_MAX_DELTA (5 * 16)
+
+/**
+ * Number of implausible readings in a row after which we believe them anyway
+ * and restart the filter from the new value. This is so a genuine step change
+ * (say, the puck got moved) doesn't get rejected forever.
+ */
+#define FILTER_MAX_REJECTS 3
+
+/**
+ * Run a new reading through the filter.
+ *
+ * The filter state is kept in RTC memory, so this carries across deep sleeps.
+ *
+ * @param reading  [in]  The new reading, in 1/16 degree C.
+ * @param smoothed [out] The median of the window after this reading was (or
+ *                       wasn't) added.
+ *
+ * @return true if the reading is plausible and was added to the window.
+ * @return false if the reading was rejected and should not be reported.
+ */
+bool filter_temperature(int16_t reading, int16_t *smoothed);
+
+#endif // __TEMP_FILTER_H_
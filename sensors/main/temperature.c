@@ -6,8 +6,7 @@
 #include "esp_log.h"
 #include "esp_sleep.h"
 #include "esp_system.h"
-#include <driver/gpio.h>
-#include <ds18x20.h>
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
@@ -15,60 +14,35 @@
 #include "temperature.h"
 #include "config_storage.h"
 #include "wifi.h"
+#include "rtc_storage.h"
+#include "temp_filter.h"
+#include "sensors.h"
+#include "ds18b20_sensor.h"
+#include "wake_budget.h"
+#include "schedule.h"
+#include "backlog.h"
+#include "coap_server.h"
+#include "stacks.h"
 
 static const char *TAG = "temperature";
 
-#define SENSOR_GPIO GPIO_NUM_12
-#define POWER_GPIO GPIO_NUM_13
-
-/* For our config, we want to turn off the high 3 bits and leave the others
- * alone. Note that, strictly speaking, the DS18B20 only cares about bits 5
- * and 6 - bit 7 is always zero. But, some other sensors have that high bit
- * and can use it for other resolutions. But, clearing it should result in the
- * standard behavior and not bother the actual DS18B20.
- */
-
-/* Values for the config register for various conversion precisions and
- * conversion times in ms.
- *
- * Note that various third party sensors may use these bits for other purposes;
- * if so, add them as necessary. This is only tested with the actual Dallas /
- * Maxim DS18B20.
- */
-#define DS18B20_12BIT 0x7F
-#define DS18B20_12BIT_TIME 750
-#define DS18B20_11BIT 0x5F
-#define DS18B20_11BIT_TIME 375
-#define DS18B20_10BIT 0x3F
-#define DS18B20_10BIT_TIME 188
-#define DS18B20_9BIT  0x1F
-#define DS18B20_9BIT_TIME 94
-
-/*
- * Precision and delay selection.
- */
-#define SENSOR_CONFIG_REG_VALUE DS18B20_12BIT
-#define MEASUREMENT_DELAY_MS DS18B20_12BIT_TIME
-
 /*
- * Delay in MS after sensor on to wait before doing something. This allows for
- * power to settle, capacitors to charge, etc.
+ * How far (in whole degrees C) the integer part of the temperature has to
+ * move from the last reported value before the sensor raises its alarm flag.
  *
- * Note that anything less than 10 does nothing because portTICK_PERIOD_MS is
- * 10.
+ * The DS18B20 only compares the integer part of the reading against TH and TL,
+ * so 1 means "as soon as the reading crosses a whole degree boundary in
+ * either direction", which works out to between 0.0625 and 1 degree C of
+ * change.
  */
-#define SENSOR_ON_DELAY_MS 10
+#define ALARM_MARGIN_C 1
 
-/*
- * If we are running the DS18B20 in its default mode (12 bit resolution), we
- * don't need to update the config because new parts will be set to the
- * defaults. However, if not, this needs to be set to 1 so we update the config
- * accordingly.
- */
-#define CHECK_DS18B20_CONFIG 1
+// The last temperature we read, in 1/16 degree C.
+int16_t last_temp = 0;
 
-// The last temperature we read.
-float last_temp = 0;
+// The last humidity we read, in 1/10 percent, if we have a sensor for it.
+bool last_humidity_valid = false;
+uint16_t last_humidity = 0;
 
 // Use deep sleep. Set to false for easier debugging.
 bool use_deep_sleep = true;
@@ -80,168 +54,87 @@ bool use_deep_sleep = true;
 bool paused = false;
 
 /**
- * Turn on our sensor.
- */
-static void sensor_on(void)
-{
-    /* Turn on the power, and set pullup mode on comms pin so the bus works.
-     * The internal pullup violates the datasheet recommendations, but works,
-     * and saves us an external resistor.
-     */
-    ESP_ERROR_CHECK(gpio_set_level(POWER_GPIO, 1));
-    ESP_ERROR_CHECK(gpio_set_pull_mode(SENSOR_GPIO, GPIO_PULLUP_ONLY));
-
-    vTaskDelay(SENSOR_ON_DELAY_MS / portTICK_PERIOD_MS);
-}
-
-/**
- * Turn off our sensor.
+ * Set the alarm thresholds around a reported temperature.
+ *
+ * These are only kept in RTC memory - the sensor loses its scratchpad when we
+ * power it off, and we don't want to wear out its EEPROM by saving them
+ * there on every report, so they're written to it on each alarm check.
+ *
+ * @param temperature The temperature we just reported, in 1/16 degree C.
  */
-static void sensor_off(void)
+static void set_alarm_thresholds(int16_t temperature)
 {
-    /* We've now gotten the temperature, turn off the power and bus lines,
-     * and pull the bus line down avoid current leakage across the pullup.
-     */
-    ESP_ERROR_CHECK(gpio_set_level(SENSOR_GPIO, 0));
-    ESP_ERROR_CHECK(gpio_set_level(POWER_GPIO, 0));
-    ESP_ERROR_CHECK(gpio_set_pull_mode(SENSOR_GPIO, GPIO_PULLDOWN_ONLY));
+    // The sensor compares bits 11-4 of the reading, which is the whole degrees
+    // rounded toward negative infinity - and that's what an arithmetic shift
+    // gives us.
+    int whole = temperature >> 4;
+
+    rtc_storage.alarm_high = whole + ALARM_MARGIN_C;
+    rtc_storage.alarm_low = whole - ALARM_MARGIN_C;
+    rtc_storage.alarm_valid = true;
 }
 
 /**
- * Read the temperature.
+ * Check whether a temperature is outside the alarm thresholds.
+ *
+ * This is the same comparison the sensor does in hardware.
  *
- * @param temperature [out] pointer to variable to receive the
- *                          temperature. Only valid if the function
- *                          returns true.
+ * @param temperature The temperature, in 1/16 degree C.
  *
- * @return true if the temperature read succeeded.
- * @return false if the temperature read succeeded.
+ * @return true if it is at or beyond either threshold.
  */
-static bool read_temperature(float *temperature)
+static bool is_outside_alarm_thresholds(int16_t temperature)
 {
-    esp_err_t ret;
-    bool success = false;
-    int count;
+    int whole = temperature >> 4;
 
-    sensor_on();
+    return whole >= rtc_storage.alarm_high || whole <= rtc_storage.alarm_low;
+}
 
-    // Start measuring. false here means don't wait.
-    ret = ds18x20_measure(SENSOR_GPIO, DS18X20_ANY, false);
-    count = 0;
-    // occasionally we'll fail to start the conversion, so retry until
-    // it succeeds or we give up.
-    while (ret != ESP_OK && count < 5) {
-        ret = ds18x20_measure(SENSOR_GPIO, DS18X20_ANY, false);
-        ++count;
-    }
-    if (count > 0) {
-        ESP_LOGW(TAG, "It took %d tries to start measurement.", count + 1);
-    }
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Error starting measurement: %s", esp_err_to_name(ret));
-    }
-    else {
-        // wait for measurement to happen, adding 1 extra tick just to be
-        // certain we have given ample time.
-        vTaskDelay((MEASUREMENT_DELAY_MS / portTICK_PERIOD_MS) + 1);
-
-        // Read it back.
-        ret = ds18b20_read_temperature(SENSOR_GPIO, DS18X20_ANY, temperature);
-        count = 0;
-        // occasionally we'll get corrupt data (detectable via bad CRC)
-        // so retry the read until it succeeds or we give up.
-        while (ret != ESP_OK && count < 5) {
-            ret = ds18b20_read_temperature(
-                      SENSOR_GPIO, DS18X20_ANY, temperature);
-            ++count;
-        }
-        if (count > 0) {
-            ESP_LOGW(TAG, "It took %d tries to read the temperature.", count + 1);
-        }
-        if (ret == ESP_OK) {
-            // We have good data, set success.
-            success = true;
-        }
-        else {
-            ESP_LOGE(TAG, "Error reading temperature: %s",
-                     esp_err_to_name(ret));
-        }
-    }
+int temp_to_tenths(int16_t temperature, bool celsius)
+{
+    // Round half away from zero. Note that the division truncates toward zero,
+    // so the offset has to follow the sign.
+    int32_t rounding = temperature < 0 ? -(TEMP_UNITS_PER_DEGREE / 2) :
+                                          (TEMP_UNITS_PER_DEGREE / 2);
 
-    sensor_off();
+    if (celsius) {
+        return ((int32_t)temperature * 10 + rounding) / TEMP_UNITS_PER_DEGREE;
+    }
 
-    return success;
+    // F = C * 1.8 + 32, in tenths.
+    return ((int32_t)temperature * 18 + rounding) / TEMP_UNITS_PER_DEGREE +
+           320;
 }
 
-#if CHECK_DS18B20_CONFIG
-/**
- * Check and (optionally) fix the configuration.
- * 
- * @return true the configuration was or is now correct.
- * @return false if there was any sort of error.
- */
-static bool check_and_fix_18b20_configuration(void)
+int format_temperature(char *buffer, size_t length, int16_t temperature,
+                       bool celsius)
 {
-    // scratchpad holds 8 bytes of data
-    uint8_t scratchpad[8] = {};
-
-    bool success = false;
-    int count = 0;
-    esp_err_t ret;
+    int tenths = temp_to_tenths(temperature, celsius);
+    const char *sign = "";
 
-    sensor_on();
-
-    while (!success && count < 5 ) {
-        ret = ds18x20_read_scratchpad(SENSOR_GPIO, DS18X20_ANY, scratchpad);
-        if (ret != ESP_OK) {
-            ESP_LOGE(TAG, "Error reading scratchpad: %s",
-                    esp_err_to_name(ret));
-        }
-        else {
-            // The config register is byte index 4
-            if (scratchpad[4] == SENSOR_CONFIG_REG_VALUE) {
-                ESP_LOGI(TAG, "Temperature sensor config is correct.");
-                success = true;
-            }
-            else {
-                scratchpad[4] = SENSOR_CONFIG_REG_VALUE;
-
-                ESP_LOGI(TAG,
-                        "Temperature sensor config is incorrect - rewriting.");
-
-                // We only write bytes 2-4, to the scratchpad.
-                ret = ds18x20_write_scratchpad(SENSOR_GPIO,
-                                            DS18X20_ANY,
-                                            &scratchpad[2]);
-                if (ret != ESP_OK) {
-                    ESP_LOGE(TAG, "Error writing scratchpad: %s",
-                            esp_err_to_name(ret));
-                }
-                else {
-                    // And then save it once it's written.
-                    ret = ds18x20_copy_scratchpad(SENSOR_GPIO, DS18X20_ANY);
-                    if (ret != ESP_OK) {
-                        ESP_LOGE(TAG, "Error copying scratchpad: %s",
-                                esp_err_to_name(ret));
-                    }
-                    else {
-                        success = true;
-                    }
-                }
-            }
-        }
-        ++count;
+    if (tenths < 0) {
+        sign = "-";
+        tenths = -tenths;
     }
 
-    sensor_off();
-
-    return success;
+    return snprintf(buffer, length, "%s%d.%d", sign, tenths / 10, tenths % 10);
 }
-#endif // CHECK_DS18B20_CONFIG
 
-float c_to_f(float celsius)
+/**
+ * Decide whether this wake has to report in, regardless of the temperature.
+ *
+ * @param rtc_valid Whether RTC storage survived from the last wake.
+ *
+ * @return true if we must report.
+ * @return false if we only need to if the temperature has moved.
+ */
+static bool is_report_due(bool rtc_valid)
 {
-    return celsius * 1.8 + 32;
+    // Always report on a cold boot, when we don't have thresholds to compare
+    // against, or when we're set to report every time.
+    return !rtc_valid ||
+           !rtc_storage.alarm_valid ||
+           rtc_storage.polls_since_report + 1 >= schedule_heartbeat_polls();
 }
 
 /**
@@ -252,21 +145,32 @@ float c_to_f(float celsius)
 static void temp_task(void *pvParameters)
 {
     bool comms_success;
+    bool report_due;
+    bool backoff;
+    bool rtc_valid;
+    bool fast_off;
+    bool mains;
+    bool streaming;
     int count;
+    alarm_result_t alarm;
+    int16_t smoothed;
+    sensor_readings_t readings;
     TickType_t last_wake_time_ticks = xTaskGetTickCount();
-    TickType_t next_wake_time_ticks = last_wake_time_ticks +
-                                      (current_config.poll_time_sec * 1000) /
-                                      portTICK_PERIOD_MS;
+    TickType_t next_wake_time_ticks;
     TickType_t now_ticks;
     uint64_t interval_microseconds = 0;
+    int64_t shutdown_start_us;
+    uint32_t shutdown_ms;
 
 
-    float temp_temp;
+    int16_t temp_temp;
+    char temp_str[MAX_TEMPERATURE_STR_LEN];
 
-#if CHECK_DS18B20_CONFIG
-    // Check and fix our sensor config.
-    comms_success = check_and_fix_18b20_configuration();
-#endif // CHECK_DS18B20_CONFIG
+    rtc_valid = read_rtc_storage();
+    if (rtc_valid) {
+        wake_budget_check_last();
+    }
+    backlog_init(rtc_valid);
 
     while (true) {
         while(paused) {
@@ -274,84 +178,274 @@ static void temp_task(void *pvParameters)
             vTaskDelay(10000 / portTICK_PERIOD_MS);
         }
 
-        ESP_LOGW(TAG, "Starting temperature sampling.");
-        now_ticks = xTaskGetTickCount();
+        // On mains power, we stay up and report every poll, so the
+        // controller gets a low latency feed. Read it every time round, so
+        // it takes effect as soon as it's saved.
+        mains = current_config.mains_powered;
+
+        // Only enforce the budget if we're going to deep sleep - if not,
+        // someone is debugging and doesn't want it pulled out from under them.
+        if (use_deep_sleep && !mains) {
+            wake_budget_start();
+        }
+        wake_budget_set_phase(WAKE_PHASE_SAMPLING);
+
+        // If we're backing off, we don't even try - and the cheap alarm check
+        // is no use either, because we couldn't report what it found.
+        backoff = rtc_valid && schedule_skip_radio();
 
+        // If the controller is observing us, it gets every change as soon as
+        // we have it, so we only need to report for the heartbeat.
+        streaming = mains && !backoff && coap_server_is_observed();
+        report_due = !backoff &&
+                     ((mains && !streaming) || is_report_due(rtc_valid));
         comms_success = false;
-        count = 0; // prevent infinite tight loop
-        while (!comms_success && count < 5 ) {
-            comms_success = read_temperature(&temp_temp);
-            if (comms_success && temp_temp == 85) {
-                /* 85 is the power on reset value and sometimes our call to
-                 * kick off a temperature conversion silently fails, resulting
-                 * in no conversion happening. Since this is for residential
-                 * HVAC, if we're ever in that temperature range, no amount of * AC is ever going to save us. So, it's fair to treat this as * out of range and sample again, even though doing so might
-                 * put us into an infinite loop if it were ever to get that
-                 * warm. I'm willing to take that risk.
-                */
-                comms_success = false;
-                ESP_LOGW(TAG, "Discarding default reading of 85");
-            }
-            ++count;
+        if (backoff) {
+            ESP_LOGW(TAG, "Backing off after %u failures - sampling only.",
+                     rtc_storage.failure_streak);
+        }
+        else if (report_due) {
+            // Start bringing WiFi up now, so it connects while we're busy
+            // sampling. On mains power, it's probably still up from last
+            // time, in which case this does nothing.
+            wifi_enable();
+
+#if CHECK_DS18B20_CONFIG
+            // Check and fix our sensor config. If this fails, so will the
+            // read below, so there's nothing else to do about it here.
+            ds18b20_check_and_fix_configuration();
+#endif // CHECK_DS18B20_CONFIG
         }
-        if (count > 1) {
-            ESP_LOGW(TAG, "It took %d tries to read temperature.", count + 1);
+        else if (streaming) {
+            // No need for the alarm - we're about to read the temperature
+            // anyway, and the observer hears about it if it's changed.
+            ESP_LOGI(TAG, "Streaming to observer.");
         }
+        else {
+            ESP_LOGW(TAG, "Checking temperature alarm.");
+            now_ticks = xTaskGetTickCount();
 
-        ESP_LOGW(TAG, "Temperature acquisition took %dms.",
-            (xTaskGetTickCount() - now_ticks) * portTICK_PERIOD_MS);
+            alarm = ds18b20_check_alarm(rtc_storage.alarm_high,
+                                        rtc_storage.alarm_low, &temp_temp);
 
-        ESP_LOGI(TAG, "Waiting for WiFi");
-        // Wait for wifi to be up before sending our message
-        if (wait_for_wifi_connected()) {
-            if (comms_success) {
-                // good temp, update
-                if (current_config.use_celsius) {
-                    last_temp = temp_temp;
-                    ESP_LOGW(TAG, "Read temp: %.1f°C", last_temp);
+            ESP_LOGW(TAG, "Alarm check took %dms.",
+                (xTaskGetTickCount() - now_ticks) * portTICK_PERIOD_MS);
+
+            if (alarm == ALARM_CLEAR) {
+                schedule_note_steady();
+            }
+            else if (alarm == ALARM_TRIPPED) {
+                // The sensor says it moved, but only bring the radio up if the
+                // filter agrees - a single noisy reading near the threshold
+                // isn't worth a transmission.
+                if (!filter_temperature(temp_temp, &smoothed)) {
+                    ESP_LOGW(TAG, "Temperature alarm on implausible reading - "
+                                  "not reporting.");
+                }
+                else if (!is_outside_alarm_thresholds(smoothed)) {
+                    ESP_LOGW(TAG, "Temperature alarm not confirmed by filter - "
+                                  "not reporting.");
                 }
                 else {
-                    last_temp = c_to_f(temp_temp);
-                    ESP_LOGW(TAG, "Read temp: %.1f°F", last_temp);
+                    ESP_LOGW(TAG, "Temperature alarm - reporting.");
+                    report_due = true;
+                    comms_success = true;
+                    wifi_enable();
                 }
-
-                // We've read our temperature, wake up our WiFi task to send it.
-                // This is nonblocking., so we have to wait below.
-                wifi_send_temperature();
             }
-            else {
-                ESP_LOGE(TAG, "Temperature read invalid - not doing anything.");
+            else if (alarm == ALARM_ERROR) {
+                // Do a full read with all its retries, and report it.
+                ESP_LOGW(TAG, "Temperature alarm check failed - reporting.");
+                report_due = true;
+                wifi_enable();
             }
+        }
 
-            ESP_LOGI(TAG, "Waiting for message to send.");
-            // While there are any messages outstanding, wait.
-            if (!wait_for_sending_complete()) {
-                ESP_LOGW(TAG,
-                         "Timeout waiting for message to send.");
+        if ((report_due || backoff || streaming) && !comms_success) {
+            ESP_LOGW(TAG, "Starting temperature sampling.");
+            now_ticks = xTaskGetTickCount();
+
+            count = 0; // prevent infinite tight loop
+            while (!comms_success && count < 5 ) {
+                // Everything converts at once, so this takes as long as the
+                // slowest sensor. It's only worth retrying for the
+                // temperature, though - that's what we report.
+                sample_sensors(&readings);
+                comms_success = readings.temperature_valid;
+                temp_temp = readings.temperature;
+                ++count;
+            }
+            if (count > 1) {
+                ESP_LOGW(TAG, "It took %d tries to read temperature.", count + 1);
             }
 
-            // Regardless of sending timing out or not, we turn WiFi off and
-            // sleep.
+            if (readings.humidity_valid) {
+                last_humidity = readings.humidity;
+                last_humidity_valid = true;
+                ESP_LOGW(TAG, "Read humidity: %u.%u%%", last_humidity / 10,
+                         last_humidity % 10);
+            }
 
-            ESP_LOGI(TAG, "Waiting for WiFi off.");
-            // we're about to go sleep; disable wifi so it comes down
-            // gracefully, and then wait for it to actually be down.
-            wifi_disable();
+            ESP_LOGW(TAG, "Temperature acquisition took %dms.",
+                (xTaskGetTickCount() - now_ticks) * portTICK_PERIOD_MS);
 
-            if (!wait_for_wifi_off()) {
-                ESP_LOGW(TAG,
-                "Timeout waiting for WiFi to come down.");
+            // Drop implausible readings rather than sending them.
+            if (comms_success && !filter_temperature(temp_temp, &smoothed)) {
+                comms_success = false;
             }
         }
-        else {
-            ESP_LOGW(TAG, "Timeout waiting for WiFi to come up.");
+
+        if (comms_success) {
+            schedule_note_reading(smoothed);
+        }
+
+        if (streaming && !report_due && comms_success) {
+            last_temp = temp_temp;
+            wifi_notify_temperature();
+        }
+
+        if (backoff && comms_success) {
+            // Nothing to send it to, so keep it until there is.
+            last_temp = temp_temp;
+            backlog_push(temp_temp);
+        }
+
+        if (!report_due) {
+            ++rtc_storage.polls_since_report;
+        }
+
+        if (report_due) {
+            wake_budget_set_phase(WAKE_PHASE_CONNECTING);
+            ESP_LOGI(TAG, "Waiting for WiFi");
+            // Wait for wifi to be up before sending our message
+            if (wait_for_wifi_connected()) {
+                if (comms_success) {
+                    // good temp, update. It's kept in sensor units and only
+                    // converted to the configured unit when it's formatted.
+                    last_temp = temp_temp;
+                    format_temperature(temp_str, sizeof(temp_str), last_temp,
+                                       current_config.use_celsius);
+                    ESP_LOGW(TAG, "Read temp: %s°%c", temp_str,
+                             current_config.use_celsius ? 'C' : 'F');
+
+                    // We've read our temperature, wake up our WiFi task to
+                    // send it. This is nonblocking., so we have to wait below.
+                    wifi_send_temperature();
+
+                    // The thresholds track what we reported, so the next
+                    // alarm is relative to what the controller knows.
+                    set_alarm_thresholds(temp_temp);
+                    rtc_storage.polls_since_report = 0;
+
+                    // Only wait if we sent something - otherwise there's
+                    // nothing to wait for, and WiFi would stay up for the
+                    // whole timeout.
+                    wake_budget_set_phase(WAKE_PHASE_SENDING);
+                    ESP_LOGI(TAG, "Waiting for message to send.");
+                    if (!wait_for_sending_complete()) {
+                        ESP_LOGW(TAG,
+                                 "Timeout waiting for message to send.");
+                    }
+
+                    // We only know whether the controller is there if we
+                    // sent it something.
+                    if (last_send_succeeded()) {
+                        schedule_report_succeeded();
+                    }
+                    else {
+                        // The WiFi task keeps the reading for later.
+                        schedule_report_failed();
+                    }
+                }
+                else {
+                    ESP_LOGE(TAG, "Temperature read invalid - not doing anything.");
+                }
+
+                // On mains power we stay connected for the next report.
+                // Otherwise, regardless of sending timing out or not, we turn
+                // WiFi off and sleep.
+                if (mains) {
+                    ESP_LOGI(TAG, "On mains power, staying connected.");
+                }
+                else {
+                    wake_budget_set_phase(WAKE_PHASE_DISCONNECTING);
+                    ESP_LOGI(TAG, "Waiting for WiFi off.");
+                    shutdown_start_us = esp_timer_get_time();
+
+                    // If the controller has what it needs and we're about to
+                    // deep sleep, the radio is about to go off anyway, so
+                    // there's no point waiting for it to come down
+                    // gracefully.
+                    fast_off = current_config.fast_shutdown && comms_success &&
+                               last_send_succeeded() && use_deep_sleep &&
+                               !paused;
+                    if (fast_off) {
+                        wifi_disable_fast();
+                    }
+                    else {
+                        // disable wifi so it comes down gracefully.
+                        wifi_disable();
+                    }
+
+                    // and then wait for it to actually be down.
+                    if (!wait_for_wifi_off()) {
+                        ESP_LOGW(TAG,
+                        "Timeout waiting for WiFi to come down.");
+                    }
+
+                    shutdown_ms = (esp_timer_get_time() - shutdown_start_us) /
+                                  1000;
+                    ESP_LOGW(TAG, "%s WiFi shutdown took %ums.",
+                             fast_off ? "Fast" : "Graceful", shutdown_ms);
+
+                    // Keep it for "wifi show". Zero means "not yet", so
+                    // round up.
+                    if (shutdown_ms > UINT16_MAX) {
+                        shutdown_ms = UINT16_MAX;
+                    }
+                    else if (shutdown_ms == 0) {
+                        shutdown_ms = 1;
+                    }
+                    if (fast_off) {
+                        rtc_storage.fast_off_ms = shutdown_ms;
+                    }
+                    else {
+                        rtc_storage.graceful_off_ms = shutdown_ms;
+                    }
+                }
+            }
+            else {
+                ESP_LOGW(TAG, "Timeout waiting for WiFi to come up.");
+                // Don't leave it trying to connect while we sleep.
+                wifi_disable();
+                schedule_report_failed();
+                if (comms_success) {
+                    backlog_push(temp_temp);
+                }
+            }
         }
 
+        // We made it; the rest is just sleeping.
+        wake_budget_end();
+
+        // Whatever happened above, make sure it's still there when we wake.
+        // (It's written again below if we deep sleep, but if we don't, it
+        // needs to be right for the console.)
+        stacks_update();
+        write_rtc_storage();
+        rtc_valid = true;
+
+        // Work out when we should wake, now we know what the temperature is
+        // doing (in case we're adapting the poll interval to it).
+        next_wake_time_ticks = last_wake_time_ticks +
+                               (schedule_interval_s() * 1000) /
+                               portTICK_PERIOD_MS;
+
         // and we need to account for the time we spent executing, above.
         now_ticks = xTaskGetTickCount();
 
         ESP_LOGI(TAG, "poll time = %d sec, now_ticks = %d, "
-                      "last_wake_time_ticks = %d, next_wake_time_ticks = %d", current_config.poll_time_sec, now_ticks,
+                      "last_wake_time_ticks = %d, next_wake_time_ticks = %d", schedule_interval_s(), now_ticks,
                       last_wake_time_ticks, next_wake_time_ticks);
 
         if (now_ticks > next_wake_time_ticks) {
@@ -369,50 +463,78 @@ static void temp_task(void *pvParameters)
             interval_microseconds = (next_wake_time_ticks - now_ticks) *
                                         portTICK_PERIOD_MS * 1000;
 
+            // and then line it up with our slot, if we have one. Slots
+            // spread out battery pucks' reports; on mains power we just
+            // report as often as we're asked.
+            if (!mains) {
+                interval_microseconds =
+                    (uint64_t)schedule_sleep_ms(interval_microseconds / 1000) *
+                    1000;
+            }
+
             // There is a possibility that we got here before the user could
             // type "pause". If so, we'd go into a deep sleep which is a reboot,
             // which means this might happen repeatedly. So, if pause is set by
-            // here, don't deep sleep.
-            if (use_deep_sleep && !paused) {
-                ESP_LOGW(TAG, "Deep sleep for %lld us.", interval_microseconds);
+            // here, don't deep sleep. On mains power, we never do.
+            if (use_deep_sleep && !paused && !mains) {
+                // Note that we print this in ms because newlib nano printf
+                // doesn't do 64 bit values.
+                ESP_LOGW(TAG, "Deep sleep for %u ms.",
+                         (uint32_t)(interval_microseconds / 1000));
+
+                interval_microseconds = (uint64_t)schedule_prepare_deep_sleep(
+                                            interval_microseconds / 1000) *
+                                        1000;
+                write_rtc_storage();
 
                 esp_deep_sleep(interval_microseconds);
             }
             else {
-                ESP_LOGW(TAG, "Normal sleep for %lld us.", interval_microseconds);
+                ESP_LOGW(TAG, "Normal sleep for %u ms.",
+                         (uint32_t)(interval_microseconds / 1000));
 
                 vTaskDelay((interval_microseconds / 1000) / portTICK_PERIOD_MS);
             }
         }
 
-        // reset last wake time, calculate next wake time
+        // reset last wake time
         last_wake_time_ticks = xTaskGetTickCount();
-        next_wake_time_ticks = last_wake_time_ticks +
-                               (current_config.poll_time_sec * 1000) /
-                               portTICK_PERIOD_MS;
 
         ESP_LOGI(TAG, "Waking up");
-        // Enable WiFi again, then loop.
-        wifi_enable();
     }
 }
 
-float get_last_temp(void)
+int16_t get_last_temp(void)
 {
     return last_temp;
 }
 
+bool get_last_humidity(uint16_t *humidity)
+{
+    *humidity = last_humidity;
+
+    return last_humidity_valid;
+}
+
 void start_temp_polling(void)
 {
-    xTaskCreate(temp_task, "temp", 2048, NULL, TEMP_TASK_PRIORITY, NULL);
+    static StackType_t stack[TEMP_TASK_STACK_SIZE];
+    static StaticTask_t tcb;
+    TaskHandle_t handle;
+
+    handle = xTaskCreateStatic(temp_task, "temp", TEMP_TASK_STACK_SIZE, NULL,
+                               TEMP_TASK_PRIORITY, stack, &tcb);
+    stacks_watch(STACK_TEMP, handle, TEMP_TASK_STACK_SIZE);
 }
 
 void disable_deep_sleep(void)
 {
     use_deep_sleep = false;
+    wake_budget_stop();
 }
 
 void enable_pause(void)
 {
     paused = true;
+    wake_budget_stop();
 }
\ No newline at end of file
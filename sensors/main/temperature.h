@@ -6,14 +6,47 @@
 #ifndef __TEMPERATURE_H_
 #define __TEMPERATURE_H_
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Temperatures are passed around as signed 16 bit counts of 1/16 degree C,
+ * which is what the DS18B20 gives us. There is no FPU, so we stay in integer
+ * math all the way to the formatted string.
+ */
+#define TEMP_UNITS_PER_DEGREE 16
+
+/**
+ * Maximum length of a formatted temperature, including the NUL.
+ *
+ * The sensor range is -55 to 125C (-67 to 257F), so this is a sign or a
+ * hundreds digit, 2 more digits, a decimal point and a tenths digit.
+ */
+#define MAX_TEMPERATURE_STR_LEN 6
+
+/**
+ * Convert a temperature to tenths of a degree in the given unit.
+ *
+ * @param temperature The temperature in 1/16 degree C.
+ * @param celsius     true for Celsius, false for Farenheit.
+ *
+ * @return The temperature in tenths of a degree, rounded to nearest.
+ */
+int temp_to_tenths(int16_t temperature, bool celsius);
+
 /**
- * Convert Celsius to Farenheit.
+ * Format a temperature with one decimal place, e.g. "-12.5".
  *
- * @param celsius The temperature in Celsius.
+ * @param buffer      [out] buffer to receive the string.
+ * @param length      [in]  size of buffer; MAX_TEMPERATURE_STR_LEN is enough.
+ * @param temperature [in]  The temperature in 1/16 degree C.
+ * @param celsius     [in]  true for Celsius, false for Farenheit.
  *
- * @return The temperature in Farenheit.
+ * @return the return value of snprintf.
  */
-float c_to_f(float celsius);
+int format_temperature(char *buffer, size_t length, int16_t temperature,
+                       bool celsius);
 
 /**
  * Retrieve our last sampled temperature.
@@ -22,9 +55,19 @@ float c_to_f(float celsius);
  * because then we'd have to guard the hardware access with a mutex and
  * that's just unnecessary for a rarely used feature.
  *
- * @return the last value of the last sampled temperature.
+ * @return the value of the last sampled temperature, in 1/16 degree C.
+ */
+int16_t get_last_temp(void);
+
+/**
+ * Retrieve our last sampled humidity, as for get_last_temp().
+ *
+ * @param humidity [out] the last sampled humidity, in 1/10 percent.
+ *
+ * @return true if we have one.
+ * @return false if there's no humidity sensor or it hasn't been read yet.
  */
-float get_last_temp(void);
+bool get_last_humidity(uint16_t *humidity);
 
 /**
  * Start our temperature polling task.
@@ -0,0 +1,182 @@
+/**
+ * @file
+ * Hard limit on how long any one wake can last.
+ *
+ * Every step of a wake has its own timeout, but they add up, and a bad AP or
+ * a hung controller can keep one step going longer than expected. This puts
+ * one deadline over the whole lot, so a puck can't drain its batteries
+ * overnight because one thing got stuck.
+ *
+ * The waits take their timeouts from what's left, so a wake that runs out of
+ * budget winds down the normal way: the temperature task gets a timeout,
+ * records the failure and sleeps. The timer is only a backstop for something
+ * stuck where it isn't waiting.
+ */
+
+#include "esp_log.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+
+#include "wake_budget.h"
+#include "rtc_storage.h"
+#include "schedule.h"
+
+static const char *TAG = "wake_budget";
+
+/**
+ * Shortest sleep after the budget runs out, in ms, so a very short poll
+ * interval doesn't turn into an immediate reboot loop.
+ */
+#define MIN_EXPIRED_SLEEP_MS 1000
+
+/** Names for logging, indexed by wake_phase_t. */
+static const char *phase_names[WAKE_PHASE_MAX] = {
+    "idle",
+    "sampling",
+    "connecting",
+    "sending",
+    "disconnecting",
+};
+
+static esp_timer_handle_t budget_timer = NULL;
+
+static volatile wake_phase_t current_phase = WAKE_PHASE_NONE;
+
+/** Whether the budget applies to this wake. */
+static volatile bool budget_armed = false;
+
+/**
+ * esp_timer_get_time() when the budget runs out. Only written while the budget
+ * isn't armed.
+ */
+static int64_t budget_deadline_us;
+
+/** The phase the budget ran out in, or WAKE_PHASE_NONE if it hasn't. */
+static wake_phase_t expired_phase = WAKE_PHASE_NONE;
+
+/**
+ * Called from the esp_timer task if the wake is still going
+ * WAKE_BUDGET_GRACE_MS after the budget ran out.
+ *
+ * Whatever is stuck may be halfway through changing RTC memory, so this
+ * doesn't write any of it. The checksum is spoiled instead, so the next wake
+ * starts afresh rather than trusting something half done.
+ *
+ * @param arg unused.
+ */
+static void wake_budget_expired(void *arg)
+{
+    uint32_t sleep_ms = schedule_interval_s() * 1000;
+    uint32_t spent_ms = WAKE_BUDGET_MS + WAKE_BUDGET_GRACE_MS;
+
+    ESP_LOGE(TAG, "Stuck while %s after the wake budget ran out - forcing "
+                  "deep sleep.", phase_names[current_phase]);
+
+    // We've already used up the budget from this poll interval.
+    if (sleep_ms > spent_ms + MIN_EXPIRED_SLEEP_MS) {
+        sleep_ms -= spent_ms;
+    }
+    else {
+        sleep_ms = MIN_EXPIRED_SLEEP_MS;
+    }
+
+    rtc_storage.checksum = ~rtc_storage.checksum;
+
+    // This doesn't return.
+    esp_deep_sleep((uint64_t)sleep_ms * 1000);
+}
+
+void wake_budget_start(void)
+{
+    const esp_timer_create_args_t args = {
+        .callback = &wake_budget_expired,
+        .name = "wake_budget",
+    };
+
+    if (budget_timer == NULL) {
+        ESP_ERROR_CHECK(esp_timer_create(&args, &budget_timer));
+    }
+    else {
+        // Restarting a running timer is an error, so stop it first. If it
+        // isn't running, this fails harmlessly.
+        esp_timer_stop(budget_timer);
+    }
+
+    current_phase = WAKE_PHASE_NONE;
+    expired_phase = WAKE_PHASE_NONE;
+    budget_deadline_us = esp_timer_get_time() + WAKE_BUDGET_MS * 1000LL;
+    budget_armed = true;
+    ESP_ERROR_CHECK(esp_timer_start_once(budget_timer,
+                                         (uint64_t)(WAKE_BUDGET_MS +
+                                                    WAKE_BUDGET_GRACE_MS) *
+                                         1000));
+}
+
+void wake_budget_stop(void)
+{
+    budget_armed = false;
+    if (budget_timer != NULL) {
+        // As above, this fails harmlessly if it isn't running.
+        esp_timer_stop(budget_timer);
+    }
+    current_phase = WAKE_PHASE_NONE;
+}
+
+/**
+ * If the budget has run out and that hasn't been noted yet, it ran out in the
+ * current phase.
+ */
+static void note_expiry(void)
+{
+    if (budget_armed && expired_phase == WAKE_PHASE_NONE &&
+        esp_timer_get_time() >= budget_deadline_us) {
+        expired_phase = current_phase;
+    }
+}
+
+void wake_budget_end(void)
+{
+    note_expiry();
+    wake_budget_stop();
+
+    if (expired_phase != WAKE_PHASE_NONE) {
+        ESP_LOGE(TAG, "Wake budget ran out while %s.",
+                 phase_names[expired_phase]);
+        rtc_storage.budget_phase = (uint8_t)expired_phase;
+        ++rtc_storage.budget_expiries;
+    }
+}
+
+uint32_t wake_budget_remaining_ms(uint32_t timeout_ms)
+{
+    int64_t remaining_ms;
+
+    if (!budget_armed) {
+        return timeout_ms;
+    }
+
+    remaining_ms = (budget_deadline_us - esp_timer_get_time()) / 1000;
+    if (remaining_ms <= 0) {
+        return 0;
+    }
+
+    return remaining_ms < timeout_ms ? (uint32_t)remaining_ms : timeout_ms;
+}
+
+void wake_budget_set_phase(wake_phase_t phase)
+{
+    note_expiry();
+    current_phase = phase;
+}
+
+void wake_budget_check_last(void)
+{
+    if (rtc_storage.budget_phase != WAKE_PHASE_NONE &&
+        rtc_storage.budget_phase < WAKE_PHASE_MAX) {
+        ESP_LOGE(TAG, "Last wake ran out of time while %s (%u times so far).",
+                 phase_names[rtc_storage.budget_phase],
+                 rtc_storage.budget_expiries);
+    }
+
+    rtc_storage.budget_phase = WAKE_PHASE_NONE;
+}
@@ -0,0 +1,87 @@
+/**
+ * @file
+ * Header file for wake_budget.c.
+ */
+
+#ifndef __WAKE_BUDGET_H_
+#define __WAKE_BUDGET_H_
+
+#include <stdint.h>
+
+/**
+ * The longest we are allowed to stay awake on any one wake, in ms.
+ *
+ * A normal reporting wake takes a couple of seconds. Each step waits no
+ * longer than its own timeout or what's left of this, whichever is less, so
+ * a slow step leaves less time for the ones after it rather than making the
+ * wake overrun.
+ */
+#define WAKE_BUDGET_MS 30000
+
+/**
+ * How long after the budget runs out before we give up on the wake winding
+ * down by itself, in ms. That only happens if something is stuck somewhere
+ * other than waiting for the WiFi task.
+ */
+#define WAKE_BUDGET_GRACE_MS 2000
+
+/**
+ * What the wake was doing. If the budget runs out, this is recorded as the
+ * reason so it can be logged on the next wake.
+ */
+typedef enum {
+    WAKE_PHASE_NONE,            /**< Budget hasn't expired. */
+    WAKE_PHASE_SAMPLING,        /**< Talking to the sensors. */
+    WAKE_PHASE_CONNECTING,      /**< Waiting for WiFi to connect. */
+    WAKE_PHASE_SENDING,         /**< Waiting for the controller to reply. */
+    WAKE_PHASE_DISCONNECTING,   /**< Waiting for WiFi to come down. */
+    WAKE_PHASE_MAX,
+} wake_phase_t;
+
+/**
+ * Arm the budget for this wake. If it hasn't been stopped WAKE_BUDGET_GRACE_MS
+ * after it runs out, we go to deep sleep no matter what else is going on.
+ */
+void wake_budget_start(void);
+
+/**
+ * Disarm the budget, because sleep has been disabled from the console.
+ */
+void wake_budget_stop(void);
+
+/**
+ * Disarm the budget at the end of a wake, and record it in RTC memory if the
+ * budget ran out, so wake_budget_check_last() can log it.
+ *
+ * @note Call this from the temperature task, which owns the record.
+ */
+void wake_budget_end(void);
+
+/**
+ * How long something may wait, given what's left of the budget.
+ *
+ * @param timeout_ms [in] How long it would wait without a budget.
+ *
+ * @return timeout_ms, or what's left of the budget if that's less. If the
+ *         budget isn't armed, timeout_ms.
+ */
+uint32_t wake_budget_remaining_ms(uint32_t timeout_ms);
+
+/**
+ * Record what the wake is doing now. If the budget ran out during the last
+ * phase, that's the one wake_budget_end() records.
+ *
+ * @note Call this from the temperature task.
+ *
+ * @param phase the phase we're entering.
+ */
+void wake_budget_set_phase(wake_phase_t phase);
+
+/**
+ * Log it if the budget ran out on the previous wake, and clear the record.
+ *
+ * @note Call this after read_rtc_storage().
+ */
+void wake_budget_check_last(void);
+
+#endif // __WAKE_BUDGET_H_
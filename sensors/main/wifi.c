@@ -20,13 +20,13 @@
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/event_groups.h"
 #include "esp_system.h"
 #include "esp_log.h"
 #include "esp_netif.h"
 #include "esp_event.h"
 #include "esp_wifi.h"
 #include "esp_sleep.h"
+#include "esp_timer.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "queues.h"
@@ -38,39 +38,165 @@
 
 #include "priorities.h"
 #include "wifi.h"
+#include "coap_server.h"
+#include "coap_raw.h"
+#include "auth.h"
+#include "dtls.h"
+#include "discovery.h"
+#include "espnow.h"
 #include "config_storage.h"
 #include "temperature.h"
 #include "ap_cache_storage.h"
+#include "backlog.h"
+#include "reply.h"
+#include "rtc_storage.h"
+#include "stacks.h"
+#include "wake_budget.h"
 
-/* FreeRTOS event group to signal when we are connected*/
-static EventGroupHandle_t wifi_status;
+/**
+ * Where WiFi is in its lifecycle.
+ *
+ * Only the WiFi task changes this, and every command is handled there in turn,
+ * so nothing can start it while it's being stopped or stop it twice. The event
+ * handler only reads it, to know whether to retry a dropped connection.
+ */
+typedef enum {
+    WIFI_STATE_OFF,         /**< Stopped. */
+    WIFI_STATE_CONNECTING,  /**< Started, trying to connect to the AP. */
+    WIFI_STATE_CONNECTED,   /**< Connected to the AP, with an IP. */
+    WIFI_STATE_RADIO,       /**< Started on the AP's channel, but not
+                                 connected, to send over ESP-NOW. */
+    WIFI_STATE_FAILED,      /**< Started, but gave up connecting. */
+    WIFI_STATE_STOPPING,    /**< Being stopped. */
+    WIFI_STATE_MAX,
+} wifi_state_t;
+
+/** Names for the console, indexed by wifi_state_t. */
+static const char *state_names[WIFI_STATE_MAX] = {
+    "off",
+    "connecting",
+    "connected",
+    "radio",
+    "failed",
+    "stopping",
+};
+
+static volatile wifi_state_t wifi_state = WIFI_STATE_OFF;
+
+/** The WiFi task, so the event handler can notify it. */
+static TaskHandle_t wifi_task_handle = NULL;
+
+/** Notification bits from the event handler to the WiFi task. */
+#define EVENT_GOT_IP  BIT0 /**< Connected to the AP and got an IP. */
+#define EVENT_GAVE_UP BIT1 /**< Ran out of retries connecting to the AP. */
+#define EVENT_DISCONNECTED BIT2 /**< Disconnected, while stopping. */
+
+/** Notification bits from the WiFi task to whoever sent it a command. */
+#define DONE_CONNECTED BIT0 /**< WIFI_CMD_START finished, connected. */
+#define DONE_FAILED    BIT1 /**< WIFI_CMD_START finished, not connected. */
+#define DONE_OFF       BIT2 /**< WIFI_CMD_STOP finished. */
+#define DONE_SENT      BIT3 /**< WIFI_CMD_SEND_TEMP finished, and the
+                                 controller accepted it. */
+#define DONE_NOT_SENT  BIT4 /**< WIFI_CMD_SEND_TEMP finished, but it didn't. */
+
+/**
+ * DONE_* notifications we've had but not yet waited for. This belongs to the
+ * task sending commands, so only one task should wait on WiFi at a time.
+ */
+static uint32_t done_bits = 0;
+
+/** Whether the last send that was waited for was accepted. */
+static bool last_send_ok = false;
+
+/** Whether the CoAP server replied with success to the message in flight. */
+static bool coap_reply_ok = false;
+
+/**
+ * Whether the message in flight is our own report, so the reply is for us.
+ * When we're forwarding for another puck, it isn't.
+ */
+static bool coap_reply_ours = false;
+
+/** Whether we're relaying reports from other pucks. */
+static bool relaying = false;
+
+/**
+ * The CoAP session to the controller, and its context, or NULL if there isn't
+ * one open. On batteries, there is only one open while sending.
+ */
+static coap_context_t *coap_ctx = NULL;
+static coap_session_t *coap_session = NULL;
 
-/** Definition bits for the above status. */
-#define WIFI_OFF           BIT0 /**< WiFi is off. */
-#define WIFI_STOPPING      BIT1 /**< WiFi is in the process of being stopped. */
-#define WIFI_STARTED       BIT2 /**< WiFi has been started. */
-#define WIFI_CONNECTED     BIT3 /**< WiFi has connected to the AP. */
-#define WIFI_FAIL          BIT4 /**< WiFi has failed to connect to the AP. */
-#define COAP_QUEUE_EMPTY   BIT5 /**< Whether there are no COAP messages being sent. */
-#define COAP_SUCCESSFUL    BIT6 /**< Whether the last CoAP message was successful or not. */
+/** The URI the session was opened for, and its parts, which point into it. */
+static char session_uri[MAX_URI_LEN + 1];
+static coap_uri_t coap_uri;
 
 #define WIFI_MAXIMUM_RETRIES 3  /**< Maximum connection retries. */
 
 #define COAP_TIMEOUT_MS 500        /**< Maximum time to wait for a successful
                                         reply from the CoAP server for a single send. */
-#define COAP_SEND_TIMEOUT_S 5      /**< Maximum overall time to wait for COAP
-                                        to be idle (including retries). This is an effective bound on the maximum wake time of the sensor - it will (maximally) be awake for this long plus the time it takes to connect to WiFi (which is always longer than the time it gets the temperature). */
-#define COAP_RETRIES (COAP_SEND_TIMEOUT_S * 1000 / COAP_TIMEOUT_MS)
+#define COAP_SEND_TIMEOUT_S 5      /**< Deadline for sending a report,
+                                        including retries, and looking for
+                                        the controller. No new try starts
+                                        unless it can finish by then. The
+                                        hard bound on the wake as a whole is
+                                        WAKE_BUDGET_MS. */
+
+/**
+ * How much longer than COAP_SEND_TIMEOUT_S the sender waits. That covers what
+ * the deadline can't cut short: a DNS lookup, a DTLS handshake, formatting the
+ * report, and the command waiting in the queue. Without it, the sender could
+ * give up on a report which then gets through.
+ */
+#define COAP_SEND_MARGIN_MS 2000
+
+/** URIs starting with this go over DTLS. */
+#define COAPS_PREFIX "coaps://"
 
 static const char *TAG = "WiFi";
 
 static bool cache_is_valid = false;
 
+/** Length of the config hash line: "\ncfg=" and 8 hex digits. */
+#define CONFIG_HASH_LINE_LEN (5 + 8)
+
+/* Message buffer.
+ *
+ * This is of the format:
+ *
+ * <station name>: <temperature>
+ * cfg=<config hash>
+ * <age> <temperature>
+ * ...
+ *
+ * Station name is MAX_STATION_NAME_LEN.
+ *
+ * There's a colon and a space, which is +2.
+ *
+ * The temperature is MAX_TEMPERATURE_STR_LEN, including the NUL.
+ *
+ * The config hash line is CONFIG_HASH_LINE_LEN.
+ *
+ * The stack use line is STACKS_LINE_LEN.
+ *
+ * Then there are 0 or more lines of undelivered readings, see backlog.h.
+ *
+ * This is static because, with the backlog, it's too big to go on the stack.
+ */
+static char coap_payload[MAX_STATION_NAME_LEN + 2 + MAX_TEMPERATURE_STR_LEN +
+                         CONFIG_HASH_LINE_LEN + STACKS_LINE_LEN +
+                         BACKLOG_MAX_STR_LEN];
+
 /**
  * Counter for the number of wifi retries so far
  */
 static int s_retry_num = 0;
 
+/**
+ * Close the CoAP session, if there is one.
+ */
+static void close_coap_session(void);
+
 static void set_static_ip()
 {
     esp_err_t ret;
@@ -110,7 +236,7 @@ static void set_static_ip()
 static void wifi_event_handler(void *arg, esp_event_base_t event_base,
                                int32_t event_id, void *event_data)
 {
-    EventBits_t status;
+    wifi_state_t state;
     esp_err_t result;
 
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
@@ -120,7 +246,10 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
             ESP_LOGE(TAG, "Failed to set hostname: %s", esp_err_to_name(result));
         }
 
-        ESP_ERROR_CHECK(esp_wifi_connect());
+        // For ESP-NOW, the radio is started without anything to connect to.
+        if (wifi_state == WIFI_STATE_CONNECTING) {
+            ESP_ERROR_CHECK(esp_wifi_connect());
+        }
     }
     else if (event_base == WIFI_EVENT && 
              event_id == WIFI_EVENT_STA_CONNECTED &&
@@ -130,15 +259,12 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
     else if (event_base == WIFI_EVENT &&
              event_id == WIFI_EVENT_STA_DISCONNECTED) {
 
-        // We got disconnected, make sure connected bit is clear.
-        xEventGroupClearBits(wifi_status,
-                             WIFI_CONNECTED);
-
-        // If we are in the process of stopping, or if WiFi is off, DO NOT try
-        // to connect - doing so causes an error.
-        status = xEventGroupGetBits(wifi_status);
-        if (status & (WIFI_OFF | WIFI_STOPPING)) {
-            ESP_LOGE(TAG, "WiFI is shutting down, not reconnecting.");
+        // Only retry if we're still meant to be connecting or connected - in
+        // any other state, trying to connect causes an error.
+        state = wifi_state;
+        if (state != WIFI_STATE_CONNECTING && state != WIFI_STATE_CONNECTED) {
+            ESP_LOGI(TAG, "WiFi is %s, not reconnecting.", state_names[state]);
+            xTaskNotify(wifi_task_handle, EVENT_DISCONNECTED, eSetBits);
         }
         else {
             if (s_retry_num < WIFI_MAXIMUM_RETRIES) {
@@ -148,7 +274,7 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
             }
             else {
                 // Give up on connecting so we don't spin here forever.
-                xEventGroupSetBits(wifi_status, WIFI_FAIL);
+                xTaskNotify(wifi_task_handle, EVENT_GAVE_UP, eSetBits);
             }
             ESP_LOGI(TAG,"connect to the AP fail");
         }
@@ -158,15 +284,15 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
         ESP_LOGI(TAG, "got ip:%s",
                  ip4addr_ntoa(&event->ip_info.ip));
         // We've successfully connected, so reset our connection attempts
-        // counter and set our connected bit.
+        // counter and tell the WiFi task.
         s_retry_num = 0;
-        xEventGroupSetBits(wifi_status, WIFI_CONNECTED);
+        xTaskNotify(wifi_task_handle, EVENT_GOT_IP, eSetBits);
     }
 }
 
 /**
  * Init the wifi as much as we can sans config - we'll have to wait for
- * a WIFI_START message to do that.
+ * a WIFI_CMD_START command to do that.
  *
  * @note This should be called before connect_wifi().
  */
@@ -174,12 +300,6 @@ static void wifi_init(void)
 {
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
 
-    wifi_status = xEventGroupCreate();
-
-    // Some bits are set for off/disabled/empty - set those now, because we
-    // start with wifi stopped and the queue empty.
-    xEventGroupSetBits(wifi_status, WIFI_OFF);
-
     ESP_ERROR_CHECK(esp_netif_init());
 
     ESP_ERROR_CHECK(esp_event_loop_create_default());
@@ -230,28 +350,39 @@ static void wifi_deinit(void)
     ESP_ERROR_CHECK(esp_wifi_deinit());
     ESP_ERROR_CHECK(esp_event_loop_delete_default());
     ESP_ERROR_CHECK(esp_netif_deinit());
-    vEventGroupDelete(s_wifi_event_group);
 }
 #endif
 
 /**
  * Configure and connect to a WiFi AP.
  *
- * @note Make sure current_config is valid before this is called.
+ * @param use_cache [in] Whether to try the cached AP info, if there is any.
+ *
+ * @return true if we connected.
+ * @return false if we didn't. WiFi is left started, in WIFI_STATE_FAILED.
+ *
+ * @note Make sure current_config is valid and WiFi is off before this is
+ *       called.
  */
-static void connect_wifi(void)
+static bool connect_wifi(bool use_cache)
 {
     wifi_config_t wifi_config = {};
     wifi_ap_record_t ap_info = {};
-
-    xEventGroupClearBits(wifi_status, WIFI_OFF);
+    uint32_t events = 0;
 
     strncpy((char *)wifi_config.sta.ssid, current_config.ssid,
             sizeof(wifi_config.sta.ssid));
     strncpy((char *)wifi_config.sta.password, current_config.pass,
             sizeof(wifi_config.sta.password));
 
-    if (current_config.cache_ap_info) {
+    cache_is_valid = false;
+    if (!current_config.cache_ap_info) {
+        ESP_LOGI(TAG, "AP info cache is disabled.");
+    }
+    else if (!use_cache) {
+        ESP_LOGI(TAG, "Not using the AP info cache.");
+    }
+    else {
         ESP_LOGI(TAG, "AP info cache is enabled, reading back.");
         cache_is_valid = read_ap_cache_from_nvs();
         if (cache_is_valid) {
@@ -266,9 +397,6 @@ static void connect_wifi(void)
             ESP_LOGI(TAG, "AP info cache is invalid.");
         }
     }
-    else {
-        ESP_LOGI(TAG, "AP info cache is disabled.");
-    }
 
     /* NOTE: In the example code, they ratchet up the minimum security to
      * refuse to connect to WiFi networks with poor security. I have removed
@@ -278,22 +406,35 @@ static void connect_wifi(void)
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
 
+    // On mains power we stay connected, so let the radio sleep between
+    // beacons rather than listen the whole time. A relay has to listen the
+    // whole time, though, because the pucks sending to it don't wait for
+    // beacons.
+    if (current_config.mains_powered) {
+        ESP_ERROR_CHECK(esp_wifi_set_ps(current_config.espnow_relay ?
+                                        WIFI_PS_NONE : WIFI_PS_MIN_MODEM));
+    }
+
+    // Throw away anything the event handler told us about the last connection.
+    xTaskNotifyWait(0, UINT32_MAX, NULL, 0);
+    s_retry_num = 0;
+
+    wifi_state = WIFI_STATE_CONNECTING;
     ESP_ERROR_CHECK(esp_wifi_start());
-    xEventGroupSetBits(wifi_status, WIFI_STARTED);
 
     ESP_LOGI(TAG, "WiFi config finished.");
 
-    /* Waiting until either the connection is established (WIFI_CONNECTED)
-     * or connection failed for the maximum number of re-tries (WIFI_FAIL).
-     * The bits are set by wifi_event_handler() (see above). */
-    EventBits_t status = xEventGroupWaitBits(
-                             wifi_status,
-                             WIFI_CONNECTED | WIFI_FAIL,
-                             pdFALSE,
-                             pdFALSE,
-                             portMAX_DELAY);
-
-    if (status & WIFI_CONNECTED) {
+    /* Wait until either the connection is established (EVENT_GOT_IP) or the
+     * event handler gave up retrying (EVENT_GAVE_UP).
+     *
+     * This is bounded, because if the AP never answers at all, neither gets
+     * sent, and we'd never get to process the next command. */
+    xTaskNotifyWait(0, UINT32_MAX, &events,
+                    wake_budget_remaining_ms(WIFI_CONNECT_WAIT_TIMEOUT_S *
+                                             1000) / portTICK_PERIOD_MS);
+
+    if (events & EVENT_GOT_IP) {
+        wifi_state = WIFI_STATE_CONNECTED;
         ESP_LOGI(TAG, "connected to SSID: %s", wifi_config.sta.ssid);
         // We are now connected to WiFi.
         // If we're supposed to cache info and the cache isn't currently valid,
@@ -311,60 +452,176 @@ static void connect_wifi(void)
                 ESP_LOGE(TAG, "Failed to save AP info to cache.");
             }
         }
-}
-    else if (status & WIFI_FAIL) {
-        ESP_LOGI(TAG, "Failed to connect to SSID: %s", wifi_config.sta.ssid);
-        // We don't need to clear the connected bit, because it's cleared when
-        // we get the disconnected event in the event handler.
-
-        // But we do clear this bit because we've handled it.
-        xEventGroupClearBits(wifi_status, WIFI_FAIL);
-
-        if (current_config.cache_ap_info && cache_is_valid) {
-            // If the we failed to connect, then assume our cache is now invalid
-            // because we tried to connect to an AP that didn't exist, so any
-            // information is obsolete.
-            cache_is_valid = false;
-
-            // and, if we were relying on the cached data, then post a message
-            // to the queue to try again - which will just kick is back into
-            // this function with an invalid cache, but is cleaner than adding a
-            // loop.
-            wifi_restart();
+
+        // On mains power we stay connected, so the controller can observe
+        // us rather than wait for reports.
+        if (current_config.mains_powered) {
+            coap_server_start();
+
+            if (current_config.espnow_relay) {
+                relaying = espnow_listen();
+            }
         }
-        // otherwise, we either weren't caching data or the cache wasn't valid,
-        // and should just stop trying.
+        return true;
+    }
+
+    wifi_state = WIFI_STATE_FAILED;
+    if (events & EVENT_GAVE_UP) {
+        ESP_LOGI(TAG, "Failed to connect to SSID: %s", wifi_config.sta.ssid);
     }
     else {
-        ESP_LOGE(TAG, "UNEXPECTED EVENT");
+        ESP_LOGE(TAG, "Timeout connecting to SSID: %s", wifi_config.sta.ssid);
     }
+
+    return false;
 }
 
 /**
  * Disconnect the connected WiFi.
+ *
+ * This is safe to call in any state - if WiFi is already off, it does nothing.
  */
 static void disconnect_wifi(void)
 {
-    EventBits_t status = xEventGroupGetBits(wifi_status);
-    
-    // signal that we are in the process of stopping WiFi and shouldn't try to 
-    // reconnect, etc.
-    xEventGroupSetBits(wifi_status, WIFI_STOPPING);
+    wifi_state_t state = wifi_state;
+    esp_err_t result;
 
-    if (status & WIFI_CONNECTED) {
-        ESP_ERROR_CHECK(esp_wifi_disconnect());
+    if (state == WIFI_STATE_OFF) {
+        ESP_LOGI(TAG, "WiFi is already off.");
+        return;
     }
-    if (status & WIFI_STARTED) {
-        ESP_ERROR_CHECK(esp_wifi_stop());
-        // We don't deinit the WiFi, because it's not necessary - the config is
-        // set in connect_wifi, right before esp_wifi_start.
-        xEventGroupClearBits(wifi_status, WIFI_STARTED);
+
+    // The session, server and relay kept open on mains power won't survive
+    // WiFi going down. Anything left to relay stays queued until it's back.
+    close_coap_session();
+    coap_raw_close();
+    dtls_close();
+    coap_server_stop();
+    espnow_stop();
+    relaying = false;
+
+    // Signal that we are in the process of stopping WiFi, so the event
+    // handler doesn't try to reconnect when we disconnect.
+    wifi_state = WIFI_STATE_STOPPING;
+
+    if (state == WIFI_STATE_CONNECTED) {
+        // The AP may already have dropped us, which is no reason not to
+        // carry on stopping.
+        result = esp_wifi_disconnect();
+        if (result != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to disconnect: %s", esp_err_to_name(result));
+        }
     }
 
-    // WiFi is now off.
-    xEventGroupSetBits(wifi_status, WIFI_OFF);
-    // Since it is off, we are no longer stopping.
-    xEventGroupClearBits(wifi_status, WIFI_STOPPING);
+    // We don't deinit the WiFi, because it's not necessary - the config is
+    // set in connect_wifi, right before esp_wifi_start.
+    ESP_ERROR_CHECK(esp_wifi_stop());
+
+    wifi_state = WIFI_STATE_OFF;
+}
+
+/**
+ * Leave the AP, without stopping WiFi, for when we're about to deep sleep.
+ *
+ * The AP gets a deauth so it can drop us from its client table straight away,
+ * rather than holding on to us until it times us out. Everything else
+ * disconnect_wifi() does is left for deep sleep to take care of.
+ *
+ * WiFi is left in WIFI_STATE_STOPPING, so if we don't sleep after all,
+ * disconnect_wifi() will finish the job.
+ */
+static void abandon_wifi(void)
+{
+    wifi_state_t state = wifi_state;
+    esp_err_t result;
+
+    if (state == WIFI_STATE_OFF) {
+        ESP_LOGI(TAG, "WiFi is already off.");
+        return;
+    }
+
+    wifi_state = WIFI_STATE_STOPPING;
+
+    if (state == WIFI_STATE_CONNECTED) {
+        xTaskNotifyWait(0, UINT32_MAX, NULL, 0);
+
+        result = esp_wifi_disconnect();
+        if (result != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to disconnect: %s", esp_err_to_name(result));
+        }
+        else {
+            // The event handler tells us once the deauth is out, so we don't
+            // sleep with it still in the driver.
+            xTaskNotifyWait(0, UINT32_MAX, NULL,
+                            WIFI_DEAUTH_WAIT_MS / portTICK_PERIOD_MS);
+        }
+    }
+}
+
+/**
+ * Bring WiFi up with the current config, falling back from the AP info cache
+ * to a full scan if the cache doesn't work.
+ *
+ * @return true if we connected.
+ * @return false if we didn't.
+ */
+static bool bring_up_wifi(void)
+{
+    // TODO: Add some blinkenlights feedback here?
+    if (!is_config_valid(&current_config)) {
+        ESP_LOGE(TAG, "invalid config, not connecting to wifi");
+        return false;
+    }
+
+    ESP_LOGI(TAG, "wifi config looks valid, connecting");
+    if (connect_wifi(true)) {
+        return true;
+    }
+
+    if (current_config.cache_ap_info && cache_is_valid) {
+        // If we failed to connect using the cache, then assume it's
+        // obsolete (the AP moved channel, or was replaced) and try once more
+        // without it. This only happens once, because the retry doesn't use
+        // the cache.
+        ESP_LOGW(TAG, "Cached AP info didn't work, trying without it.");
+        cache_is_valid = false;
+        disconnect_wifi();
+        return connect_wifi(false);
+    }
+
+    // Otherwise, we either weren't caching data or the cache wasn't valid,
+    // and should just stop trying.
+    return false;
+}
+
+/**
+ * Start the radio on the AP's channel, without connecting to the AP, to send
+ * to the relay over ESP-NOW.
+ *
+ * @return true if we're ready to send.
+ * @return false if we aren't. The radio is left started, in
+ *         WIFI_STATE_FAILED.
+ *
+ * @note The AP info cache must have been read.
+ */
+static bool bring_up_radio(void)
+{
+    wifi_config_t wifi_config = {};
+
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
+
+    wifi_state = WIFI_STATE_RADIO;
+    ESP_ERROR_CHECK(esp_wifi_start());
+    ESP_ERROR_CHECK(esp_wifi_set_channel(ap_cache.channel,
+                                         WIFI_SECOND_CHAN_NONE));
+
+    if (!espnow_start(current_config.relay_mac, ap_cache.channel)) {
+        wifi_state = WIFI_STATE_FAILED;
+        return false;
+    }
+
+    return true;
 }
 
 /**
@@ -384,30 +641,36 @@ static void coap_message_handler(coap_context_t *ctx, coap_session_t *session,
     // This doesn't actually get the code bits, it just returns the full code.
     // int code = COAP_RESPONSE_CODE(received->code);
     int code = received->code & 0x1F;
+    size_t length;
+    uint8_t *data;
 
     // success is 2.05 which (PUT).(CONTENT). Anything else is an error.
     if (class == 2 && code == 5) {
-        xEventGroupSetBits(wifi_status, COAP_SUCCESSFUL);
+        // The controller may have something to tell us.
+        if (coap_reply_ours && coap_get_data(received, &length, &data)) {
+            reply_parse(data, length);
+        }
+
+        coap_reply_ok = true;
     }
     else {
         ESP_LOGE(TAG, "Received code %d.%02d back from the CoAP server.", class, code);
     }
-
-    xEventGroupSetBits(wifi_status, COAP_QUEUE_EMPTY);
 }
 
 /**
- * Parse the coap server URI in the config into a given coap_uri_t struct,
- * applying some validity checks along the way.
+ * Parse a coap server URI into a given coap_uri_t struct, applying some
+ * validity checks along the way.
  *
+ * @param uri_str URI to parse. uri points into this, so it must outlive uri.
  * @param uri URI structure into which all the URI details should be placed.
  * 
  * @return true if the parsing was successful and the URI should work.
  * @return false if the parsing was unsuccessful or the URI won't work.
 */
-static bool parse_coap_server(coap_uri_t *uri)
+static bool parse_coap_server(const char *uri_str, coap_uri_t *uri)
 {
-    if (coap_split_uri((const uint8_t *)current_config.uri, strlen(current_config.uri), uri) != 0) {
+    if (coap_split_uri((const uint8_t *)uri_str, strlen(uri_str), uri) != 0) {
         ESP_LOGE(TAG, "CoAP server uri error");
         return false;
     }
@@ -421,222 +684,891 @@ static bool parse_coap_server(coap_uri_t *uri)
     return true;
 }
 
+static void close_coap_session(void)
+{
+    if (coap_session != NULL) {
+        coap_session_release(coap_session);
+        coap_session = NULL;
+    }
+
+    if (coap_ctx != NULL) {
+        coap_free_context(coap_ctx);
+        coap_ctx = NULL;
+        coap_cleanup();
+    }
+}
+
 /**
- * Send the temperature via CoAP.
+ * Open a CoAP session to a server.
+ *
+ * @param uri [in] The URI to send to.
  *
- * @return true if the packet was successfully sent
- * @return false if the packet was not successfully sent
+ * @return true if the session is open.
+ * @return false if it couldn't be opened.
  */
-static bool coap_send_temperature(void)
+static bool open_coap_session(const char *uri)
 {
-    /* Temporary data buffer.
-     *
-     * This is of the format:
-     *
-     * <station name>: <temperature>
-     *
-     * Station name is MAX_STATION_NAME_LEN.
-     * 
-     * There's a colon and a space, which is +2.
-     *
-     * The temperature range is -55 to 125C (-67 to 257F), which is 3
-     * characters. We also have a decimal point and another place, for a total
-     * of 5 characters, and then a NUL, for 6, total. */
-    char buffer[MAX_STATION_NAME_LEN + 2 + 6];
-
-    coap_uri_t uri;
     char hostname[MAX_URI_LEN + 1];
     struct addrinfo *ainfo;
     coap_address_t dst_addr;
-    coap_context_t *ctx = NULL;
-    coap_session_t *session = NULL;
+    int result;
+
+    // Take our own copy, because coap_uri points into it and the config can
+    // change while the session is open.
+    strncpy(session_uri, uri, sizeof(session_uri));
+    if (!parse_coap_server(session_uri, &coap_uri)) {
+        return false;
+    }
+
+    // This copy is necessary because the uri.host.s element is just a
+    // pointer into to the URI array - not a NUL terminated string. We
+    // don't want to change it, but getaddrinfo needs a NUL terminated
+    // hostname / IP. So, copy it out and NUL terminate it so
+    // getaddrinfo is content.
+    memcpy(hostname, coap_uri.host.s, coap_uri.host.length);
+    hostname[coap_uri.host.length] = '\0';
+
+    result = getaddrinfo(hostname, NULL, NULL, &ainfo);
+    if (result != 0) {
+        ESP_LOGE(TAG, "getaddrinfo failed: %d", result);
+        return false;
+    }
+
+    coap_address_init(&dst_addr);
+    dst_addr.size = ainfo->ai_addrlen;
+    memcpy(&dst_addr.addr, ainfo->ai_addr, ainfo->ai_addrlen);
+    if (ainfo->ai_family == AF_INET6) {
+        dst_addr.addr.sin6.sin6_family = AF_INET6;
+        dst_addr.addr.sin6.sin6_port   = htons(coap_uri.port);
+    } else {
+        dst_addr.addr.sin.sin_family   = AF_INET;
+        dst_addr.addr.sin.sin_port     = htons(coap_uri.port);
+    }
+    freeaddrinfo(ainfo);
+
+    coap_ctx = coap_new_context(NULL);
+    if (!coap_ctx) {
+        ESP_LOGE(TAG, "coap_new_context() failed");
+        return false;
+    }
+
+    coap_session = coap_new_client_session(coap_ctx, NULL, &dst_addr,
+        coap_uri.scheme==COAP_URI_SCHEME_COAP_TCP ? COAP_PROTO_TCP :
+        coap_uri.scheme==COAP_URI_SCHEME_COAPS_TCP ? COAP_PROTO_TLS :
+        coap_uri.scheme==COAP_URI_SCHEME_COAPS ? COAP_PROTO_DTLS : COAP_PROTO_UDP);
+    if (!coap_session) {
+        ESP_LOGE(TAG, "coap_new_client_session() failed");
+        close_coap_session();
+        return false;
+    }
+
+    coap_register_response_handler(coap_ctx, coap_message_handler);
+
+    return true;
+}
+
+/**
+ * Format our report.
+ *
+ * @param buffer [out] Buffer to receive it. Always NUL terminated.
+ * @param size   [in]  Size of buffer.
+ *
+ * @return the length of the report.
+ */
+static size_t format_report(char *buffer, size_t size)
+{
+    char temperature[MAX_TEMPERATURE_STR_LEN];
+    int backlog_readings;
+    size_t used;
+
+    // format our temperature
+    memset(buffer, 0, size);
+    format_temperature(temperature, sizeof(temperature), get_last_temp(),
+                       current_config.use_celsius);
+    snprintf(buffer, size, "%s: %s", current_config.station_name, temperature);
+
+    // which version of the controller's config we have, so it knows
+    // whether to send it,
+    used = strlen(buffer);
+    snprintf(buffer + used, size - used, "\ncfg=%08x",
+             current_config.config_hash);
+
+    // how deep our stacks have gone, so they can be sized from real use,
+    used = strlen(buffer);
+    stacks_format(buffer + used, size - used);
+
+    // and anything we couldn't send before.
+    used = strlen(buffer);
+    backlog_readings = backlog_format(buffer + used, size - used,
+                                      current_config.use_celsius);
+    if (backlog_readings > 0) {
+        ESP_LOGW(TAG, "Sending %d undelivered readings.", backlog_readings);
+    }
+
+    return strlen(buffer);
+}
+
+/**
+ * Build the authentication option for a report, if it's ours and there's a
+ * key to sign it with.
+ *
+ * Reports we relay for other pucks go with the option their sender put in
+ * the frame, if any, since the relay doesn't have their keys.
+ *
+ * @param payload [in]  The report.
+ * @param length  [in]  Its length.
+ * @param ours    [in]  Whether it's our own report.
+ * @param auth    [in]  The option a relayed report came with, or NULL.
+ * @param option  [out] Where to build the option, AUTH_OPTION_LEN long.
+ *
+ * @return the option, if there is one.
+ * @return NULL if the report goes without it.
+ */
+static const uint8_t *sign_report(const char *payload, size_t length,
+                                  bool ours, const uint8_t *auth,
+                                  uint8_t *option)
+{
+    if (!ours) {
+        return auth;
+    }
+
+    if (!auth_sign(payload, length, option)) {
+        return NULL;
+    }
+
+    return option;
+}
+
+/**
+ * PUT a report to the controller via libcoap.
+ *
+ * On mains power, the session is kept open afterwards for the next send.
+ *
+ * @param uri     [in] The URI to send to.
+ * @param payload [in] The report.
+ * @param length  [in] Its length.
+ * @param ours    [in] Whether it's our own report, rather than one we're
+ *                     forwarding, so the reply is for us.
+ * @param auth    [in] The option a forwarded report came with, or NULL.
+ * @param deadline_us [in] esp_timer_get_time() to finish trying by.
+ *
+ * @return true if the controller accepted it.
+ * @return false if it didn't.
+ */
+static bool libcoap_put(const char *uri, const char *payload, size_t length,
+                        bool ours, const uint8_t *auth, int64_t deadline_us)
+{
     coap_pdu_t *request = NULL;
+    uint8_t option[AUTH_OPTION_LEN];
+    const uint8_t *signature;
     bool success = false;
+    bool reopened = false;
     int result;
-    EventBits_t bits;
     int send_attempts = 0;
 
-    if (!parse_coap_server(&uri)) {
-        ESP_LOGE(TAG, "parse_coap_server failed");
+    // If the URI changed since the session was opened, it's going to the
+    // wrong place.
+    if (coap_session != NULL && strcmp(session_uri, uri) != 0) {
+        close_coap_session();
     }
-    else {
-        // format our temperature
-        memset(buffer, 0, sizeof(buffer));
-        snprintf(buffer, sizeof(buffer), "%s: %.1f", current_config.station_name, get_last_temp());
-        
-        // This copy is necessary because the uri.host.s element is just a
-        // pointer into to the URI array - not a NUL terminated string. We
-        // don't want to change it, but getaddrinfo needs a NUL terminated
-        // hostname / IP. So, copy it out and NUL terminate it so
-        // getaddrinfo is content.
-        memcpy(hostname, uri.host.s, uri.host.length);
-        hostname[uri.host.length] = '\0';
-
-        result = getaddrinfo(hostname, NULL, NULL, &ainfo);
-        if (result != 0) {
-            ESP_LOGE(TAG, "getaddrinfo failed: %d", result);
+
+    while (!success &&
+           esp_timer_get_time() + COAP_TIMEOUT_MS * 1000 <= deadline_us) {
+        ++send_attempts;
+
+        // Opening it means a DNS lookup, and with coaps://, a handshake, so
+        // if that fails, trying again straight away won't do any better.
+        if (coap_session == NULL && !open_coap_session(uri)) {
+            break;
+        }
+
+        request = coap_new_pdu(coap_session);
+        if (!request) {
+            ESP_LOGE(TAG, "coap_new_pdu() failed");
         }
         else {
-            while (send_attempts < COAP_RETRIES && !success) {
-                ++send_attempts;
-
-                ctx = coap_new_context(NULL);
-                if (!ctx) {
-                    ESP_LOGE(TAG, "coap_new_context() failed");
-                } else {
-                    coap_address_init(&dst_addr);
-                    dst_addr.size = ainfo->ai_addrlen;
-                    memcpy(&dst_addr.addr, ainfo->ai_addr, ainfo->ai_addrlen);
-                    if (ainfo->ai_family == AF_INET6) {
-                        dst_addr.addr.sin6.sin6_family = AF_INET6;
-                        dst_addr.addr.sin6.sin6_port   = htons(uri.port);
-                    } else {
-                        dst_addr.addr.sin.sin_family   = AF_INET;
-                        dst_addr.addr.sin.sin_port     = htons(uri.port);
-                    }
-
-                    session = coap_new_client_session(ctx, NULL, &dst_addr,
-                        uri.scheme==COAP_URI_SCHEME_COAP_TCP ? COAP_PROTO_TCP :
-                        uri.scheme==COAP_URI_SCHEME_COAPS_TCP ? COAP_PROTO_TLS :
-                        uri.scheme==COAP_URI_SCHEME_COAPS ? COAP_PROTO_DTLS : COAP_PROTO_UDP);
-                    if (!session) {
-                        ESP_LOGE(TAG, "coap_new_client_session() failed");
-                    }
-                    else {
-                        coap_register_response_handler(ctx, coap_message_handler);
-
-                        request = coap_new_pdu(session);
-                        if (!request) {
-                            ESP_LOGE(TAG, "coap_new_pdu() failed");
-                        }
-                        else {
-                            request->type = COAP_MESSAGE_CON;
-                            request->tid = coap_new_message_id(session);
-                            request->code = COAP_REQUEST_PUT;
-
-                            coap_add_option(request, COAP_OPTION_URI_PATH,
-                                            uri.path.length, uri.path.s);
-                            
-                            coap_add_data(request, strlen(buffer), (uint8_t *)buffer);
-
-                            xEventGroupClearBits(wifi_status, COAP_SUCCESSFUL|COAP_QUEUE_EMPTY);
-
-                            // coap_send deletes the request when finished
-                            coap_send(session, request);
-
-                            // this runs the coap network I/O; return value is how
-                            // long it took, or -1 if error.
-                            result = coap_run_once(ctx, COAP_TIMEOUT_MS);
-                            if (result < 0) {
-                                ESP_LOGE(TAG, "coap_run_once returned %d", result);
-                            }
-                            else {
-                                ESP_LOGW(TAG, "sending the COAP message took %d ms", result);
-                            }
-
-                            bits = xEventGroupWaitBits(
-                                    wifi_status,
-                                    COAP_SUCCESSFUL,
-                                    pdFALSE,
-                                    pdFALSE,
-                                    COAP_TIMEOUT_MS / portTICK_PERIOD_MS);
-                            // success is only true if we got a successful return
-                            // code
-                            if (bits & COAP_SUCCESSFUL) {
-                                success = true;
-                            }
-                        }
-
-                        coap_session_release(session);
-                    }
-                    coap_free_context(ctx);            
+            request->type = COAP_MESSAGE_CON;
+            request->tid = coap_new_message_id(coap_session);
+            request->code = COAP_REQUEST_PUT;
+
+            coap_add_option(request, COAP_OPTION_URI_PATH,
+                            coap_uri.path.length, coap_uri.path.s);
+
+            // Each try is a new message, so it gets a new sequence number,
+            // unless it's forwarded, when we only have the one it came with.
+            signature = sign_report(payload, length, ours, auth, option);
+            if (signature != NULL) {
+                coap_add_option(request, COAP_OPTION_AUTH, AUTH_OPTION_LEN,
+                                signature);
+            }
+
+            coap_add_data(request, length, (const uint8_t *)payload);
+
+            coap_reply_ok = false;
+            coap_reply_ours = ours;
+
+            // coap_send deletes the request when finished
+            coap_send(coap_session, request);
+
+            // this runs the coap network I/O, including calling
+            // our handler with any reply; return value is how
+            // long it took, or -1 if error.
+            result = coap_run_once(coap_ctx, COAP_TIMEOUT_MS);
+            if (result < 0) {
+                ESP_LOGE(TAG, "coap_run_once returned %d", result);
+            }
+            else {
+                ESP_LOGW(TAG, "sending the COAP message took %d ms", result);
+            }
+
+            // success is only true if we got a successful return
+            // code
+            success = coap_reply_ok;
+
+            // Only an error from the session itself means it's broken. A
+            // missing or unhappy reply goes again over the same one. Start
+            // again from scratch once, but if that's broken too, give up.
+            if (!success && result < 0) {
+                close_coap_session();
+                if (reopened) {
+                    break;
                 }
+                reopened = true;
             }
         }
+    }
 
-        coap_cleanup();
-        freeaddrinfo(ainfo);
+    if (!current_config.mains_powered) {
+        close_coap_session();
     }
-    
+
     return success;
 }
 
+/**
+ * How many tries of COAP_TIMEOUT_MS fit before a deadline.
+ *
+ * @param deadline_us [in] esp_timer_get_time() to finish trying by.
+ *
+ * @return The number of tries, which may be none.
+ */
+static int tries_before(int64_t deadline_us)
+{
+    int64_t remaining_us = deadline_us - esp_timer_get_time();
+
+    if (remaining_us <= 0) {
+        return 0;
+    }
+
+    return remaining_us / (COAP_TIMEOUT_MS * 1000);
+}
+
+/**
+ * PUT a report to the controller via the minimal CoAP sender.
+ *
+ * @param payload [in] The report.
+ * @param length  [in] Its length.
+ * @param ours    [in] Whether it's our own report, so the reply is for us.
+ * @param auth    [in] The option a forwarded report came with, or NULL.
+ * @param deadline_us [in] esp_timer_get_time() to finish trying by.
+ *
+ * @return true if the controller accepted it.
+ * @return false if it didn't.
+ */
+static bool raw_put(const char *payload, size_t length, bool ours,
+                    const uint8_t *auth, int64_t deadline_us)
+{
+    uint8_t option[AUTH_OPTION_LEN];
+    const uint8_t *reply;
+    size_t reply_length;
+    int tries = tries_before(deadline_us);
+
+    if (tries == 0) {
+        return false;
+    }
+
+    // Resends are the same message, so they share a sequence number.
+    if (!coap_raw_put(payload, length,
+                      sign_report(payload, length, ours, auth, option),
+                      COAP_TIMEOUT_MS, tries, &reply, &reply_length)) {
+        return false;
+    }
+
+    // The controller may have something to tell us.
+    if (ours && reply_length > 0) {
+        reply_parse(reply, reply_length);
+    }
+
+    return true;
+}
+
+/**
+ * PUT a report to the controller via CoAP over DTLS.
+ *
+ * @param payload [in] The report.
+ * @param length  [in] Its length.
+ * @param ours    [in] Whether it's our own report, so the reply is for us.
+ * @param auth    [in] The option a forwarded report came with, or NULL.
+ * @param deadline_us [in] esp_timer_get_time() to finish trying by.
+ *
+ * @return true if the controller accepted it.
+ * @return false if it didn't.
+ */
+static bool secure_put(const char *payload, size_t length, bool ours,
+                       const uint8_t *auth, int64_t deadline_us)
+{
+    uint8_t option[AUTH_OPTION_LEN];
+    const uint8_t *reply;
+    size_t reply_length;
+    int tries = tries_before(deadline_us);
+
+    if (tries == 0) {
+        return false;
+    }
+
+    if (!is_psk_set(&current_config)) {
+        ESP_LOGE(TAG, "coaps:// needs a PSK; set one with \"config set psk\".");
+        return false;
+    }
+
+    if (!dtls_put(payload, length,
+                  sign_report(payload, length, ours, auth, option),
+                  COAP_TIMEOUT_MS, tries, &reply, &reply_length)) {
+        return false;
+    }
+
+    if (ours && reply_length > 0) {
+        reply_parse(reply, reply_length);
+    }
+
+    return true;
+}
+
+/**
+ * PUT a report to a URI via CoAP. coaps:// goes over DTLS, which always uses
+ * the minimal sender's template. Otherwise, it's the minimal sender if it's
+ * enabled and the URI allows, or libcoap.
+ *
+ * Each is timed, and the last time one got through is kept in RTC memory, so
+ * they can be compared.
+ *
+ * @param uri     [in] The URI to send to.
+ * @param payload [in] The report.
+ * @param length  [in] Its length.
+ * @param ours    [in] Whether it's our own report, rather than one we're
+ *                     forwarding, so the reply is for us.
+ * @param auth    [in] The option a forwarded report came with, or NULL.
+ * @param deadline_us [in] esp_timer_get_time() to finish trying by.
+ *
+ * @return true if the controller accepted it.
+ * @return false if it didn't.
+ */
+static bool put_to(const char *uri, const char *payload, size_t length,
+                   bool ours, const uint8_t *auth, int64_t deadline_us)
+{
+    int64_t start = esp_timer_get_time();
+    uint32_t elapsed_us;
+    bool success;
+
+    if (strncmp(uri, COAPS_PREFIX, strlen(COAPS_PREFIX)) == 0) {
+        if (!coap_raw_prepare(uri)) {
+            ESP_LOGE(TAG, "coaps:// URIs need an IP address for the host.");
+            return false;
+        }
+        success = secure_put(payload, length, ours, auth, deadline_us);
+        ESP_LOGI(TAG, "DTLS send took %uus.",
+                 (uint32_t)(esp_timer_get_time() - start));
+    }
+    else if (current_config.raw_coap && coap_raw_prepare(uri)) {
+        success = raw_put(payload, length, ours, auth, deadline_us);
+        elapsed_us = esp_timer_get_time() - start;
+        if (success) {
+            rtc_storage.raw_send_us = elapsed_us;
+        }
+        ESP_LOGI(TAG, "Raw CoAP send took %uus.", elapsed_us);
+    }
+    else {
+        success = libcoap_put(uri, payload, length, ours, auth,
+                              deadline_us);
+        elapsed_us = esp_timer_get_time() - start;
+        if (success) {
+            rtc_storage.libcoap_send_us = elapsed_us;
+        }
+        ESP_LOGI(TAG, "libcoap send took %uus.", elapsed_us);
+    }
+
+    return success;
+}
+
+/**
+ * PUT a report to the controller via CoAP.
+ *
+ * If it doesn't get through, the controller may have moved, so look for it,
+ * and if it's somewhere new, try again there.
+ *
+ * @param payload [in] The report.
+ * @param length  [in] Its length.
+ * @param ours    [in] Whether it's our own report, rather than one we're
+ *                     forwarding, so the reply is for us.
+ * @param auth    [in] The option a forwarded report came with, or NULL.
+ *
+ * @return true if the controller accepted it.
+ * @return false if it didn't.
+ */
+static bool coap_put(const char *payload, size_t length, bool ours,
+                     const uint8_t *auth)
+{
+    uint32_t send_ms = wake_budget_remaining_ms(COAP_SEND_TIMEOUT_S * 1000 +
+                                                COAP_SEND_MARGIN_MS);
+    // The sender waits the margin on top, so keep that out of the deadline
+    // even when the wake budget is running short.
+    int64_t deadline_us = esp_timer_get_time() +
+                          (send_ms > COAP_SEND_MARGIN_MS ?
+                           (send_ms - COAP_SEND_MARGIN_MS) * 1000LL : 0);
+    // Enough to look for it again, and try once where it's moved to.
+    int64_t rediscover_us = (DISCOVERY_TIMEOUT_MS + COAP_TIMEOUT_MS) * 1000LL;
+
+    // Looking for it is quicker than a DNS lookup on every wake.
+    if (discovery_wanted(current_config.uri)) {
+        discover_controller(current_config.uri);
+    }
+
+    if (put_to(discovery_uri(current_config.uri), payload, length, ours,
+               auth, deadline_us - rediscover_us)) {
+        return true;
+    }
+
+    if (esp_timer_get_time() + rediscover_us > deadline_us ||
+        !discover_controller(current_config.uri)) {
+        return false;
+    }
+
+    return put_to(discovery_uri(current_config.uri), payload, length, ours,
+                  auth, deadline_us);
+}
+
+/**
+ * Forward reports from other pucks, received over ESP-NOW, to the
+ * controller.
+ *
+ * Everything queued goes in one batch, a PUT each, back to back over the one
+ * session. The controller's replies are meant for the pucks, which aren't
+ * listening, so they're dropped.
+ */
+static void relay_forward(void)
+{
+    relay_frame_t frame;
+
+    if (wifi_state != WIFI_STATE_CONNECTED) {
+        return;
+    }
+
+    while (xQueuePeek(relay_queue, &frame, 0) == pdTRUE) {
+        if (!coap_put(frame.data, frame.length, false,
+                      frame.has_auth ? frame.auth : NULL)) {
+            // If the controller isn't answering, the rest won't get through
+            // either, so leave them for next time.
+            ESP_LOGE(TAG, "Failed to forward a report from "
+                          "%02x:%02x:%02x:%02x:%02x:%02x.",
+                     frame.mac[0], frame.mac[1], frame.mac[2], frame.mac[3],
+                     frame.mac[4], frame.mac[5]);
+            return;
+        }
+
+        xQueueReceive(relay_queue, &frame, 0);
+    }
+}
+
+/**
+ * Send a report via CoAP, straight to the controller.
+ *
+ * @param payload [in] The report.
+ * @param length  [in] Its length.
+ *
+ * @return true if the controller accepted it.
+ * @return false if it didn't.
+ */
+static bool coap_send_report(const char *payload, size_t length)
+{
+    return coap_put(payload, length, true, NULL);
+}
+
+#if LOOPBACK_ESPNOW
+/**
+ * Send a report as if over ESP-NOW, but to our own relay queue, then forward
+ * it like a relay would.
+ *
+ * @param payload [in] The report.
+ * @param length  [in] Its length.
+ *
+ * @return true if it was queued, which stands in for the relay's ack.
+ * @return false if it wasn't.
+ */
+static bool loopback_send_report(const char *payload, size_t length)
+{
+    uint8_t option[AUTH_OPTION_LEN];
+
+    if (!espnow_loopback(payload, length,
+                         sign_report(payload, length, true, NULL, option))) {
+        return false;
+    }
+
+    relay_forward();
+    return true;
+}
+#else
+/**
+ * Send a report to the relay over ESP-NOW, signed if we have a key, for the
+ * relay to forward.
+ *
+ * @param payload [in] The report.
+ * @param length  [in] Its length.
+ *
+ * @return true if the relay acked it.
+ * @return false if it didn't.
+ */
+static bool espnow_send_report(const char *payload, size_t length)
+{
+    uint8_t option[AUTH_OPTION_LEN];
+
+    return espnow_send(payload, length,
+                       sign_report(payload, length, true, NULL, option));
+}
+#endif // LOOPBACK_ESPNOW
+
+/**
+ * A way of getting our report to the controller.
+ */
+typedef struct {
+    const char *name;           /**< Name, for the log. */
+    size_t max_length;          /**< Biggest report it can send, including
+                                     the NUL. */
+    bool (*start)(void);        /**< Get ready to send. */
+    bool (*send)(const char *payload, size_t length); /**< Send a report. */
+} transport_t;
+
+/** Straight to the controller. */
+static const transport_t coap_transport = {
+    .name = "CoAP",
+    .max_length = sizeof(coap_payload),
+    .start = bring_up_wifi,
+    .send = coap_send_report,
+};
+
+#if LOOPBACK_ESPNOW
+/** Through ourselves, as a relay; see LOOPBACK_ESPNOW. */
+static const transport_t loopback_transport = {
+    .name = "ESP-NOW loopback",
+    .max_length = ESPNOW_MAX_REPORT_LEN + 1,
+    .start = bring_up_wifi,
+    .send = loopback_send_report,
+};
+#else
+/** Through a relay puck. */
+static const transport_t espnow_transport = {
+    .name = "ESP-NOW",
+    .max_length = ESPNOW_MAX_REPORT_LEN + 1,
+    .start = bring_up_radio,
+    .send = espnow_send_report,
+};
+#endif // LOOPBACK_ESPNOW
+
+/** The transport picked when WiFi was last started. */
+static const transport_t *transport = &coap_transport;
+
+/**
+ * Pick how to send our report.
+ *
+ * We only go through a relay when we can get there in one frame. Otherwise,
+ * or if the last try didn't get through, we talk to the controller directly.
+ *
+ * @return the transport.
+ */
+static const transport_t *pick_transport(void)
+{
+    // A mains powered puck might as well stay connected.
+    if (current_config.mains_powered || !is_relay_set(&current_config)) {
+        return &coap_transport;
+    }
+
+    // The relay is on the AP's channel, which we only know from the cache.
+    if (!current_config.cache_ap_info || !read_ap_cache_from_nvs()) {
+        ESP_LOGW(TAG, "No cached AP channel to find the relay on.");
+        return &coap_transport;
+    }
+
+    // Only the report itself fits in a frame. This is also how we fall back
+    // when the relay doesn't ack, because the reading goes in the backlog.
+    if (backlog_count() > 0) {
+        ESP_LOGW(TAG, "Sending the backlog straight to the controller.");
+        return &coap_transport;
+    }
+
+#if LOOPBACK_ESPNOW
+    return &loopback_transport;
+#else
+    return &espnow_transport;
+#endif // LOOPBACK_ESPNOW
+}
+
+/**
+ * Start whichever transport suits the current config.
+ *
+ * @return true if we're ready to send.
+ * @return false if we aren't.
+ */
+static bool start_transport(void)
+{
+    if (!is_config_valid(&current_config)) {
+        ESP_LOGE(TAG, "invalid config, not starting wifi");
+        return false;
+    }
+
+    transport = pick_transport();
+    ESP_LOGI(TAG, "Reporting over %s.", transport->name);
+
+    return transport->start();
+}
+
+/**
+ * Send our report over the transport that was started.
+ *
+ * @return true if it was delivered.
+ * @return false if it wasn't.
+ */
+static bool send_report(void)
+{
+    size_t length = format_report(coap_payload, transport->max_length);
+
+    if (!transport->send(coap_payload, length)) {
+        backlog_release();
+        return false;
+    }
+
+    backlog_commit();
+    return true;
+}
+
+/**
+ * Tell whoever sent a command that it's done.
+ *
+ * @param command [in] The command.
+ * @param done    [in] DONE_* bits saying how it went.
+ */
+static void command_done(const wifi_command_t *command, uint32_t done)
+{
+    if (command->requester != NULL) {
+        xTaskNotify(command->requester, done, eSetBits);
+    }
+}
+
+/**
+ * Handle one command from the queue.
+ *
+ * @param command [in] The command.
+ */
+static void handle_command(const wifi_command_t *command)
+{
+    switch(command->type) {
+        case WIFI_CMD_START:
+            if (wifi_state == WIFI_STATE_CONNECTED ||
+                wifi_state == WIFI_STATE_RADIO) {
+                ESP_LOGI(TAG, "already connected");
+                command_done(command, DONE_CONNECTED);
+                break;
+            }
+            // If the last attempt failed, WiFi is still started - stop it
+            // so we can start it again.
+            disconnect_wifi();
+            command_done(command,
+                         start_transport() ? DONE_CONNECTED : DONE_FAILED);
+            break;
+        case WIFI_CMD_STOP:
+            // No extraneous checks here, because disconnect_wifi() does
+            // nothing if it's already off.
+            disconnect_wifi();
+            command_done(command, DONE_OFF);
+            break;
+        case WIFI_CMD_STOP_FAST:
+            abandon_wifi();
+            command_done(command, DONE_OFF);
+            break;
+        case WIFI_CMD_RECONFIGURE:
+            // If it's stopping, we're about to deep sleep, so reconnecting
+            // would only waste an association and race the sleep. The next
+            // start picks up the new config anyway.
+            if (wifi_state != WIFI_STATE_OFF &&
+                wifi_state != WIFI_STATE_STOPPING) {
+                ESP_LOGI(TAG, "network config changed, reconnecting");
+                disconnect_wifi();
+                start_transport();
+            }
+            else {
+                ESP_LOGI(TAG, "network config changed, will use it "
+                              "when wifi next starts");
+            }
+            break;
+        case WIFI_CMD_SEND_TEMP:
+            // Anything observing us gets it too, whether it's changed or not,
+            // so it knows we're still here.
+            coap_server_update(true);
+
+            if (wifi_state != WIFI_STATE_CONNECTED &&
+                wifi_state != WIFI_STATE_RADIO) {
+                ESP_LOGE(TAG, "Not connected, can't send temperature");
+                backlog_push(get_last_temp());
+                command_done(command, DONE_NOT_SENT);
+            }
+            else if (send_report()) {
+                ESP_LOGI(TAG, "Temperature sent successfully");
+                command_done(command, DONE_SENT);
+            }
+            else {
+                // Kept here rather than by the sender, because only we know
+                // for sure it didn't get there, even if they gave up
+                // waiting.
+                ESP_LOGE(TAG, "Temperature sending failed");
+                backlog_push(get_last_temp());
+                command_done(command, DONE_NOT_SENT);
+            }
+            break;
+        case WIFI_CMD_NOTIFY:
+            coap_server_update(false);
+            break;
+        default:
+            ESP_LOGE(TAG, "Unknown command: %d", command->type);
+            break;
+    }
+}
+
 /**
  * WiFi task.
  *
- * This basically just sleeps until it gets a message telling it to do
- * something.
+ * This basically just sleeps until it gets a command telling it to do
+ * something. Commands are handled one at a time, in order, so each one sees
+ * WiFi in a settled state.
  *
  * @param pvParameters Parameters for the function (unused)
  */
 static void wifi_task(void *pvParameters)
 {
-    uint8_t message;
+    wifi_command_t command;
+    TickType_t wait;
 
     // basic wifi init (without configuration)
     wifi_init();
 
     while(true) {
-        if (xQueueReceive(wifi_queue, &message, portMAX_DELAY) == pdTRUE) {
-            switch(message) {
-                case WIFI_START:
-                    // TODO: Add some blinkenlights feedback here?
-                    if (is_config_valid(&current_config)) {
-                        ESP_LOGI(TAG, "wifi config looks valid, connecting");
-                        connect_wifi();
-                    }
-                    else {
-                        ESP_LOGE(TAG, "invalid config, not connecting to wifi");
-                    }
-                    break;
-                case WIFI_STOP:
-                    // No extraneous checks here, because the disconnect WiFi
-                    // function checks extensively to not double-free something.
-                    disconnect_wifi();
-                    break;
-                case WIFI_SEND_TEMP:
-                    if (coap_send_temperature()) {
-                        ESP_LOGI(TAG, "Temperature sent successfully");
-                    }
-                    else {
-                        ESP_LOGE(TAG, "Temperature sending failed");
-                    }
-                    break;
-                default:
-                    ESP_LOGE(TAG, "Unknown command: %d", message);
-                    break;
+        // While we're serving CoAP or relaying, we can't just block waiting
+        // for a command - we check for one, then get on with those for a bit.
+        if (coap_server_running()) {
+            wait = 0;
+        }
+        else if (relaying) {
+            wait = COAP_SERVER_POLL_MS / portTICK_PERIOD_MS;
+        }
+        else {
+            wait = portMAX_DELAY;
+        }
+
+        if (xQueueReceive(wifi_queue, &command, wait) == pdTRUE) {
+            handle_command(&command);
+        }
+        else {
+            // No commands; serve CoAP and relay if we are, otherwise go back
+            // and wait.
+            coap_server_run(COAP_SERVER_POLL_MS);
+            if (relaying) {
+                relay_forward();
             }
         }
-        // else we didn't get an item from the queue, just go back and wait.
     }
 }
 
-void wifi_enable(void)
+/**
+ * Queue a command for the WiFi task.
+ *
+ * @param type      [in] What to do.
+ * @param done      [in] The DONE_* bits it can finish with, which are cleared
+ *                       so that we only see this command finish. 0 if nobody
+ *                       is going to wait for it.
+ */
+static void send_command(wifi_command_type_t type, uint32_t done)
 {
-    uint8_t message = WIFI_START;
+    wifi_command_t command = {
+        .type = type,
+        .requester = NULL,
+    };
+    uint32_t pending = 0;
+
+    if (done != 0) {
+        // Keep anything else that's already finished, but forget any earlier
+        // result for this.
+        xTaskNotifyWait(0, UINT32_MAX, &pending, 0);
+        done_bits = (done_bits | pending) & ~done;
+        command.requester = xTaskGetCurrentTaskHandle();
+    }
 
-    xQueueSend(wifi_queue, &message, portMAX_DELAY);
+    xQueueSend(wifi_queue, &command, portMAX_DELAY);
 }
 
-void wifi_disable(void)
+/**
+ * Wait for the WiFi task to finish a command we sent.
+ *
+ * @param done       [in] The DONE_* bits to wait for - any one will do.
+ * @param timeout_ms [in] How long to wait.
+ *
+ * @return Whichever of the bits arrived, which are then forgotten.
+ * @return 0 on timeout.
+ */
+static uint32_t wait_for_done(uint32_t done, uint32_t timeout_ms)
 {
-    uint8_t message = WIFI_STOP;
+    TickType_t start = xTaskGetTickCount();
+    TickType_t timeout = timeout_ms / portTICK_PERIOD_MS;
+    TickType_t elapsed;
+    uint32_t pending;
+    uint32_t result;
+
+    while ((done_bits & done) == 0) {
+        elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= timeout) {
+            return 0;
+        }
 
-    xQueueSend(wifi_queue, &message, portMAX_DELAY);
+        pending = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &pending, timeout - elapsed);
+        done_bits |= pending;
+    }
+
+    result = done_bits & done;
+    done_bits &= ~done;
+    return result;
 }
 
-void wifi_restart(void)
+void wifi_enable(void)
 {
-    // This just submits both items to the message queue, so they'll be
-    // processed in order.
+    send_command(WIFI_CMD_START, DONE_CONNECTED | DONE_FAILED);
+}
 
-    uint8_t message = WIFI_STOP;
+void wifi_disable(void)
+{
+    send_command(WIFI_CMD_STOP, DONE_OFF);
+}
 
-    xQueueSend(wifi_queue, &message, portMAX_DELAY);
+void wifi_disable_fast(void)
+{
+    send_command(WIFI_CMD_STOP_FAST, DONE_OFF);
+}
 
-    message = WIFI_START;
+void wifi_notify_temperature(void)
+{
+    send_command(WIFI_CMD_NOTIFY, 0);
+}
 
-    xQueueSend(wifi_queue, &message, portMAX_DELAY);
+void wifi_reconfigure(void)
+{
+    // This comes from the console, which doesn't wait for it.
+    send_command(WIFI_CMD_RECONFIGURE, 0);
 }
 
 /**
@@ -644,72 +1576,54 @@ void wifi_restart(void)
  */
 void wifi_send_temperature(void)
 {
-    uint8_t message = WIFI_SEND_TEMP;
-
-    xQueueSend(wifi_queue, &message, portMAX_DELAY);
+    send_command(WIFI_CMD_SEND_TEMP, DONE_SENT | DONE_NOT_SENT);
 }
 
 void start_wifi(void)
 {
-    xTaskCreate(wifi_task, "wifi", 5 * 1024, NULL, WIFI_TASK_PRIORITY, NULL);
+    static StackType_t stack[WIFI_TASK_STACK_SIZE];
+    static StaticTask_t tcb;
+
+    wifi_task_handle = xTaskCreateStatic(wifi_task, "wifi",
+                                         WIFI_TASK_STACK_SIZE, NULL,
+                                         WIFI_TASK_PRIORITY, stack, &tcb);
+    stacks_watch(STACK_WIFI, wifi_task_handle, WIFI_TASK_STACK_SIZE);
 }
 
 bool wait_for_wifi_connected(void)
 {
-    EventBits_t bits;
-
-    bits = xEventGroupWaitBits(
-            wifi_status,
-            WIFI_CONNECTED,
-            pdFALSE,
-            pdFALSE,
-            WIFI_CONNECT_WAIT_TIMEOUT_S * 1000 / portTICK_PERIOD_MS);
-
-    if (bits & WIFI_CONNECTED) {
-        // bit set
-        return true;
-    }
-    else {
-        // timeout
-        return false;
-    }
+    // Twice, because if the AP info cache is stale, bring_up_wifi() tries
+    // again without it.
+    return wait_for_done(DONE_CONNECTED | DONE_FAILED,
+                         wake_budget_remaining_ms(
+                             2 * WIFI_CONNECT_WAIT_TIMEOUT_S * 1000)) ==
+           DONE_CONNECTED;
 }
 
 bool wait_for_wifi_off(void)
 {
-    EventBits_t bits;
+    return wait_for_done(DONE_OFF,
+                         wake_budget_remaining_ms(
+                             WIFI_DOWN_WAIT_TIMEOUT_S * 1000)) != 0;
+}
 
-    bits = xEventGroupWaitBits(
-            wifi_status,
-            WIFI_OFF,
-            pdFALSE,
-            pdFALSE,
-            WIFI_DOWN_WAIT_TIMEOUT_S * 1000 / portTICK_PERIOD_MS);
+bool wait_for_sending_complete(void)
+{
+    uint32_t result = wait_for_done(DONE_SENT | DONE_NOT_SENT,
+                                    wake_budget_remaining_ms(
+                                        COAP_SEND_TIMEOUT_S * 1000 +
+                                        COAP_SEND_MARGIN_MS));
 
-    if (bits & WIFI_OFF) {
-        // bit set
-        return true;
-    }
-    else {
-        // timeout
-        return false;
-    }
+    last_send_ok = (result == DONE_SENT);
+    return result != 0;
 }
 
-bool wait_for_sending_complete(void)
+bool last_send_succeeded(void)
 {
-    EventBits_t bits;
-
-    bits = xEventGroupWaitBits(
-             wifi_status,
-             COAP_QUEUE_EMPTY,
-             pdFALSE,
-             pdFALSE,
-             COAP_SEND_TIMEOUT_S * 1000 / portTICK_PERIOD_MS);
- 
-    if (bits & COAP_QUEUE_EMPTY) {
-        // bit set
-        return true;
-    }
-    return false;
+    return last_send_ok;
+}
+
+const char *wifi_state_name(void)
+{
+    return state_names[wifi_state];
 }
@@ -6,6 +6,10 @@
 #ifndef __WIFI_H_
 #define __WIFI_H_
 
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
 /**
  * How long to wait for WiFi to be connected
  * In my system, this takes less than 5 seconds, so a 10 second timeout seems
@@ -20,11 +24,36 @@
  */
 #define WIFI_DOWN_WAIT_TIMEOUT_S 5
 
-enum wifi_messages {
-    WIFI_START,
-    WIFI_STOP,
-    WIFI_SEND_TEMP,
-};
+/**
+ * How long the fast shutdown waits for the deauth to go out.
+ *
+ * The driver sends it straight away when asked to disconnect, and tells us
+ * when it has, so this is only a bound in case it never does.
+ */
+#define WIFI_DEAUTH_WAIT_MS 100
+
+/**
+ * What the WiFi task can be told to do.
+ */
+typedef enum {
+    WIFI_CMD_START,         /**< Connect, if not already connected. */
+    WIFI_CMD_STOP,          /**< Disconnect and turn WiFi off. */
+    WIFI_CMD_STOP_FAST,     /**< Tell the AP we're leaving, and nothing
+                                 else. */
+    WIFI_CMD_RECONFIGURE,   /**< Reconnect with new config, if it's on. */
+    WIFI_CMD_SEND_TEMP,     /**< Send the last temperature reading. */
+    WIFI_CMD_NOTIFY,        /**< Tell observers about the last temperature
+                                 reading, if it's changed. */
+} wifi_command_type_t;
+
+/**
+ * A command for the WiFi task, as sent on wifi_queue.
+ */
+typedef struct {
+    wifi_command_type_t type;
+    /** Task to notify when it's done, or NULL if nobody is waiting. */
+    TaskHandle_t requester;
+} wifi_command_t;
 
 /**
  * Start our WiFi task.
@@ -34,6 +63,11 @@ void start_wifi(void);
 /**
  * Enable WiFi.
  *
+ * This, wifi_disable() and wifi_send_temperature() return straight away; the
+ * matching wait_for_*() function waits for the WiFi task to finish. Only one
+ * task should use them at a time. The waits give up early if the wake budget
+ * runs out first.
+ *
  * @note Only call once current_config is valid.
  */
 void wifi_enable(void);
@@ -44,22 +78,47 @@ void wifi_enable(void);
 void wifi_disable(void);
 
 /**
- * Disable then enable WiFi.
+ * Get WiFi ready for deep sleep as quickly as possible.
+ *
+ * This only sends the AP a deauth, so it doesn't keep us in its client table
+ * until it times us out, and leaves the radio on - deep sleep turns it off
+ * anyway. Wait for it with wait_for_wifi_off().
+ *
+ * @note Only call this right before deep sleep. If WiFi is wanted again
+ *       without a sleep, wifi_enable() will stop it properly first.
+ */
+void wifi_disable_fast(void);
+
+/**
+ * Apply a changed network config.
+ *
+ * If WiFi is up, it reconnects with the new config. If not, it's left alone,
+ * and the new config is used the next time it comes up. Because this goes
+ * through the WiFi task, it can't collide with WiFi being shut down for sleep.
  *
  * @note Only call once current_config is valid.
  */
-void wifi_restart(void);
+void wifi_reconfigure(void);
 
 /**
- * Send last temperature reading.
+ * Send last temperature reading. If it doesn't get through, it's kept in the
+ * backlog.
  */
 void wifi_send_temperature(void);
 
+/**
+ * Tell anything observing us about the last temperature reading, if it's
+ * changed, without sending a report.
+ *
+ * This doesn't wait, and does nothing unless we're on mains power.
+ */
+void wifi_notify_temperature(void);
+
 /**
  * Wait for WiFi to be connected
  *
  * @return true when WiFi is connected
- * @return false on timeout
+ * @return false if it failed to connect, or on timeout
  */
 bool wait_for_wifi_connected(void);
 
@@ -73,10 +132,28 @@ bool wait_for_wifi_off(void);
 
 /**
  * Wait for our message ot be sent.
+ *
+ * @note Only call this after wifi_send_temperature(). With nothing sent, it
+ *       waits for the whole timeout.
  * 
  * @return true if the message was sent.
  * @return false if we timed out.
  */
 bool wait_for_sending_complete(void);
 
+/**
+ * Check whether the controller accepted the last message we sent.
+ *
+ * @return true if it replied with success.
+ * @return false if it replied with an error or didn't reply.
+ */
+bool last_send_succeeded(void);
+
+/**
+ * Get the name of the state WiFi is in, for the console.
+ *
+ * @return The name, e.g. "connected".
+ */
+const char *wifi_state_name(void);
+
 #endif // __WIFI_H_
\ No newline at end of file